@@ -1,5 +1,9 @@
 #include <iostream>         // cout, cerr
 #include <cstdlib>          // EXIT_FAILURE
+#include <vector>           // vector
+#include <algorithm>        // min, max, copy, replace
+#include <string>           // string
+#include <sys/stat.h>       // stat
 #include <GL/glew.h>        // GLEW library
 #include <GLFW/glfw3.h>     // GLFW library
 #define STB_IMAGE_IMPLEMENTATION
@@ -53,6 +57,42 @@ namespace
     glm::vec2 gUVScale(5.0f, 5.0f);
     GLint gTexWrapMode = GL_REPEAT;
 
+    // Number of textures an animation cycles through, so the frame being
+    // uploaded is never the one the GPU may still be drawing from
+    const int ANIM_RING_SIZE = 3;
+
+    // Part of an animation canvas, in pixels, top-left origin
+    struct AnimRect
+    {
+        int x0, y0, x1, y1;
+    };
+
+    // Stores the GL data for a GIF playing on a ring of textures
+    struct GLAnimTexture
+    {
+        // Decoder, or nullptr if no animation is loaded
+        stbi_gif_anim* anim;
+        int width, height;
+        GLuint textureIds[ANIM_RING_SIZE];
+        // What each texture is missing compared to the latest frame
+        AnimRect pending[ANIM_RING_SIZE];
+        // Ring index of the texture holding the latest frame
+        int current;
+        // glfwGetTime() at which the next frame is due
+        double nextFrameTime;
+        // Dirty rows, flipped for OpenGL, on their way to the texture
+        std::vector<unsigned char> staging;
+    };
+    GLAnimTexture gAnimTexture = {};
+
+    // Directory to keep QOI copies of textures in (--texture-cache <dir>),
+    // or nullptr to always load the originals
+    const char* gTextureCacheDir = nullptr;
+
+    // GIF to play on the cube instead of its still texture (--anim-texture <gif>),
+    // or nullptr to keep the still one
+    const char* gAnimFilename = nullptr;
+
     // Shader programs
     GLuint gCubeProgramId;
     GLuint gLampProgramId;
@@ -103,8 +143,13 @@ void MouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset);
 void MouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
 void CreateMesh(GLMesh& mesh);
 void DestroyMesh(GLMesh& mesh);
+string TextureCache(const char* filename);
 bool CreateTexture(const char* filename, GLuint& textureId);
 void DestroyTexture(GLuint textureId);
+void SetTextureWrap(GLint mode);
+bool CreateAnimTexture(const char* filename, GLAnimTexture& tex);
+void UpdateAnimTexture(GLAnimTexture& tex, double time);
+void DestroyAnimTexture(GLAnimTexture& tex);
 void Render();
 bool CreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId);
 void DestroyShaderProgram(GLuint programId);
@@ -303,28 +348,16 @@ void main()
 );
 
 
-// Images are loaded with Y axis going down, but OpenGL's Y axis goes up, so let's flip it
-void flipImageVertically(unsigned char* image, int width, int height, int channels)
+int main(int argc, char* argv[])
 {
-    for (int j = 0; j < height / 2; ++j)
+    for (int i = 1; i + 1 < argc; i += 2)
     {
-        int index1 = j * width * channels;
-        int index2 = (height - 1 - j) * width * channels;
-
-        for (int i = width * channels; i > 0; --i)
-        {
-            unsigned char tmp = image[index1];
-            image[index1] = image[index2];
-            image[index2] = tmp;
-            ++index1;
-            ++index2;
-        }
+        if (string(argv[i]) == "--texture-cache")
+            gTextureCacheDir = argv[i + 1];
+        else if (string(argv[i]) == "--anim-texture")
+            gAnimFilename = argv[i + 1];
     }
-}
-
 
-int main(int argc, char* argv[])
-{
     if (!Start(argc, argv, &gWindow))
         return EXIT_FAILURE;
 
@@ -360,6 +393,10 @@ int main(int argc, char* argv[])
         return EXIT_FAILURE;
     }
 
+    // Load the animated texture if asked for; the cube keeps the still one without it
+    if (gAnimFilename && !CreateAnimTexture(gAnimFilename, gAnimTexture))
+        cout << "Failed to load animated texture " << gAnimFilename << ", using " << texFilename << endl;
+
     // tell opengl for each sampler to which texture unit it belongs to (only has to be done once)
     glUseProgram(gCubeProgramId);
 
@@ -382,6 +419,9 @@ int main(int argc, char* argv[])
         // -----
         ProcessInput(gWindow);
 
+        // Upload the animation's next frame if it's due
+        UpdateAnimTexture(gAnimTexture, glfwGetTime());
+
         // Render this frame
         Render();
 
@@ -393,6 +433,7 @@ int main(int argc, char* argv[])
 
     // Release texture
     DestroyTexture(gTextureId);
+    DestroyAnimTexture(gAnimTexture);
 
     // Release shader programs
     DestroyShaderProgram(gCubeProgramId);
@@ -471,10 +512,7 @@ void ProcessInput(GLFWwindow* window)
 
     if (glfwGetKey(window, GLFW_KEY_1) == GLFW_PRESS && gTexWrapMode != GL_REPEAT)
     {
-        glBindTexture(GL_TEXTURE_2D, gTextureId);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glBindTexture(GL_TEXTURE_2D, 0);
+        SetTextureWrap(GL_REPEAT);
 
         gTexWrapMode = GL_REPEAT;
 
@@ -482,10 +520,7 @@ void ProcessInput(GLFWwindow* window)
     }
     else if (glfwGetKey(window, GLFW_KEY_2) == GLFW_PRESS && gTexWrapMode != GL_MIRRORED_REPEAT)
     {
-        glBindTexture(GL_TEXTURE_2D, gTextureId);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_MIRRORED_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_MIRRORED_REPEAT);
-        glBindTexture(GL_TEXTURE_2D, 0);
+        SetTextureWrap(GL_MIRRORED_REPEAT);
 
         gTexWrapMode = GL_MIRRORED_REPEAT;
 
@@ -493,10 +528,7 @@ void ProcessInput(GLFWwindow* window)
     }
     else if (glfwGetKey(window, GLFW_KEY_3) == GLFW_PRESS && gTexWrapMode != GL_CLAMP_TO_EDGE)
     {
-        glBindTexture(GL_TEXTURE_2D, gTextureId);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glBindTexture(GL_TEXTURE_2D, 0);
+        SetTextureWrap(GL_CLAMP_TO_EDGE);
 
         gTexWrapMode = GL_CLAMP_TO_EDGE;
 
@@ -504,13 +536,7 @@ void ProcessInput(GLFWwindow* window)
     }
     else if (glfwGetKey(window, GLFW_KEY_4) == GLFW_PRESS && gTexWrapMode != GL_CLAMP_TO_BORDER)
     {
-        float color[] = { 1.0f, 0.0f, 1.0f, 1.0f };
-        glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, color);
-
-        glBindTexture(GL_TEXTURE_2D, gTextureId);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-        glBindTexture(GL_TEXTURE_2D, 0);
+        SetTextureWrap(GL_CLAMP_TO_BORDER);
 
         gTexWrapMode = GL_CLAMP_TO_BORDER;
 
@@ -672,7 +698,10 @@ void Render()
 
     // bind textures on corresponding texture units
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureId);
+    if (gAnimTexture.anim)
+        glBindTexture(GL_TEXTURE_2D, gAnimTexture.textureIds[gAnimTexture.current]);
+    else
+        glBindTexture(GL_TEXTURE_2D, gTextureId);
 
     // Draws the triangles
     glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices);
@@ -1228,15 +1257,73 @@ void DestroyMesh(GLMesh& mesh)
 }
 
 
+/*Make sure an image has an up-to-date QOI copy in the cache directory, if there is one; returns the file to load*/
+string TextureCache(const char* filename)
+{
+    // QOI decodes several times faster than PNG, so images are converted once
+    // and loaded from the copy until the original changes
+    if (!gTextureCacheDir)
+        return filename;
+    // name the copy after the whole path, so images in different folders don't collide
+    string cacheName = filename;
+    replace(cacheName.begin(), cacheName.end(), '/', '_');
+    replace(cacheName.begin(), cacheName.end(), '\\', '_');
+    replace(cacheName.begin(), cacheName.end(), ':', '_');
+    cacheName = string(gTextureCacheDir) + "/" + cacheName + ".qoi";
+    struct stat source, cache;
+    if (stat(filename, &source) != 0)
+        return filename;
+    if (stat(cacheName.c_str(), &cache) == 0 && cache.st_mtime >= source.st_mtime)
+        return cacheName;
+
+    int width, height, channels;
+    unsigned char* pixels = stbi_load(filename, &width, &height, &channels, 0);
+    if (!pixels)
+        return filename;
+    bool cached = false;
+    if (channels == 3 || channels == 4)
+    {
+        cached = stbi_qoi_write(cacheName.c_str(), pixels, width, height, channels) != 0;
+        if (!cached)
+            cout << "Could not write texture cache " << cacheName << endl;
+    }
+    stbi_image_free(pixels);
+    return cached ? cacheName : string(filename);
+}
+
+
 /*Generate and load the texture*/
-bool CreateTexture(const char* filename, GLuint& textureId)
+bool CreateTexture(const char* imageFilename, GLuint& textureId)
 {
+    string source = TextureCache(imageFilename);
+    const char* filename = source.c_str();
+
     int width, height, channels;
-    unsigned char* image = stbi_load(filename, &width, &height, &channels, 0);
-    if (image)
+    if (!stbi_info(filename, &width, &height, &channels))
+        return false;
+    if (channels != 3 && channels != 4)
     {
-        flipImageVertically(image, width, height, channels);
+        cout << "Not implemented to handle image with " << channels << " channels" << endl;
+        return false;
+    }
 
+    // Decode straight into a pixel unpack buffer. Rows are padded to GL's default
+    // 4-byte unpack alignment, and written bottom row first since images are
+    // loaded with the Y axis going down while OpenGL's goes up.
+    int stride = (width * channels + 3) & ~3;
+    GLuint pbo;
+    glGenBuffers(1, &pbo);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, (GLsizeiptr)stride * height, NULL, GL_STREAM_DRAW);
+    unsigned char* pixels = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, (GLsizeiptr)stride * height,
+        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    bool loaded = pixels &&
+        stbi_load_into(filename, &width, &height, &channels, channels, pixels + (size_t)stride * (height - 1), -stride, height);
+    if (pixels && !glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER))
+        loaded = false;
+
+    if (loaded)
+    {
         glGenTextures(1, &textureId);
         glBindTexture(GL_TEXTURE_2D, textureId);
 
@@ -1247,27 +1334,22 @@ bool CreateTexture(const char* filename, GLuint& textureId)
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
+        // The upload is sourced from the bound pixel unpack buffer
         if (channels == 3)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-        else if (channels == 4)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, (void*)0);
         else
-        {
-            cout << "Not implemented to handle image with " << channels << " channels" << endl;
-            return false;
-        }
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, (void*)0);
 
         glGenerateMipmap(GL_TEXTURE_2D);
 
-        stbi_image_free(image);
         // Unbind the texture
         glBindTexture(GL_TEXTURE_2D, 0);
-
-        return true;
     }
 
-    // Error loading the image
-    return false;
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glDeleteBuffers(1, &pbo);
+
+    return loaded;
 }
 
 
@@ -1277,6 +1359,139 @@ void DestroyTexture(GLuint textureId)
 }
 
 
+/*Set the wrap mode of the cube's textures: the still one and every texture in the animation ring*/
+void SetTextureWrap(GLint mode)
+{
+    std::vector<GLuint> textureIds(1, gTextureId);
+    if (gAnimTexture.anim)
+        textureIds.insert(textureIds.end(), gAnimTexture.textureIds, gAnimTexture.textureIds + ANIM_RING_SIZE);
+
+    float color[] = { 1.0f, 0.0f, 1.0f, 1.0f };
+    for (GLuint textureId : textureIds)
+    {
+        glBindTexture(GL_TEXTURE_2D, textureId);
+        if (mode == GL_CLAMP_TO_BORDER)
+            glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, color);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, mode);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, mode);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+
+/*Open a GIF and create the ring of textures it plays on*/
+bool CreateAnimTexture(const char* filename, GLAnimTexture& tex)
+{
+    int width, height;
+    stbi_gif_anim* anim = stbi_gif_anim_open(filename, &width, &height);
+    if (!anim)
+        return false;
+
+    tex.anim = anim;
+    tex.width = width;
+    tex.height = height;
+    tex.current = 0;
+    tex.nextFrameTime = 0.0;
+
+    // Storage only; every texture starts out missing the whole canvas. There
+    // are no mipmaps, so a frame is a single sub-image upload
+    glGenTextures(ANIM_RING_SIZE, tex.textureIds);
+    for (int i = 0; i < ANIM_RING_SIZE; ++i)
+    {
+        glBindTexture(GL_TEXTURE_2D, tex.textureIds[i]);
+        glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, width, height);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        tex.pending[i] = { 0, 0, width, height };
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // Show the first frame straight away
+    UpdateAnimTexture(tex, glfwGetTime());
+    return true;
+}
+
+
+/*Decode the next frame once it's due and upload it to the next texture in the ring*/
+void UpdateAnimTexture(GLAnimTexture& tex, double time)
+{
+    if (!tex.anim || time < tex.nextFrameTime)
+        return;
+
+    // Loop back to the start at the end of the animation
+    stbi_gif_frame frame;
+    int result = stbi_gif_anim_next(tex.anim, &frame);
+    if (result == 0)
+    {
+        stbi_gif_anim_rewind(tex.anim);
+        result = stbi_gif_anim_next(tex.anim, &frame);
+    }
+    if (result != 1)
+    {
+        // Keep showing the last good frame
+        cout << "Animated texture stopped: " << stbi_failure_reason() << endl;
+        tex.nextFrameTime = 1e300;
+        return;
+    }
+
+    // Every texture now also lags behind by what this frame changed
+    for (int i = 0; i < ANIM_RING_SIZE; ++i)
+    {
+        AnimRect& r = tex.pending[i];
+        if (r.x0 >= r.x1 || r.y0 >= r.y1)
+            r = { frame.x0, frame.y0, frame.x1, frame.y1 };
+        else
+        {
+            r.x0 = std::min(r.x0, frame.x0);
+            r.y0 = std::min(r.y0, frame.y0);
+            r.x1 = std::max(r.x1, frame.x1);
+            r.y1 = std::max(r.y1, frame.y1);
+        }
+    }
+
+    // Bring the next texture up to date with one sub-image upload. Its rows
+    // go bottom first, since OpenGL's Y axis goes up
+    int next = (tex.current + 1) % ANIM_RING_SIZE;
+    AnimRect& r = tex.pending[next];
+    if (r.x0 < r.x1 && r.y0 < r.y1)
+    {
+        int w = r.x1 - r.x0;
+        int h = r.y1 - r.y0;
+        tex.staging.resize((size_t)w * h * 4);
+        for (int y = 0; y < h; ++y)
+        {
+            const unsigned char* src = frame.pixels + ((size_t)(r.y1 - 1 - y) * tex.width + r.x0) * 4;
+            std::copy(src, src + (size_t)w * 4, tex.staging.begin() + (size_t)y * w * 4);
+        }
+
+        glBindTexture(GL_TEXTURE_2D, tex.textureIds[next]);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, r.x0, tex.height - r.y1, w, h, GL_RGBA, GL_UNSIGNED_BYTE, tex.staging.data());
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+    r = { 0, 0, 0, 0 };
+    tex.current = next;
+
+    // Delays are in 1/100ths of a second; like browsers, treat the very short
+    // ones as 1/10th. Don't try to catch up after a stall
+    double delay = (frame.delay < 2 ? 10 : frame.delay) / 100.0;
+    tex.nextFrameTime += delay;
+    if (tex.nextFrameTime < time)
+        tex.nextFrameTime = time + delay;
+}
+
+
+void DestroyAnimTexture(GLAnimTexture& tex)
+{
+    if (!tex.anim)
+        return;
+    glDeleteTextures(ANIM_RING_SIZE, tex.textureIds);
+    stbi_gif_anim_close(tex.anim);
+    tex.anim = nullptr;
+}
+
+
 // Implements the UCreateShaders function
 bool CreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId)
 {
@@ -31,6 +31,7 @@ GIF (*comp always reports as 4-channel)
 HDR (radiance rgbE format)
 PIC (Softimage PIC)
 PNM (PPM and PGM binary only)
+QOI (decoder, plus an encoder for caching textures)
 
 Animated GIF still needs a proper API, but here's one way to do it:
 http://gist.github.com/urraka/685d9a6340b26b830d49
@@ -89,6 +90,7 @@ STBI_NO_GIF
 STBI_NO_HDR
 STBI_NO_PIC
 STBI_NO_PNM   (.ppm and .pgm)
+STBI_NO_QOI
 
 - You can request *only* certain decoders and suppress all other ones
 (this will be more forward-compatible, as addition of new decoders
@@ -103,6 +105,7 @@ STBI_ONLY_GIF
 STBI_ONLY_HDR
 STBI_ONLY_PIC
 STBI_ONLY_PNM   (.ppm and .pgm)
+STBI_ONLY_QOI
 
 Note that you can define multiples of these, and you will get all
 of them ("only x" and "only y" is interpreted to mean "only x&y").
@@ -295,6 +298,14 @@ publish, and distribute this file as you see fit.
 // The three functions you must define are "read" (reads some bytes of data),
 // "skip" (skips some bytes of data), "eof" (reports if the stream is at the end).
 //
+// Functions that take a filename memory-map the file (mmap on Unix-likes,
+// a file mapping on Windows) and decode straight from the mapping, as
+// stbi_load_from_memory would, so there's no buffering or rewinding. They
+// fall back to stdio for anything that can't be mapped, such as pipes or
+// empty files. Define STBI_NO_MMAP to always use stdio. The file must not be
+// truncated while it's being decoded. Functions that take a FILE* still
+// read through it.
+//
 // ===========================================================================
 //
 // SIMD support
@@ -325,6 +336,153 @@ publish, and distribute this file as you see fit.
 //
 // ===========================================================================
 //
+// Multithreading
+//
+// Define STBI_THREADS before the implementation to let decoders split large
+// images across threads (Win32 threads on Windows, pthreads elsewhere, so
+// link with -pthread). Currently this covers reconstruction of interlaced
+// PNGs, the IDCT of progressive JPEGs, color conversion of all JPEGs, and
+// entropy decoding of baseline JPEGs that have restart markers and are
+// loaded from memory. Threads are started per decode; stbi_set_thread_count()
+// limits how many, up to STBI_MAX_THREADS (default 16). Output is identical
+// either way.
+//
+// stbi_info_batch() and stbi_load_batch() work through a whole list of
+// files or memory blocks instead, one image per thread at a time, and pass
+// each result to your callback as soon as it is ready. Each thread decodes
+// into its own reset-per-image stbi_arena, so after the first few images a
+// batch hardly touches the heap; the flip side is that the pixels handed
+// to the callback are gone once it returns, so copy or upload them there.
+// The callback runs on several threads at once, and the decodes inside a
+// batch don't start threads of their own. Batches rely on STBI_THREAD_LOCAL
+// working; without STBI_THREADS they run on the calling thread.
+//
+// ===========================================================================
+//
+// Per-call options
+//
+// The stbi_set_* / stbi_*_gamma / stbi_*_scale functions change settings for
+// every decode in the process. The stbi_load*_ex functions instead take an
+// stbi_load_options holding all of them, plus the desired channel count and
+// an allocator, so decodes on different threads can use different settings.
+// Start from stbi_load_options_init(), which copies the global settings.
+// After the call, options->failure_reason says why it failed, or is NULL.
+//
+// Options also have settings with no global equivalent: jpeg_scale set to
+// 2, 4 or 8 decodes JPEGs straight to that fraction of their size (rounded
+// up), using reduced IDCTs, which is much faster than decoding in full and
+// downsampling. The returned x and y are the reduced size.
+//
+// roi_x, roi_y, roi_w and roi_h, when roi_w and roi_h are positive, pick a
+// rectangle of the image (clipped to it, in the reduced size if jpeg_scale
+// is set) and return just that; x and y are its size. The decode goes
+// through the row streaming below and stops after the last row needed.
+// Baseline JPEGs skip the IDCT and color conversion outside the rectangle,
+// and skip whole restart intervals without entropy decoding them; PNGs only
+// finish the pixels inside it. A tile of a huge image costs a fraction of
+// a full decode, the more so the higher up it is. Flipping applies to the
+// returned rectangle, not to where it's taken from.
+//
+// ===========================================================================
+//
+// Custom allocators
+//
+// STBI_MALLOC and friends apply to every decode. To give a single decode its
+// own allocator -- say, one arena per worker thread -- fill in an
+// stbi_allocator and call one of the stbi_load_*_alloc functions. Every
+// allocation made while decoding, including the returned image, goes
+// through it; release the image through the same allocator, not with
+// stbi_image_free().
+//
+// stbi_arena is a ready-made bump allocator for this. Give it a block of
+// memory, or NULL to let it manage its own: an arena that owns its memory
+// grows on reset to fit the most it has been asked for, so after decoding
+// the largest image once it never touches the heap again. In reset-per-image
+// mode the arena is reset at the start of every decode, so each image stays
+// valid until the next one is loaded through it. An arena must only be used
+// by one thread at a time.
+//
+// ===========================================================================
+//
+// Zero-copy views
+//
+// Uncompressed PNM, BMP and TGA files usually hold their pixels exactly as
+// stbi_load would return them, give or take channel order and row order.
+// stbi_view() maps such a file and returns an stbi_image_view pointing
+// straight at those pixels: 8-bit P5/P6 PNM, 24-bit and 32-bit BGR(A) BMP,
+// and raw (not RLE, not paletted) 8/16/24/32-bit TGA. Set
+// STBI_VIEW_ALLOW_BGR and STBI_VIEW_ALLOW_BOTTOM_UP in 'flags' to accept the
+// layouts BMP and TGA normally use; the view then reports them through
+// 'bgr' and a negative 'stride'. desired_channels must be 0 or match the
+// file. Anything else -- other formats, conversions, truncated files -- is
+// decoded into a copy instead, top-down and in stbi_load's channel order;
+// 'channels' is what the copy holds, which for a PNG with a tRNS chunk is
+// one more than the file has. 'zero_copy' tells which happened. The view
+// ignores stbi_set_flip_vertically_on_load.
+//
+// Call stbi_view_free() when done. A zero-copy view from a file keeps the
+// file mapped until then, and the file must not be modified meanwhile. With
+// stbi_view_from_memory() the view points into your buffer instead.
+//
+// ===========================================================================
+//
+// Streaming rows
+//
+// stbi_load_rows() and friends decode an image into callbacks instead of a
+// buffer: 'begin' gets the size once, then 'rows' gets runs of converted
+// rows, top to bottom, as they're decoded. Baseline JPEG, non-interlaced PNG
+// and BMP are decoded with a bounded amount of memory this way -- a few MCU
+// rows, two scanlines, or a band of about STBI_ROWS_BAND_BYTES. Everything
+// else (progressive JPEG, interlaced PNG, the other formats) is decoded in
+// full first and then sent, so it works the same, just without the saving.
+// Rows are numbered as they're stored and stbi_set_flip_vertically_on_load
+// is ignored; a bottom-up BMP arrives a band at a time, last band first.
+// Either callback can return 0 to stop, which makes the load fail with
+// "stopped". With a region in the options (see Per-call options), only that
+// rectangle is sent, as if it were the whole image.
+//
+// ===========================================================================
+//
+// Animated GIFs
+//
+// stbi_load() only returns the first frame of a GIF. To play the rest, open
+// it with stbi_gif_anim_open() and call stbi_gif_anim_next() once per frame.
+// Frames are drawn onto one RGBA canvas that's kept between calls, and each
+// one comes with the rectangle that changed since the one before (its own,
+// plus whatever the last frame's disposal cleared) so you can update just
+// that part of a texture. stbi_gif_anim_rewind() starts again from the top.
+//
+// ===========================================================================
+//
+// QOI
+//
+// QOI is a simple lossless format that decodes several times faster than
+// PNG, at a somewhat larger size. Besides loading it like any other format,
+// stb_image can write it: stbi_qoi_encode() turns 3- or 4-channel pixels
+// into a QOI file in memory, and stbi_qoi_write() saves one to disk. That
+// makes it a good cache for textures that are converted once and loaded
+// many times.
+//
+// ===========================================================================
+//
+// Decoder statistics
+//
+// Define STBI_STATS (wherever the header is included, since it adds
+// functions) to have the decoders count what they do: bytes read, inflate
+// output, zlib codes too long for the fast Huffman table, output buffer
+// reallocations, PNG scanlines by filter type, JPEG MCUs and IDCTs, and
+// whole-image conversion passes, plus the time spent inflating, unfiltering,
+// decoding JPEG scans and converting. Call stbi_reset_stats() before a load
+// and stbi_get_stats() after it to get that load's numbers. They're kept per
+// thread; what a decode hands to other threads (see Multithreading) is added
+// to the calling thread's when it's done, with times summed, so they can
+// come to more than the wall-clock time. Where one stage drives another --
+// a PNG inflated through a small window is unfiltered as the window fills,
+// and streamed JPEG rows are converted as the scan goes -- the inner stage's
+// time counts toward both. Without STBI_STATS none of it is compiled in.
+//
+// ===========================================================================
+//
 // HDR image support   (disable by defining STBI_NO_HDR)
 //
 // stb_image now supports loading HDR images in general, and currently
@@ -380,6 +538,8 @@ publish, and distribute this file as you see fit.
 #include <stdio.h>
 #endif // STBI_NO_STDIO
 
+#include <stddef.h>
+
 #define STBI_VERSION 1
 
 enum
@@ -480,12 +640,257 @@ extern "C" {
 
 
     // get a VERY brief reason for failure
-    // NOT THREADSAFE
+    // this is per-thread where the compiler supports thread-local storage
+    // (see STBI_THREAD_LOCAL), otherwise NOT THREADSAFE
     STBIDEF const char *stbi_failure_reason(void);
 
     // free the loaded image -- this is just free()
     STBIDEF void     stbi_image_free(void *retval_from_stbi_load);
 
+    ////////////////////////////////////
+    //
+    // decoding into caller memory
+    //
+
+    // decode straight into dest, e.g. a mapped pixel buffer object: scanline j
+    // goes to dest + j*dest_stride, and a negative stride stores the image
+    // bottom-up. desired_channels works as above, 0 meaning the file's own
+    // count. fails (returning 0) rather than write past dest if a scanline
+    // needs more than |dest_stride| bytes or there are more than dest_rows of
+    // them; dest is left undefined on failure. JPEG, PNM and most 8-bit PNGs
+    // are written in place; other images are decoded and then copied in.
+    // stbi_set_flip_vertically_on_load is ignored; use a negative stride.
+    STBIDEF int      stbi_load_from_memory_into(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels, stbi_uc *dest, int dest_stride, int dest_rows);
+    STBIDEF int      stbi_load_from_callbacks_into(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *channels_in_file, int desired_channels, stbi_uc *dest, int dest_stride, int dest_rows);
+#ifndef STBI_NO_STDIO
+    STBIDEF int      stbi_load_into(char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, stbi_uc *dest, int dest_stride, int dest_rows);
+    STBIDEF int      stbi_load_from_file_into(FILE *f, int *x, int *y, int *channels_in_file, int desired_channels, stbi_uc *dest, int dest_stride, int dest_rows);
+#endif
+
+    ////////////////////////////////////
+    //
+    // per-call allocators
+    //
+
+    typedef struct
+    {
+        void *(*alloc)(void *user, size_t size);
+        void *(*resize)(void *user, void *p, size_t old_size, size_t new_size);
+        void  (*release)(void *user, void *p);
+        void  (*reset)(void *user);   // optional; called before each decode
+        void  *user;
+    } stbi_allocator;
+
+    STBIDEF stbi_uc *stbi_load_from_memory_alloc(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels, stbi_allocator const *allocator);
+    STBIDEF stbi_uc *stbi_load_from_callbacks_alloc(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *channels_in_file, int desired_channels, stbi_allocator const *allocator);
+#ifndef STBI_NO_STDIO
+    STBIDEF stbi_uc *stbi_load_alloc(char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, stbi_allocator const *allocator);
+    STBIDEF stbi_uc *stbi_load_from_file_alloc(FILE *f, int *x, int *y, int *channels_in_file, int desired_channels, stbi_allocator const *allocator);
+#endif
+
+    typedef struct
+    {
+        stbi_uc *base;
+        size_t   size, used, last;
+        size_t   high_water;        // the most any one reset period has needed
+        void    *overflow;          // heap blocks for requests that didn't fit
+        size_t   overflow_bytes;
+        int      owns_base, reset_per_image;
+    } stbi_arena;
+
+    // memory may be NULL, in which case the arena allocates (and grows) its own
+    STBIDEF void           stbi_arena_init(stbi_arena *arena, void *memory, size_t size, int reset_per_image);
+    STBIDEF void           stbi_arena_reset(stbi_arena *arena);
+    STBIDEF void           stbi_arena_free(stbi_arena *arena);
+    STBIDEF stbi_allocator stbi_arena_allocator(stbi_arena *arena);
+
+    ////////////////////////////////////
+    //
+    // per-call options
+    //
+
+    typedef struct
+    {
+        int   desired_channels;
+        int   flip_vertically;
+        int   unpremultiply;
+        int   convert_iphone_png_to_rgb;
+        float ldr_to_hdr_gamma, ldr_to_hdr_scale;
+        float hdr_to_ldr_gamma, hdr_to_ldr_scale;
+        stbi_allocator const *allocator;   // NULL for STBI_MALLOC etc.
+        void *png_inflate_buffer;           // see stbi_set_png_inflate_buffer
+        int   png_inflate_buffer_size;
+        int   jpeg_scale;                   // 2, 4 or 8 decode JPEGs at 1/jpeg_scale size
+        int   roi_x, roi_y, roi_w, roi_h;   // decode only this rectangle, if roi_w and roi_h are > 0
+        int   png_verify_checksums;         // see stbi_set_png_verify_checksums
+
+        const char *failure_reason;         // set by the call: NULL on success
+    } stbi_load_options;
+
+    // fill in the current global settings, so only the differences need setting
+    STBIDEF void     stbi_load_options_init(stbi_load_options *options);
+
+    STBIDEF stbi_uc *stbi_load_from_memory_ex(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, stbi_load_options *options);
+    STBIDEF stbi_uc *stbi_load_from_callbacks_ex(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *channels_in_file, stbi_load_options *options);
+#ifndef STBI_NO_STDIO
+    STBIDEF stbi_uc *stbi_load_ex(char const *filename, int *x, int *y, int *channels_in_file, stbi_load_options *options);
+    STBIDEF stbi_uc *stbi_load_from_file_ex(FILE *f, int *x, int *y, int *channels_in_file, stbi_load_options *options);
+#endif
+#ifndef STBI_NO_LINEAR
+    STBIDEF float   *stbi_loadf_from_memory_ex(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, stbi_load_options *options);
+    STBIDEF float   *stbi_loadf_from_callbacks_ex(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *channels_in_file, stbi_load_options *options);
+#ifndef STBI_NO_STDIO
+    STBIDEF float   *stbi_loadf_ex(char const *filename, int *x, int *y, int *channels_in_file, stbi_load_options *options);
+    STBIDEF float   *stbi_loadf_from_file_ex(FILE *f, int *x, int *y, int *channels_in_file, stbi_load_options *options);
+#endif
+#endif
+
+    ////////////////////////////////////
+    //
+    // zero-copy views
+    //
+
+    typedef struct
+    {
+        stbi_uc const *data;        // top-left pixel
+        int   x, y, channels;
+        int   stride;               // bytes from a row to the one below it; negative if stored bottom-up
+        int   bgr;                  // 3 and 4 channel pixels are stored B,G,R(,A)
+        int   zero_copy;            // data points into the file rather than a decoded copy
+
+        void *private_pixels;       // internal: the decoded copy, if any
+        void *private_map;          // internal: the file mapping, if any
+        int   private_map_len;
+    } stbi_image_view;
+
+    enum
+    {
+        STBI_VIEW_ALLOW_BGR = 1,        // accept BGR(A) pixels as stored
+        STBI_VIEW_ALLOW_BOTTOM_UP = 2   // accept rows stored bottom-up (negative stride)
+    };
+
+    STBIDEF int      stbi_view_from_memory(stbi_uc const *buffer, int len, int desired_channels, int flags, stbi_image_view *view);
+#ifndef STBI_NO_STDIO
+    STBIDEF int      stbi_view(char const *filename, int desired_channels, int flags, stbi_image_view *view);
+#endif
+    STBIDEF void     stbi_view_free(stbi_image_view *view);
+
+    ////////////////////////////////////
+    //
+    // batches
+    //
+
+    typedef struct
+    {
+        char const    *filename;        // a file, or NULL to use buffer and len
+        stbi_uc const *buffer;
+        int            len;
+    } stbi_batch_item;
+
+    typedef struct
+    {
+        int         ok;
+        int         x, y, channels_in_file;
+        stbi_uc    *pixels;             // NULL for info batches and on failure
+        const char *failure_reason;     // NULL on success
+    } stbi_batch_result;
+
+    // called once per item, on whichever thread handled it, in no particular
+    // order; 'pixels' is only valid until the callback returns
+    typedef void stbi_batch_callback(void *user, int index, stbi_batch_result const *result);
+
+    // both return how many items succeeded; options may be NULL for the
+    // current global settings, and its allocator is ignored
+    STBIDEF int      stbi_info_batch(stbi_batch_item const *items, int count, stbi_batch_callback *callback, void *user);
+    STBIDEF int      stbi_load_batch(stbi_batch_item const *items, int count, stbi_load_options const *options, stbi_batch_callback *callback, void *user);
+
+    ////////////////////////////////////
+    //
+    // row streaming
+    //
+
+    typedef struct
+    {
+        int(*begin)(void *user, int x, int y, int channels_in_file, int channels);     // may be NULL; return 0 to stop
+        int(*rows)(void *user, int y, int count, stbi_uc const *pixels, int stride);  // pixels are only valid during the call; return 0 to stop
+    } stbi_row_callbacks;
+
+    // all return 1 on success; options may be NULL for the current global settings
+    STBIDEF int      stbi_load_rows_from_memory(stbi_uc const *buffer, int len, stbi_load_options const *options, stbi_row_callbacks const *callbacks, void *user);
+    STBIDEF int      stbi_load_rows_from_callbacks(stbi_io_callbacks const *clbk, void *io_user, stbi_load_options const *options, stbi_row_callbacks const *callbacks, void *user);
+#ifndef STBI_NO_STDIO
+    STBIDEF int      stbi_load_rows(char const *filename, stbi_load_options const *options, stbi_row_callbacks const *callbacks, void *user);
+#endif
+
+#ifdef STBI_STATS
+    ////////////////////////////////////
+    //
+    // decoder statistics
+    //
+
+    typedef struct
+    {
+        size_t bytes_read;              // from the file or buffer
+        size_t inflate_bytes;           // zlib output
+        size_t huffman_slow_decodes;    // zlib codes too long for the fast table
+        size_t zexpand_reallocs;        // times the zlib output buffer had to grow
+        size_t png_filters[5];          // PNG scanlines by filter: none, sub, up, avg, paeth
+        size_t jpeg_mcus;               // a single block each in non-interleaved scans
+        size_t idct_blocks;
+        size_t conversion_passes;       // whole-image passes: channels, depth, palette, flip, ...
+        double inflate_seconds;
+        double unfilter_seconds;
+        double jpeg_scan_seconds;       // entropy decoding and IDCT
+        double convert_seconds;         // JPEG color conversion and the passes above
+    } stbi_stats;
+
+    // the totals for every decode on this thread since the last reset
+    STBIDEF void     stbi_get_stats(stbi_stats *stats);
+    STBIDEF void     stbi_reset_stats(void);
+#endif
+
+#ifndef STBI_NO_GIF
+    ////////////////////////////////////
+    //
+    // animated GIFs
+    //
+
+    typedef struct stbi_gif_anim stbi_gif_anim;
+
+    typedef struct
+    {
+        stbi_uc const *pixels;          // the whole canvas, RGBA; valid until the next call
+        int   x0, y0, x1, y1;           // the rectangle that changed since the last frame
+        int   delay;                    // how long to show it, in 1/100ths of a second
+        int   index;                    // 0 for the first frame
+    } stbi_gif_frame;
+
+    // both return NULL on failure; the buffer must outlive the animation
+    STBIDEF stbi_gif_anim *stbi_gif_anim_open_memory(stbi_uc const *buffer, int len, int *x, int *y);
+#ifndef STBI_NO_STDIO
+    STBIDEF stbi_gif_anim *stbi_gif_anim_open(char const *filename, int *x, int *y);
+#endif
+    // returns 1 with a frame, 0 after the last one, -1 on error
+    STBIDEF int      stbi_gif_anim_next(stbi_gif_anim *anim, stbi_gif_frame *frame);
+    STBIDEF void     stbi_gif_anim_rewind(stbi_gif_anim *anim);
+    STBIDEF void     stbi_gif_anim_close(stbi_gif_anim *anim);
+#endif
+
+#ifndef STBI_NO_QOI
+    ////////////////////////////////////
+    //
+    // QOI encoder, for caching decoded images
+    //
+
+    // comp is 3 or 4; pixels are packed rows, top to bottom. returns the
+    // file's bytes (free with stbi_image_free) and their count in *out_len,
+    // or NULL on failure
+    STBIDEF stbi_uc *stbi_qoi_encode(stbi_uc const *pixels, int x, int y, int comp, int *out_len);
+#ifndef STBI_NO_STDIO
+    STBIDEF int      stbi_qoi_write(char const *filename, stbi_uc const *pixels, int x, int y, int comp);
+#endif
+#endif
+
     // get image dimensions & components without fully decoding
     STBIDEF int      stbi_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp);
     STBIDEF int      stbi_info_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp);
@@ -507,9 +912,36 @@ extern "C" {
     // or just pass them through "as-is"
     STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert);
 
+    // check each PNG chunk's CRC-32 and the image data's Adler-32, failing
+    // with "bad CRC" or "bad adler32" if they don't match. Off by default;
+    // costs a few percent of decode time with PCLMULQDQ and SSSE3
+    STBIDEF void stbi_set_png_verify_checksums(int flag_true_if_should_verify);
+
     // flip the image vertically, so the first pixel in the output array is the bottom left
     STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip);
 
+    // number of threads a decode may use when the implementation is built
+    // with STBI_THREADS; 0 (the default) means one per processor, 1 keeps
+    // all work on the calling thread
+    STBIDEF void stbi_set_thread_count(int thread_count);
+
+    // PNG decoding inflates the image data into a scratch buffer of exactly
+    // stbi_png_inflate_size() bytes before unfiltering it. To reuse one buffer
+    // across many decodes, supply it here; it is used for any image it is large
+    // enough for, and the decoder allocates as usual otherwise. The buffer must
+    // stay valid until you pass NULL to go back to per-image allocations.
+    // Otherwise, images that inflate to more than STBI_PNG_STREAM_THRESHOLD
+    // bytes (default 1MB) skip the scratch buffer entirely and are unfiltered
+    // scanline by scanline through a small inflate window.
+    // stbi_png_inflate_size*() return 0 if the file isn't a PNG or its data
+    // inflates to more than INT_MAX bytes.
+    // NOT THREADSAFE
+    STBIDEF void stbi_set_png_inflate_buffer(void *buffer, int buffer_size);
+    STBIDEF int  stbi_png_inflate_size_from_memory(stbi_uc const *buffer, int len);
+#ifndef STBI_NO_STDIO
+    STBIDEF int  stbi_png_inflate_size(char const *filename);
+#endif
+
     // ZLIB client - used by PNG, available for other purposes
 
     STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen);
@@ -535,7 +967,7 @@ extern "C" {
 #if defined(STBI_ONLY_JPEG) || defined(STBI_ONLY_PNG) || defined(STBI_ONLY_BMP) \
   || defined(STBI_ONLY_TGA) || defined(STBI_ONLY_GIF) || defined(STBI_ONLY_PSD) \
   || defined(STBI_ONLY_HDR) || defined(STBI_ONLY_PIC) || defined(STBI_ONLY_PNM) \
-  || defined(STBI_ONLY_ZLIB)
+  || defined(STBI_ONLY_QOI) || defined(STBI_ONLY_ZLIB)
 #ifndef STBI_ONLY_JPEG
 #define STBI_NO_JPEG
 #endif
@@ -563,6 +995,9 @@ extern "C" {
 #ifndef STBI_ONLY_PNM
 #define STBI_NO_PNM
 #endif
+#ifndef STBI_ONLY_QOI
+#define STBI_NO_QOI
+#endif
 #endif
 
 #if defined(STBI_NO_PNG) && !defined(STBI_SUPPORT_ZLIB) && !defined(STBI_NO_ZLIB)
@@ -589,6 +1024,47 @@ extern "C" {
 #define STBI_ASSERT(x) assert(x)
 #endif
 
+// files opened by name are memory-mapped where the platform allows it
+#if !defined(STBI_NO_STDIO) && !defined(STBI_NO_MMAP) && (defined(_WIN32) || defined(__unix__) || defined(__APPLE__))
+#define STBI__MMAP
+#endif
+
+#if defined(_WIN32) && (defined(STBI_THREADS) || defined(STBI__MMAP) || defined(STBI_STATS))
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#define STBI__UNDEF_WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#define STBI__UNDEF_NOMINMAX
+#endif
+#include <windows.h>
+#ifdef STBI__UNDEF_WIN32_LEAN_AND_MEAN
+#undef WIN32_LEAN_AND_MEAN
+#undef STBI__UNDEF_WIN32_LEAN_AND_MEAN
+#endif
+#ifdef STBI__UNDEF_NOMINMAX
+#undef NOMINMAX
+#undef STBI__UNDEF_NOMINMAX
+#endif
+#endif
+
+#if defined(STBI_THREADS) && !defined(_WIN32)
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#if defined(STBI_STATS) && !defined(_WIN32)
+#include <time.h>
+#endif
+
+#if defined(STBI__MMAP) && !defined(_WIN32)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 
 #ifndef _MSC_VER
 #ifdef __cplusplus
@@ -606,12 +1082,14 @@ typedef unsigned short stbi__uint16;
 typedef   signed short stbi__int16;
 typedef unsigned int   stbi__uint32;
 typedef   signed int   stbi__int32;
+typedef unsigned __int64 stbi__uint64;
 #else
 #include <stdint.h>
 typedef uint16_t stbi__uint16;
 typedef int16_t  stbi__int16;
 typedef uint32_t stbi__uint32;
 typedef int32_t  stbi__int32;
+typedef uint64_t stbi__uint64;
 #endif
 
 // should produce compiler error if size is wrong
@@ -651,6 +1129,20 @@ typedef unsigned char validate_uint32[sizeof(stbi__uint32) == 4 ? 1 : -1];
 #define STBI_REALLOC_SIZED(p,oldsz,newsz) STBI_REALLOC(p,newsz)
 #endif
 
+#ifndef STBI_THREAD_LOCAL
+#if defined(__cplusplus) && __cplusplus >= 201103L
+#define STBI_THREAD_LOCAL       thread_local
+#elif defined(__GNUC__)
+#define STBI_THREAD_LOCAL       __thread
+#elif defined(_MSC_VER)
+#define STBI_THREAD_LOCAL       __declspec(thread)
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_THREADS__)
+#define STBI_THREAD_LOCAL       _Thread_local
+#else
+#define STBI_THREAD_LOCAL
+#endif
+#endif
+
 // x86/x64 detection
 #if defined(__x86_64__) || defined(_M_X64)
 #define STBI__X64_TARGET
@@ -733,6 +1225,89 @@ static int stbi__sse2_available()
 #endif
 #endif
 
+// AVX2 kernels are compiled alongside the SSE2 ones, using per-function
+// target attributes on GCC/Clang, and only used if the CPU and OS support them
+#if defined(STBI_SSE2) && !defined(STBI_NO_AVX2)
+#if (defined(_MSC_VER) && _MSC_VER >= 1800) || defined(__clang__) || (defined(__GNUC__) && (__GNUC__ * 100 + __GNUC_MINOR__) >= 409)
+#define STBI__AVX2
+#include <immintrin.h>
+
+#ifdef _MSC_VER
+#define STBI__AVX2_TARGET
+
+static int stbi__avx2_available(void)
+{
+    int info[4];
+    __cpuid(info, 1);
+    // the OS has to save the YMM registers too (OSXSAVE, AVX, XCR0 bits 1-2)
+    if ((info[2] & 0x18000000) != 0x18000000 || (_xgetbv(0) & 6) != 6)
+        return 0;
+    __cpuidex(info, 7, 0);
+    return (info[1] >> 5) & 1;
+}
+#else
+#define STBI__AVX2_TARGET  __attribute__((target("avx2")))
+
+static int stbi__avx2_available(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+#endif
+#endif
+
+// likewise SSSE3, for byte shuffles
+#if defined(STBI_SSE2) && !defined(STBI_NO_SSSE3)
+#if (defined(_MSC_VER) && _MSC_VER >= 1500) || defined(__clang__) || (defined(__GNUC__) && (__GNUC__ * 100 + __GNUC_MINOR__) >= 409)
+#define STBI__SSSE3
+#include <tmmintrin.h>
+
+#ifdef _MSC_VER
+#define STBI__SSSE3_TARGET
+
+static int stbi__ssse3_available(void)
+{
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] >> 9) & 1;
+}
+#else
+#define STBI__SSSE3_TARGET  __attribute__((target("ssse3")))
+
+static int stbi__ssse3_available(void)
+{
+    return __builtin_cpu_supports("ssse3");
+}
+#endif
+#endif
+#endif
+
+// and PCLMULQDQ, for PNG CRCs
+#if defined(STBI_SSE2) && !defined(STBI_NO_PCLMUL) && !defined(STBI_NO_PNG)
+#if (defined(_MSC_VER) && _MSC_VER >= 1500) || defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 8)
+#define STBI__PCLMUL
+#include <wmmintrin.h>
+
+#ifdef _MSC_VER
+#define STBI__PCLMUL_TARGET
+
+static int stbi__pclmul_available(void)
+{
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] >> 1) & 1;
+}
+#else
+#define STBI__PCLMUL_TARGET  __attribute__((target("pclmul")))
+
+static int stbi__pclmul_available(void)
+{
+    return __builtin_cpu_supports("pclmul");
+}
+#endif
+#endif
+#endif
+
 // ARM NEON
 #if defined(STBI_NO_SIMD) && defined(STBI_NEON)
 #undef STBI_NEON
@@ -768,6 +1343,24 @@ typedef struct
 
     stbi_uc *img_buffer, *img_buffer_end;
     stbi_uc *img_buffer_original, *img_buffer_original_end;
+
+    // stbi_load_*_into: where the caller wants the pixels, else NULL
+    stbi_uc *dest;
+    int dest_stride, dest_rows;
+
+    // stbi_load_rows*: where to send rows as they're decoded, else NULL
+    stbi_row_callbacks const *rows;
+    void *rows_user;
+    stbi_uc *rows_buf;      // scratch for converting rows before they're sent
+    size_t rows_buf_len;
+    int roi_x0, roi_y0, roi_x1, roi_y1; // the part of the image sent, see stbi__rows_begin
+    int rows_left;          // rows of it not sent yet
+
+    // PNG chunk CRCs: while crc_from is set, every byte read from there on
+    // is folded into crc (see stbi__crc_fold)
+    stbi_uc *crc_from;
+    stbi__uint32 crc;
+    int crc_simd;
 } stbi__context;
 
 
@@ -780,6 +1373,9 @@ static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
     s->read_from_callbacks = 0;
     s->img_buffer = s->img_buffer_original = (stbi_uc *)buffer;
     s->img_buffer_end = s->img_buffer_original_end = (stbi_uc *)buffer + len;
+    s->dest = NULL;
+    s->rows = NULL;
+    s->crc_from = NULL;
 }
 
 // initialize a callback-based context
@@ -790,8 +1386,11 @@ static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *
     s->buflen = sizeof(s->buffer_start);
     s->read_from_callbacks = 1;
     s->img_buffer_original = s->buffer_start;
+    s->crc_from = NULL;
     stbi__refill_buffer(s);
     s->img_buffer_original_end = s->img_buffer_end;
+    s->dest = NULL;
+    s->rows = NULL;
 }
 
 #ifndef STBI_NO_STDIO
@@ -834,6 +1433,7 @@ static void stbi__rewind(stbi__context *s)
     // we only use it after doing 'test', which only ever looks at at most 92 bytes
     s->img_buffer = s->img_buffer_original;
     s->img_buffer_end = s->img_buffer_original_end;
+    s->crc_from = NULL;
 }
 
 enum
@@ -903,8 +1503,14 @@ static void    *stbi__pnm_load(stbi__context *s, int *x, int *y, int *comp, int
 static int      stbi__pnm_info(stbi__context *s, int *x, int *y, int *comp);
 #endif
 
-// this is not threadsafe
-static const char *stbi__g_failure_reason;
+#ifndef STBI_NO_QOI
+static int      stbi__qoi_test(stbi__context *s);
+static void    *stbi__qoi_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri);
+static int      stbi__qoi_info(stbi__context *s, int *x, int *y, int *comp);
+#endif
+
+// this is not threadsafe unless STBI_THREAD_LOCAL is supported
+static STBI_THREAD_LOCAL const char *stbi__g_failure_reason;
 
 STBIDEF const char *stbi_failure_reason(void)
 {
@@ -917,9 +1523,98 @@ static int stbi__err(const char *str)
     return 0;
 }
 
+#ifdef STBI_STATS
+static STBI_THREAD_LOCAL stbi_stats stbi__g_stats;
+
+STBIDEF void stbi_get_stats(stbi_stats *stats)
+{
+    *stats = stbi__g_stats;
+}
+
+STBIDEF void stbi_reset_stats(void)
+{
+    memset(&stbi__g_stats, 0, sizeof(stbi__g_stats));
+}
+
+#ifdef STBI_THREADS
+static void stbi__stats_add(stbi_stats *to, stbi_stats const *from)
+{
+    int i;
+    to->bytes_read += from->bytes_read;
+    to->inflate_bytes += from->inflate_bytes;
+    to->huffman_slow_decodes += from->huffman_slow_decodes;
+    to->zexpand_reallocs += from->zexpand_reallocs;
+    for (i = 0; i < 5; ++i)
+        to->png_filters[i] += from->png_filters[i];
+    to->jpeg_mcus += from->jpeg_mcus;
+    to->idct_blocks += from->idct_blocks;
+    to->conversion_passes += from->conversion_passes;
+    to->inflate_seconds += from->inflate_seconds;
+    to->unfilter_seconds += from->unfilter_seconds;
+    to->jpeg_scan_seconds += from->jpeg_scan_seconds;
+    to->convert_seconds += from->convert_seconds;
+}
+#endif
+
+static double stbi__stats_now(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER t, f;
+    QueryPerformanceCounter(&t);
+    QueryPerformanceFrequency(&f);
+    return (double)t.QuadPart / (double)f.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + t.tv_nsec * 1e-9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+// STBI__STAT_TIMER declares a timer, so it goes after other declarations
+#define STBI__STAT_ADD(field, n)    (stbi__g_stats.field += (n))
+#define STBI__STAT_TIMER(t)         double t;
+#define STBI__STAT_START(t)         (t = stbi__stats_now())
+#define STBI__STAT_STOP(t, field)   (stbi__g_stats.field += stbi__stats_now() - (t))
+#define STBI__STAT_PASS(t)          (STBI__STAT_STOP(t, convert_seconds), ++stbi__g_stats.conversion_passes)
+#else
+#define STBI__STAT_ADD(field, n)    ((void)0)
+#define STBI__STAT_TIMER(t)
+#define STBI__STAT_START(t)         ((void)0)
+#define STBI__STAT_STOP(t, field)   ((void)0)
+#define STBI__STAT_PASS(t)          ((void)0)
+#endif
+
+// the allocator of the stbi_load_*_alloc call running on this thread, if any
+static STBI_THREAD_LOCAL stbi_allocator const *stbi__allocator;
+
+// the options of the stbi_load*_ex call running on this thread, if any;
+// otherwise settings come from the globals
+static STBI_THREAD_LOCAL stbi_load_options const *stbi__options;
+#define stbi__option(field, global)  (stbi__options ? stbi__options->field : (global))
+
 static void *stbi__malloc(size_t size)
 {
-    return STBI_MALLOC(size);
+    stbi_allocator const *a = stbi__allocator;
+    return a ? a->alloc(a->user, size) : STBI_MALLOC(size);
+}
+
+#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_ZLIB)
+static void *stbi__realloc_sized(void *p, size_t oldsz, size_t newsz)
+{
+    stbi_allocator const *a = stbi__allocator;
+    return a ? a->resize(a->user, p, oldsz, newsz) : STBI_REALLOC_SIZED(p, oldsz, newsz);
+}
+#endif
+
+static void stbi__free(void *p)
+{
+    stbi_allocator const *a = stbi__allocator;
+    if (a)
+        a->release(a->user, p);
+    else
+        STBI_FREE(p);
 }
 
 // stb_image uses ints pervasively, including for offset calculations.
@@ -993,6 +1688,18 @@ static void *stbi__malloc_mad4(int a, int b, int c, int d, int add)
     return stbi__malloc(a*b*c*d + add);
 }
 
+// can an x*y image of n-channel pixels be stored at s->dest?
+static int stbi__dest_fits(stbi__context *s, int x, int y, int n)
+{
+    int pitch = s->dest_stride < 0 ? -s->dest_stride : s->dest_stride;
+    return stbi__mul2sizes_valid(x, n) && x*n <= pitch && y <= s->dest_rows;
+}
+
+static stbi_uc *stbi__dest_row(stbi__context *s, int j)
+{
+    return s->dest + (ptrdiff_t)s->dest_stride * j;
+}
+
 // stbi__err - error
 // stbi__errpf - error returning pointer to float
 // stbi__errpuc - error returning pointer to unsigned char
@@ -1013,56 +1720,685 @@ STBIDEF void stbi_image_free(void *retval_from_stbi_load)
     STBI_FREE(retval_from_stbi_load);
 }
 
-#ifndef STBI_NO_LINEAR
-static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp);
-#endif
-
-#ifndef STBI_NO_HDR
-static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp);
-#endif
+#define STBI__ARENA_ALIGN  16
 
-static int stbi__vertically_flip_on_load = 0;
+static void stbi__arena_note_peak(stbi_arena *a)
+{
+    if (a->used + a->overflow_bytes > a->high_water)
+        a->high_water = a->used + a->overflow_bytes;
+}
 
-STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip)
+static void *stbi__arena_alloc(void *user, size_t size)
 {
-    stbi__vertically_flip_on_load = flag_true_if_should_flip;
+    stbi_arena *a = (stbi_arena *)user;
+    size_t start = (a->used + STBI__ARENA_ALIGN - 1) & ~(size_t)(STBI__ARENA_ALIGN - 1);
+    stbi_uc *b;
+    if (a->base && start <= a->size && size <= a->size - start) {
+        a->last = start;
+        a->used = start + size;
+        stbi__arena_note_peak(a);
+        return a->base + start;
+    }
+    // doesn't fit; take it from the heap until the next reset
+    b = (stbi_uc *)STBI_MALLOC(size + STBI__ARENA_ALIGN);
+    if (!b) return NULL;
+    *(void **)b = a->overflow;
+    a->overflow = b;
+    a->overflow_bytes += size + STBI__ARENA_ALIGN;
+    stbi__arena_note_peak(a);
+    return b + STBI__ARENA_ALIGN;
 }
 
-static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
+static void *stbi__arena_resize(void *user, void *p, size_t old_size, size_t new_size)
 {
-    memset(ri, 0, sizeof(*ri)); // make sure it's initialized if we add new fields
+    stbi_arena *a = (stbi_arena *)user;
+    void *q;
+    if (p == NULL) return stbi__arena_alloc(user, new_size);
+    // the most recent allocation can grow in place
+    if (a->base && (stbi_uc *)p == a->base + a->last && new_size <= a->size - a->last) {
+        a->used = a->last + new_size;
+        stbi__arena_note_peak(a);
+        return p;
+    }
+    // anything else shrinks where it is
+    if (new_size <= old_size) return p;
+    q = stbi__arena_alloc(user, new_size);
+    if (q) memcpy(q, p, old_size < new_size ? old_size : new_size);
+    return q;
+}
+
+static void stbi__arena_release(void *user, void *p)
+{
+    stbi_arena *a = (stbi_arena *)user;
+    // everything else is reclaimed at the next reset
+    if (a->base && (stbi_uc *)p == a->base + a->last)
+        a->used = a->last;
+}
+
+static void stbi__arena_reset(void *user)
+{
+    stbi_arena_reset((stbi_arena *)user);
+}
+
+STBIDEF void stbi_arena_init(stbi_arena *arena, void *memory, size_t size, int reset_per_image)
+{
+    memset(arena, 0, sizeof(*arena));
+    arena->reset_per_image = reset_per_image;
+    if (memory) {
+        arena->base = (stbi_uc *)memory;
+        arena->size = size;
+    } else {
+        arena->owns_base = 1;
+        arena->high_water = size;
+        if (size) {
+            arena->base = (stbi_uc *)STBI_MALLOC(size);
+            arena->size = arena->base ? size : 0;
+        }
+    }
+}
+
+STBIDEF void stbi_arena_reset(stbi_arena *arena)
+{
+    while (arena->overflow) {
+        void *next = *(void **)arena->overflow;
+        STBI_FREE(arena->overflow);
+        arena->overflow = next;
+    }
+    // grow to fit the largest period so far, so the heap isn't needed again
+    if (arena->owns_base && arena->high_water > arena->size) {
+        STBI_FREE(arena->base);
+        arena->base = (stbi_uc *)STBI_MALLOC(arena->high_water);
+        arena->size = arena->base ? arena->high_water : 0;
+    }
+    arena->used = arena->last = 0;
+    arena->overflow_bytes = 0;
+}
+
+STBIDEF void stbi_arena_free(stbi_arena *arena)
+{
+    stbi_arena_reset(arena);
+    if (arena->owns_base)
+        STBI_FREE(arena->base);
+    memset(arena, 0, sizeof(*arena));
+}
+
+STBIDEF stbi_allocator stbi_arena_allocator(stbi_arena *arena)
+{
+    stbi_allocator a;
+    a.alloc = stbi__arena_alloc;
+    a.resize = stbi__arena_resize;
+    a.release = stbi__arena_release;
+    a.reset = arena->reset_per_image ? stbi__arena_reset : NULL;
+    a.user = arena;
+    return a;
+}
+
+///////////////////////////////////////////////
+//
+//  threading
+//
+//  with STBI_THREADS, a decoder can hand independent pieces of work to
+//  stbi__parallel_for. threads are started per call and pull work items
+//  off a shared counter until none are left, so uneven items balance out.
+//  without STBI_THREADS, the items just run in order on the calling thread.
+
+#ifndef STBI_MAX_THREADS
+#define STBI_MAX_THREADS 16
+#endif
+
+typedef void stbi__task(void *data, int index);
+
+static int stbi__thread_count = 0; // 0 = one per processor
+
+STBIDEF void stbi_set_thread_count(int thread_count)
+{
+    stbi__thread_count = thread_count;
+}
+
+// add one to a counter shared between threads, returning its old value
+static int stbi__fetch_inc(volatile long *counter)
+{
+#if !defined(STBI_THREADS)
+    return (int)(*counter)++;
+#elif defined(_WIN32)
+    return (int)InterlockedIncrement(counter) - 1;
+#else
+    return (int)__sync_fetch_and_add(counter, 1);
+#endif
+}
+
+#ifdef STBI_THREADS
+// set on batch workers, which already keep every thread busy
+static STBI_THREAD_LOCAL int stbi__batch_worker;
+
+typedef struct
+{
+    stbi__task *task;
+    void *data;
+    int count;
+    volatile long next;
+    const char *volatile failure_reason; // first failure on another thread
+#ifdef STBI_STATS
+    stbi_stats stats[STBI_MAX_THREADS];  // what each started thread counted
+    volatile long stats_used;
+#endif
+} stbi__parallel;
+
+static void stbi__parallel_worker(stbi__parallel *p)
+{
+    for (;;) {
+        int i = stbi__fetch_inc(&p->next);
+        if (i >= p->count) break;
+        p->task(p->data, i);
+    }
+}
+
+// failure reasons and stats are per-thread, so hand them back to the caller
+static void stbi__parallel_thread(stbi__parallel *p)
+{
+    stbi__g_failure_reason = NULL;
+#ifdef STBI_STATS
+    memset(&stbi__g_stats, 0, sizeof(stbi__g_stats));
+#endif
+    stbi__parallel_worker(p);
+    if (stbi__g_failure_reason) {
+#ifdef _WIN32
+        (void)InterlockedCompareExchangePointer((void *volatile *)&p->failure_reason, (void *)stbi__g_failure_reason, NULL);
+#else
+        (void)__sync_val_compare_and_swap(&p->failure_reason, (const char *)NULL, stbi__g_failure_reason);
+#endif
+    }
+#ifdef STBI_STATS
+    p->stats[stbi__fetch_inc(&p->stats_used)] = stbi__g_stats;
+#endif
+}
+
+#ifdef _WIN32
+static DWORD WINAPI stbi__thread_main(LPVOID p)
+{
+    stbi__parallel_thread((stbi__parallel *)p);
+    return 0;
+}
+#else
+static void *stbi__thread_main(void *p)
+{
+    stbi__parallel_thread((stbi__parallel *)p);
+    return NULL;
+}
+#endif
+
+static int stbi__threads_available(void)
+{
+    int n = stbi__thread_count;
+    if (stbi__batch_worker) return 1;
+    if (n <= 0) {
+#ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        n = (int)info.dwNumberOfProcessors;
+#else
+        n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    }
+    if (n > STBI_MAX_THREADS) n = STBI_MAX_THREADS;
+    return n < 1 ? 1 : n;
+}
+#endif
+
+// run task(data, i) for every i in [0,count); if 'parallel' is false, or
+// there is only one thread to use, they run in order on this thread. tasks
+// on other threads don't see the caller's stbi__options or stbi__allocator,
+// so they must not allocate or depend on settings
+static void stbi__parallel_for(stbi__task *task, void *data, int count, int parallel)
+{
+    int i;
+#ifdef STBI_THREADS
+    int n = parallel ? stbi__threads_available() : 1;
+    if (n > count) n = count;
+    if (n > 1) {
+        stbi__parallel p;
+#ifdef _WIN32
+        HANDLE threads[STBI_MAX_THREADS];
+#else
+        pthread_t threads[STBI_MAX_THREADS];
+#endif
+        int started = 0;
+        p.task = task;
+        p.data = data;
+        p.count = count;
+        p.next = 0;
+        p.failure_reason = NULL;
+#ifdef STBI_STATS
+        p.stats_used = 0;
+#endif
+        // the calling thread works too, so start one less
+        for (i = 1; i < n; ++i) {
+#ifdef _WIN32
+            threads[started] = CreateThread(NULL, 0, stbi__thread_main, &p, 0, NULL);
+            if (threads[started] == NULL) break;
+#else
+            if (pthread_create(&threads[started], NULL, stbi__thread_main, &p) != 0) break;
+#endif
+            ++started;
+        }
+        stbi__parallel_worker(&p);
+        for (i = 0; i < started; ++i) {
+#ifdef _WIN32
+            WaitForSingleObject(threads[i], INFINITE);
+            CloseHandle(threads[i]);
+#else
+            pthread_join(threads[i], NULL);
+#endif
+        }
+        if (p.failure_reason)
+            stbi__g_failure_reason = p.failure_reason;
+#ifdef STBI_STATS
+        for (i = 0; i < started; ++i)
+            stbi__stats_add(&stbi__g_stats, &p.stats[i]);
+#endif
+        return;
+    }
+#else
+    STBI_NOTUSED(parallel);
+#endif
+    for (i = 0; i < count; ++i)
+        task(data, i);
+}
+
+///////////////////////////////////////////////
+//
+//  pixel kernels
+//
+//  the hot per-pixel conversions, one row (or run of pixels) at a time.
+//  stbi__setup_pixel_kernels starts from the C versions and swaps in SIMD
+//  ones the CPU supports, the same way stbi__setup_jpeg does; every version
+//  gives identical results.
+
+typedef void stbi__row_kernel(stbi_uc *dest, stbi_uc const *src, int n);
+
+typedef struct
+{
+    stbi__row_kernel *grey_to_rgba, *grey_alpha_to_rgba, *rgb_to_rgba, *rgba_to_rgb;
+    stbi__row_kernel *swap_rb3, *swap_rb4;   // BGR(A) <-> RGB(A); may work in place
+    void (*narrow16)(stbi_uc *dest, stbi__uint16 const *src, int n);
+    void (*palette3)(stbi_uc *dest, stbi_uc const *index, stbi_uc const *palette, int n);
+    void (*palette4)(stbi_uc *dest, stbi_uc const *index, stbi_uc const *palette, int n);
+    void (*key_grey)(stbi_uc *p, stbi_uc const *tc, int n);  // grey+alpha: alpha = (grey == tc[0]) ? 0 : 255
+    void (*key_rgb)(stbi_uc *p, stbi_uc const *tc, int n);   // RGBA: alpha = 0 where RGB == tc
+} stbi__pixel_kernels;
+
+static void stbi__grey_to_rgba_row(stbi_uc *dest, stbi_uc const *src, int n)
+{
+    int i;
+    for (i = 0; i < n; ++i, dest += 4)
+        dest[0] = dest[1] = dest[2] = src[i], dest[3] = 255;
+}
+
+static void stbi__grey_alpha_to_rgba_row(stbi_uc *dest, stbi_uc const *src, int n)
+{
+    int i;
+    for (i = 0; i < n; ++i, src += 2, dest += 4)
+        dest[0] = dest[1] = dest[2] = src[0], dest[3] = src[1];
+}
+
+static void stbi__rgb_to_rgba_row(stbi_uc *dest, stbi_uc const *src, int n)
+{
+    int i;
+    for (i = 0; i < n; ++i, src += 3, dest += 4)
+        dest[0] = src[0], dest[1] = src[1], dest[2] = src[2], dest[3] = 255;
+}
+
+static void stbi__rgba_to_rgb_row(stbi_uc *dest, stbi_uc const *src, int n)
+{
+    int i;
+    for (i = 0; i < n; ++i, src += 4, dest += 3)
+        dest[0] = src[0], dest[1] = src[1], dest[2] = src[2];
+}
+
+static void stbi__swap_rb3_row(stbi_uc *dest, stbi_uc const *src, int n)
+{
+    int i;
+    for (i = 0; i < n; ++i, src += 3, dest += 3) {
+        stbi_uc t = src[0];
+        dest[0] = src[2], dest[1] = src[1], dest[2] = t;
+    }
+}
+
+static void stbi__swap_rb4_row(stbi_uc *dest, stbi_uc const *src, int n)
+{
+    int i;
+    for (i = 0; i < n; ++i, src += 4, dest += 4) {
+        stbi_uc t = src[0];
+        dest[0] = src[2], dest[1] = src[1], dest[2] = t, dest[3] = src[3];
+    }
+}
+
+static void stbi__narrow16_row(stbi_uc *dest, stbi__uint16 const *src, int n)
+{
+    int i;
+    for (i = 0; i < n; ++i)
+        dest[i] = (stbi_uc)((src[i] >> 8) & 0xFF); // top half of each byte is sufficient approx of 16->8 bit scaling
+}
+
+static void stbi__palette3_row(stbi_uc *dest, stbi_uc const *index, stbi_uc const *palette, int n)
+{
+    int i;
+    for (i = 0; i < n; ++i, dest += 3) {
+        stbi_uc const *c = palette + index[i] * 4;
+        dest[0] = c[0], dest[1] = c[1], dest[2] = c[2];
+    }
+}
+
+static void stbi__palette4_row(stbi_uc *dest, stbi_uc const *index, stbi_uc const *palette, int n)
+{
+    int i;
+    for (i = 0; i < n; ++i, dest += 4) {
+        stbi_uc const *c = palette + index[i] * 4;
+        dest[0] = c[0], dest[1] = c[1], dest[2] = c[2], dest[3] = c[3];
+    }
+}
+
+static void stbi__key_grey_row(stbi_uc *p, stbi_uc const *tc, int n)
+{
+    int i;
+    for (i = 0; i < n; ++i, p += 2)
+        p[1] = (p[0] == tc[0] ? 0 : 255);
+}
+
+static void stbi__key_rgb_row(stbi_uc *p, stbi_uc const *tc, int n)
+{
+    int i;
+    for (i = 0; i < n; ++i, p += 4)
+        if (p[0] == tc[0] && p[1] == tc[1] && p[2] == tc[2])
+            p[3] = 0;
+}
+
+#ifdef STBI_SSE2
+static void stbi__narrow16_sse2(stbi_uc *dest, stbi__uint16 const *src, int n)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_srli_epi16(_mm_loadu_si128((__m128i const *) (src + i)), 8);
+        __m128i b = _mm_srli_epi16(_mm_loadu_si128((__m128i const *) (src + i + 8)), 8);
+        _mm_storeu_si128((__m128i *) (dest + i), _mm_packus_epi16(a, b));
+    }
+    stbi__narrow16_row(dest + i, src + i, n - i);
+}
+
+static void stbi__key_grey_sse2(stbi_uc *p, stbi_uc const *tc, int n)
+{
+    __m128i lo = _mm_set1_epi16(0xff), hi = _mm_set1_epi16((short)0xff00);
+    __m128i key = _mm_set1_epi16(tc[0]);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i g = _mm_and_si128(_mm_loadu_si128((__m128i *) (p + i * 2)), lo);
+        __m128i a = _mm_andnot_si128(_mm_cmpeq_epi16(g, key), hi);
+        _mm_storeu_si128((__m128i *) (p + i * 2), _mm_or_si128(g, a));
+    }
+    stbi__key_grey_row(p + i * 2, tc, n - i);
+}
+
+static void stbi__key_rgb_sse2(stbi_uc *p, stbi_uc const *tc, int n)
+{
+    __m128i rgb = _mm_set1_epi32(0xffffff), alpha = _mm_set1_epi32((int)0xff000000u);
+    __m128i key = _mm_set1_epi32(tc[0] | (tc[1] << 8) | (tc[2] << 16));
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((__m128i *) (p + i * 4));
+        __m128i hit = _mm_cmpeq_epi32(_mm_and_si128(v, rgb), key);
+        _mm_storeu_si128((__m128i *) (p + i * 4), _mm_andnot_si128(_mm_and_si128(hit, alpha), v));
+    }
+    stbi__key_rgb_row(p + i * 4, tc, n - i);
+}
+#endif
+
+#ifdef STBI__SSSE3
+// the 16 byte loads and stores of the 3-channel kernels reach past the 12
+// bytes they convert, so they stop while at least 6 pixels are left
+
+STBI__SSSE3_TARGET
+static void stbi__grey_to_rgba_ssse3(stbi_uc *dest, stbi_uc const *src, int n)
+{
+    __m128i alpha = _mm_set1_epi32((int)0xff000000u);
+    __m128i s0 = _mm_setr_epi8(0, 0, 0, -1, 1, 1, 1, -1, 2, 2, 2, -1, 3, 3, 3, -1);
+    __m128i s1 = _mm_setr_epi8(4, 4, 4, -1, 5, 5, 5, -1, 6, 6, 6, -1, 7, 7, 7, -1);
+    __m128i s2 = _mm_setr_epi8(8, 8, 8, -1, 9, 9, 9, -1, 10, 10, 10, -1, 11, 11, 11, -1);
+    __m128i s3 = _mm_setr_epi8(12, 12, 12, -1, 13, 13, 13, -1, 14, 14, 14, -1, 15, 15, 15, -1);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i g = _mm_loadu_si128((__m128i const *) (src + i));
+        _mm_storeu_si128((__m128i *) (dest + i * 4), _mm_or_si128(_mm_shuffle_epi8(g, s0), alpha));
+        _mm_storeu_si128((__m128i *) (dest + i * 4 + 16), _mm_or_si128(_mm_shuffle_epi8(g, s1), alpha));
+        _mm_storeu_si128((__m128i *) (dest + i * 4 + 32), _mm_or_si128(_mm_shuffle_epi8(g, s2), alpha));
+        _mm_storeu_si128((__m128i *) (dest + i * 4 + 48), _mm_or_si128(_mm_shuffle_epi8(g, s3), alpha));
+    }
+    stbi__grey_to_rgba_row(dest + i * 4, src + i, n - i);
+}
+
+STBI__SSSE3_TARGET
+static void stbi__grey_alpha_to_rgba_ssse3(stbi_uc *dest, stbi_uc const *src, int n)
+{
+    __m128i s0 = _mm_setr_epi8(0, 0, 0, 1, 2, 2, 2, 3, 4, 4, 4, 5, 6, 6, 6, 7);
+    __m128i s1 = _mm_add_epi8(s0, _mm_set1_epi8(8));
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i ga = _mm_loadu_si128((__m128i const *) (src + i * 2));
+        _mm_storeu_si128((__m128i *) (dest + i * 4), _mm_shuffle_epi8(ga, s0));
+        _mm_storeu_si128((__m128i *) (dest + i * 4 + 16), _mm_shuffle_epi8(ga, s1));
+    }
+    stbi__grey_alpha_to_rgba_row(dest + i * 4, src + i * 2, n - i);
+}
+
+STBI__SSSE3_TARGET
+static void stbi__rgb_to_rgba_ssse3(stbi_uc *dest, stbi_uc const *src, int n)
+{
+    __m128i alpha = _mm_set1_epi32((int)0xff000000u);
+    __m128i s = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    int i = 0;
+    for (; i + 6 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((__m128i const *) (src + i * 3));
+        _mm_storeu_si128((__m128i *) (dest + i * 4), _mm_or_si128(_mm_shuffle_epi8(v, s), alpha));
+    }
+    stbi__rgb_to_rgba_row(dest + i * 4, src + i * 3, n - i);
+}
+
+STBI__SSSE3_TARGET
+static void stbi__rgba_to_rgb_ssse3(stbi_uc *dest, stbi_uc const *src, int n)
+{
+    __m128i s = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    int i = 0;
+    for (; i + 6 <= n; i += 4)
+        _mm_storeu_si128((__m128i *) (dest + i * 3), _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *) (src + i * 4)), s));
+    stbi__rgba_to_rgb_row(dest + i * 3, src + i * 4, n - i);
+}
+
+STBI__SSSE3_TARGET
+static void stbi__swap_rb3_ssse3(stbi_uc *dest, stbi_uc const *src, int n)
+{
+    // bytes 12-15 belong to the next pixels and pass through unchanged
+    __m128i s = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 12, 13, 14, 15);
+    int i = 0;
+    for (; i + 6 <= n; i += 4)
+        _mm_storeu_si128((__m128i *) (dest + i * 3), _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *) (src + i * 3)), s));
+    stbi__swap_rb3_row(dest + i * 3, src + i * 3, n - i);
+}
+
+STBI__SSSE3_TARGET
+static void stbi__swap_rb4_ssse3(stbi_uc *dest, stbi_uc const *src, int n)
+{
+    __m128i s = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_si128((__m128i *) (dest + i * 4), _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *) (src + i * 4)), s));
+    stbi__swap_rb4_row(dest + i * 4, src + i * 4, n - i);
+}
+#endif
+
+#ifdef STBI__AVX2
+STBI__AVX2_TARGET
+static void stbi__rgb_to_rgba_avx2(stbi_uc *dest, stbi_uc const *src, int n)
+{
+    // spread 24 bytes so each 128-bit lane holds 4 whole pixels, then shuffle in-lane
+    __m256i spread = _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0);
+    __m256i s = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                                 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    __m256i alpha = _mm256_set1_epi32((int)0xff000000u);
+    int i = 0;
+    for (; i + 11 <= n; i += 8) {
+        __m256i v = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((__m256i const *) (src + i * 3)), spread);
+        _mm256_storeu_si256((__m256i *) (dest + i * 4), _mm256_or_si256(_mm256_shuffle_epi8(v, s), alpha));
+    }
+    stbi__rgb_to_rgba_row(dest + i * 4, src + i * 3, n - i);
+}
+
+STBI__AVX2_TARGET
+static void stbi__narrow16_avx2(stbi_uc *dest, stbi__uint16 const *src, int n)
+{
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i a = _mm256_srli_epi16(_mm256_loadu_si256((__m256i const *) (src + i)), 8);
+        __m256i b = _mm256_srli_epi16(_mm256_loadu_si256((__m256i const *) (src + i + 16)), 8);
+        // packus works per 128-bit lane, so put the quarters back in order
+        _mm256_storeu_si256((__m256i *) (dest + i), _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8));
+    }
+    stbi__narrow16_row(dest + i, src + i, n - i);
+}
+
+// palette entries are 4 bytes apart, so a pixel is a single 32-bit gather
+STBI__AVX2_TARGET
+static void stbi__palette4_avx2(stbi_uc *dest, stbi_uc const *index, stbi_uc const *palette, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i k = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i const *) (index + i)));
+        _mm256_storeu_si256((__m256i *) (dest + i * 4), _mm256_i32gather_epi32((int const *) palette, k, 4));
+    }
+    stbi__palette4_row(dest + i * 4, index + i, palette, n - i);
+}
+
+STBI__AVX2_TARGET
+static void stbi__palette3_avx2(stbi_uc *dest, stbi_uc const *index, stbi_uc const *palette, int n)
+{
+    __m256i s = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    int i = 0;
+    // the second store reaches 4 bytes past the 24 converted
+    for (; i + 10 <= n; i += 8) {
+        __m256i k = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i const *) (index + i)));
+        __m256i v = _mm256_shuffle_epi8(_mm256_i32gather_epi32((int const *) palette, k, 4), s);
+        _mm_storeu_si128((__m128i *) (dest + i * 3), _mm256_castsi256_si128(v));
+        _mm_storeu_si128((__m128i *) (dest + i * 3 + 12), _mm256_extracti128_si256(v, 1));
+    }
+    stbi__palette3_row(dest + i * 3, index + i, palette, n - i);
+}
+#endif
+
+static void stbi__setup_pixel_kernels(stbi__pixel_kernels *k)
+{
+    k->grey_to_rgba = stbi__grey_to_rgba_row;
+    k->grey_alpha_to_rgba = stbi__grey_alpha_to_rgba_row;
+    k->rgb_to_rgba = stbi__rgb_to_rgba_row;
+    k->rgba_to_rgb = stbi__rgba_to_rgb_row;
+    k->swap_rb3 = stbi__swap_rb3_row;
+    k->swap_rb4 = stbi__swap_rb4_row;
+    k->narrow16 = stbi__narrow16_row;
+    k->palette3 = stbi__palette3_row;
+    k->palette4 = stbi__palette4_row;
+    k->key_grey = stbi__key_grey_row;
+    k->key_rgb = stbi__key_rgb_row;
+
+#ifdef STBI_SSE2
+    if (stbi__sse2_available()) {
+        k->narrow16 = stbi__narrow16_sse2;
+        k->key_grey = stbi__key_grey_sse2;
+        k->key_rgb = stbi__key_rgb_sse2;
+    }
+#endif
+
+#ifdef STBI__SSSE3
+    if (stbi__ssse3_available()) {
+        k->grey_to_rgba = stbi__grey_to_rgba_ssse3;
+        k->grey_alpha_to_rgba = stbi__grey_alpha_to_rgba_ssse3;
+        k->rgb_to_rgba = stbi__rgb_to_rgba_ssse3;
+        k->rgba_to_rgb = stbi__rgba_to_rgb_ssse3;
+        k->swap_rb3 = stbi__swap_rb3_ssse3;
+        k->swap_rb4 = stbi__swap_rb4_ssse3;
+    }
+#endif
+
+#ifdef STBI__AVX2
+    if (stbi__avx2_available()) {
+        k->rgb_to_rgba = stbi__rgb_to_rgba_avx2;
+        k->narrow16 = stbi__narrow16_avx2;
+        k->palette3 = stbi__palette3_avx2;
+        k->palette4 = stbi__palette4_avx2;
+    }
+#endif
+}
+
+#ifndef STBI_NO_LINEAR
+static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp);
+#endif
+
+#ifndef STBI_NO_HDR
+static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp);
+#endif
+
+static int stbi__vertically_flip_on_load = 0;
+
+STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip)
+{
+    stbi__vertically_flip_on_load = flag_true_if_should_flip;
+}
+
+// every format but TGA starts with a signature, and no two share a first
+// byte, so that byte picks the one format whose test is worth running
+static int stbi__peek8(stbi__context *s)
+{
+    return s->img_buffer < s->img_buffer_end ? *s->img_buffer : -1;
+}
+
+static void *stbi__load_format(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
+{
+    memset(ri, 0, sizeof(*ri)); // make sure it's initialized if we add new fields
     ri->bits_per_channel = 8; // default is 8 so most paths don't have to be changed
     ri->channel_order = STBI_ORDER_RGB; // all current input & output are this, but this is here so we can add BGR order
     ri->num_channels = 0;
 
+    switch (stbi__peek8(s)) {
 #ifndef STBI_NO_JPEG
-    if (stbi__jpeg_test(s)) return stbi__jpeg_load(s, x, y, comp, req_comp, ri);
+    case 0xff: if (stbi__jpeg_test(s)) return stbi__jpeg_load(s, x, y, comp, req_comp, ri); break;
 #endif
 #ifndef STBI_NO_PNG
-    if (stbi__png_test(s))  return stbi__png_load(s, x, y, comp, req_comp, ri);
+    case 0x89: if (stbi__png_test(s))  return stbi__png_load(s, x, y, comp, req_comp, ri); break;
 #endif
 #ifndef STBI_NO_BMP
-    if (stbi__bmp_test(s))  return stbi__bmp_load(s, x, y, comp, req_comp, ri);
+    case 'B':  if (stbi__bmp_test(s))  return stbi__bmp_load(s, x, y, comp, req_comp, ri); break;
 #endif
 #ifndef STBI_NO_GIF
-    if (stbi__gif_test(s))  return stbi__gif_load(s, x, y, comp, req_comp, ri);
+    case 'G':  if (stbi__gif_test(s))  return stbi__gif_load(s, x, y, comp, req_comp, ri); break;
 #endif
 #ifndef STBI_NO_PSD
-    if (stbi__psd_test(s))  return stbi__psd_load(s, x, y, comp, req_comp, ri, bpc);
+    case '8':  if (stbi__psd_test(s))  return stbi__psd_load(s, x, y, comp, req_comp, ri, bpc); break;
 #endif
 #ifndef STBI_NO_PIC
-    if (stbi__pic_test(s))  return stbi__pic_load(s, x, y, comp, req_comp, ri);
+    case 0x53: if (stbi__pic_test(s))  return stbi__pic_load(s, x, y, comp, req_comp, ri); break;
 #endif
 #ifndef STBI_NO_PNM
-    if (stbi__pnm_test(s))  return stbi__pnm_load(s, x, y, comp, req_comp, ri);
+    case 'P':  if (stbi__pnm_test(s))  return stbi__pnm_load(s, x, y, comp, req_comp, ri); break;
+#endif
+#ifndef STBI_NO_QOI
+    case 'q':  if (stbi__qoi_test(s))  return stbi__qoi_load(s, x, y, comp, req_comp, ri); break;
 #endif
-
 #ifndef STBI_NO_HDR
-    if (stbi__hdr_test(s)) {
-        float *hdr = stbi__hdr_load(s, x, y, comp, req_comp, ri);
-        return stbi__hdr_to_ldr(hdr, *x, *y, req_comp ? req_comp : *comp);
-    }
+    case '#':
+        if (stbi__hdr_test(s)) {
+            float *hdr = stbi__hdr_load(s, x, y, comp, req_comp, ri);
+            return stbi__hdr_to_ldr(hdr, *x, *y, req_comp ? req_comp : *comp);
+        }
+        break;
 #endif
+    }
 
 #ifndef STBI_NO_TGA
     // test tga last because it's a crappy test!
@@ -1073,19 +2409,37 @@ static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int re
     return stbi__errpuc("unknown image type", "Image not of any known type, or corrupt");
 }
 
+// channels per pixel in a decoded result; a decoder that returns channels
+// the file doesn't have (PNG tRNS adds alpha) reports them in num_channels
+static int stbi__result_channels(stbi__result_info const *ri, int comp, int req_comp)
+{
+    return req_comp ? req_comp : ri->num_channels ? ri->num_channels : comp;
+}
+
+static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
+{
+    void *result = stbi__load_format(s, x, y, comp, req_comp, ri, bpc);
+    // reads from memory aren't counted as they happen; take how far it got
+    if (!s->io.read) STBI__STAT_ADD(bytes_read, (size_t)(s->img_buffer - s->img_buffer_original));
+    return result;
+}
+
 static stbi_uc *stbi__convert_16_to_8(stbi__uint16 *orig, int w, int h, int channels)
 {
-    int i;
+    stbi__pixel_kernels k;
     int img_len = w * h * channels;
     stbi_uc *reduced;
+    STBI__STAT_TIMER(t)
 
     reduced = (stbi_uc *)stbi__malloc(img_len);
     if (reduced == NULL) return stbi__errpuc("outofmem", "Out of memory");
 
-    for (i = 0; i < img_len; ++i)
-        reduced[i] = (stbi_uc)((orig[i] >> 8) & 0xFF); // top half of each byte is sufficient approx of 16->8 bit scaling
+    STBI__STAT_START(t);
+    stbi__setup_pixel_kernels(&k);
+    k.narrow16(reduced, orig, img_len);
 
-    STBI_FREE(orig);
+    stbi__free(orig);
+    STBI__STAT_PASS(t);
     return reduced;
 }
 
@@ -1094,40 +2448,55 @@ static stbi__uint16 *stbi__convert_8_to_16(stbi_uc *orig, int w, int h, int chan
     int i;
     int img_len = w * h * channels;
     stbi__uint16 *enlarged;
+    STBI__STAT_TIMER(t)
 
     enlarged = (stbi__uint16 *)stbi__malloc(img_len * 2);
     if (enlarged == NULL) return (stbi__uint16 *)stbi__errpuc("outofmem", "Out of memory");
 
+    STBI__STAT_START(t);
     for (i = 0; i < img_len; ++i)
         enlarged[i] = (stbi__uint16)((orig[i] << 8) + orig[i]); // replicate to high and low byte, maps 0->0, 255->0xffff
 
-    STBI_FREE(orig);
+    stbi__free(orig);
+    STBI__STAT_PASS(t);
     return enlarged;
 }
 
+static stbi_uc *stbi__load_region(stbi__context *s, int *x, int *y, int *comp, int req_comp);
+
 static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
     stbi__result_info ri;
-    void *result = stbi__load_main(s, x, y, comp, req_comp, &ri, 8);
+    void *result;
+
+    if (stbi__option(roi_w, 0) > 0 && stbi__option(roi_h, 0) > 0) {
+        result = stbi__load_region(s, x, y, comp, req_comp);
+        ri.bits_per_channel = 8;
+        ri.num_channels = 0;
+    }
+    else
+        result = stbi__load_main(s, x, y, comp, req_comp, &ri, 8);
 
     if (result == NULL)
         return NULL;
 
     if (ri.bits_per_channel != 8) {
         STBI_ASSERT(ri.bits_per_channel == 16);
-        result = stbi__convert_16_to_8((stbi__uint16 *)result, *x, *y, req_comp == 0 ? *comp : req_comp);
+        result = stbi__convert_16_to_8((stbi__uint16 *)result, *x, *y, stbi__result_channels(&ri, *comp, req_comp));
         ri.bits_per_channel = 8;
     }
 
     // @TODO: move stbi__convert_format to here
 
-    if (stbi__vertically_flip_on_load) {
+    if (stbi__option(flip_vertically, stbi__vertically_flip_on_load)) {
         int w = *x, h = *y;
-        int channels = req_comp ? req_comp : *comp;
+        int channels = stbi__result_channels(&ri, *comp, req_comp);
         int row, col, z;
         stbi_uc *image = (stbi_uc *)result;
+        STBI__STAT_TIMER(t)
 
         // @OPTIMIZE: use a bigger temp buffer and memcpy multiple pixels at once
+        STBI__STAT_START(t);
         for (row = 0; row < (h >> 1); row++) {
             for (col = 0; col < w; col++) {
                 for (z = 0; z < channels; z++) {
@@ -1137,6 +2506,7 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
                 }
             }
         }
+        STBI__STAT_PASS(t);
     }
 
     return (unsigned char *)result;
@@ -1152,20 +2522,22 @@ static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x,
 
     if (ri.bits_per_channel != 16) {
         STBI_ASSERT(ri.bits_per_channel == 8);
-        result = stbi__convert_8_to_16((stbi_uc *)result, *x, *y, req_comp == 0 ? *comp : req_comp);
+        result = stbi__convert_8_to_16((stbi_uc *)result, *x, *y, stbi__result_channels(&ri, *comp, req_comp));
         ri.bits_per_channel = 16;
     }
 
     // @TODO: move stbi__convert_format16 to here
     // @TODO: special case RGB-to-Y (and RGBA-to-YA) for 8-bit-to-16-bit case to keep more precision
 
-    if (stbi__vertically_flip_on_load) {
+    if (stbi__option(flip_vertically, stbi__vertically_flip_on_load)) {
         int w = *x, h = *y;
-        int channels = req_comp ? req_comp : *comp;
+        int channels = stbi__result_channels(&ri, *comp, req_comp);
         int row, col, z;
         stbi__uint16 *image = (stbi__uint16 *)result;
+        STBI__STAT_TIMER(t)
 
         // @OPTIMIZE: use a bigger temp buffer and memcpy multiple pixels at once
+        STBI__STAT_START(t);
         for (row = 0; row < (h >> 1); row++) {
             for (col = 0; col < w; col++) {
                 for (z = 0; z < channels; z++) {
@@ -1175,21 +2547,91 @@ static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x,
                 }
             }
         }
+        STBI__STAT_PASS(t);
     }
 
     return (stbi__uint16 *)result;
 }
 
+// decode into s->dest, or decode normally and copy it there if this
+// decoder/format combination can't write it directly
+static int stbi__load_into(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi_uc *dest, int dest_stride, int dest_rows)
+{
+    stbi__result_info ri;
+    stbi_uc *result;
+    int j, n, ok = 1;
+    s->dest = dest;
+    s->dest_stride = dest_stride;
+    s->dest_rows = dest_rows;
+    result = (stbi_uc *)stbi__load_main(s, x, y, comp, req_comp, &ri, 8);
+    if (result == NULL) return 0;
+    if (result == dest) return 1;
+
+    if (ri.bits_per_channel != 8) {
+        STBI_ASSERT(ri.bits_per_channel == 16);
+        result = stbi__convert_16_to_8((stbi__uint16 *)result, *x, *y, stbi__result_channels(&ri, *comp, req_comp));
+        if (result == NULL) return 0;
+    }
+    n = stbi__result_channels(&ri, *comp, req_comp);
+    if (stbi__dest_fits(s, *x, *y, n)) {
+        for (j = 0; j < *y; ++j)
+            memcpy(stbi__dest_row(s, j), result + (size_t)j * *x * n, (size_t)*x * n);
+    }
+    else
+        ok = stbi__err("dest too small", "Destination too small");
+    stbi__free(result);
+    return ok;
+}
+
+// decode with every allocation, including the result, going through 'allocator'
+static unsigned char *stbi__load_8bit_alloc(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi_allocator const *allocator)
+{
+    stbi_allocator const *prev = stbi__allocator;
+    unsigned char *result;
+    if (allocator && allocator->reset)
+        allocator->reset(allocator->user);
+    stbi__allocator = allocator;
+    result = stbi__load_and_postprocess_8bit(s, x, y, comp, req_comp);
+    stbi__allocator = prev;
+    return result;
+}
+
+// run a decode with 'options' standing in for the global settings
+typedef struct
+{
+    stbi_load_options const *options;
+    stbi_allocator const *allocator;
+} stbi__ex_scope;
+
+static void stbi__ex_begin(stbi__ex_scope *scope, stbi_load_options *options)
+{
+    scope->options = stbi__options;
+    scope->allocator = stbi__allocator;
+    if (options->allocator && options->allocator->reset)
+        options->allocator->reset(options->allocator->user);
+    stbi__options = options;
+    stbi__allocator = options->allocator;
+}
+
+static void stbi__ex_end(stbi__ex_scope *scope, stbi_load_options *options, void *result)
+{
+    stbi__options = scope->options;
+    stbi__allocator = scope->allocator;
+    options->failure_reason = result ? NULL : stbi__g_failure_reason;
+}
+
 #ifndef STBI_NO_HDR
 static void stbi__float_postprocess(float *result, int *x, int *y, int *comp, int req_comp)
 {
-    if (stbi__vertically_flip_on_load && result != NULL) {
+    if (stbi__option(flip_vertically, stbi__vertically_flip_on_load) && result != NULL) {
         int w = *x, h = *y;
         int depth = req_comp ? req_comp : *comp;
         int row, col, z;
         float temp;
+        STBI__STAT_TIMER(t)
 
         // @OPTIMIZE: use a bigger temp buffer and memcpy multiple pixels at once
+        STBI__STAT_START(t);
         for (row = 0; row < (h >> 1); row++) {
             for (col = 0; col < w; col++) {
                 for (z = 0; z < depth; z++) {
@@ -1199,6 +2641,7 @@ static void stbi__float_postprocess(float *result, int *x, int *y, int *comp, in
                 }
             }
         }
+        STBI__STAT_PASS(t);
     }
 }
 #endif
@@ -1217,17 +2660,107 @@ static FILE *stbi__fopen(char const *filename, char const *mode)
     return f;
 }
 
+#ifdef STBI__MMAP
+// a read-only view of a whole file
+typedef struct
+{
+    stbi_uc *data;
+    int len;
+} stbi__map;
+
+// map a file for reading; anything that isn't a regular file of 1..INT_MAX
+// bytes fails, and the caller goes through stdio instead
+static int stbi__map_file(stbi__map *m, char const *filename)
+{
+#ifdef _WIN32
+    LARGE_INTEGER size;
+    HANDLE mapping, file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) return 0;
+    m->data = NULL;
+    if (GetFileType(file) == FILE_TYPE_DISK && GetFileSizeEx(file, &size) && size.QuadPart > 0 && size.QuadPart <= INT_MAX) {
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping) {
+            // the view keeps the mapping alive
+            m->data = (stbi_uc *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            m->len = (int)size.QuadPart;
+            CloseHandle(mapping);
+        }
+    }
+    CloseHandle(file);
+    return m->data != NULL;
+#else
+    struct stat st;
+    void *p = MAP_FAILED;
+    int fd;
+    // check first, so pipes and devices are never opened twice
+    if (stat(filename, &st) != 0 || !S_ISREG(st.st_mode)) return 0;
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) return 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size <= INT_MAX)
+        p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return 0;
+#ifdef POSIX_MADV_SEQUENTIAL
+    // decoders read front to back, so ask for read-ahead, starting now
+    // (strict ISO modes hide this; it's only advice)
+    posix_madvise(p, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+    posix_madvise(p, (size_t)st.st_size, POSIX_MADV_WILLNEED);
+#endif
+    m->data = (stbi_uc *)p;
+    m->len = (int)st.st_size;
+    return 1;
+#endif
+}
+
+static void stbi__unmap_file(stbi__map *m)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(m->data);
+#else
+    munmap(m->data, (size_t)m->len);
+#endif
+}
+#endif
+
 
 STBIDEF stbi_uc *stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
-    FILE *f = stbi__fopen(filename, "rb");
+    FILE *f;
     unsigned char *result;
+#ifdef STBI__MMAP
+    stbi__map m;
+    if (stbi__map_file(&m, filename)) {
+        result = stbi_load_from_memory(m.data, m.len, x, y, comp, req_comp);
+        stbi__unmap_file(&m);
+        return result;
+    }
+#endif
+    f = stbi__fopen(filename, "rb");
     if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
     result = stbi_load_from_file(f, x, y, comp, req_comp);
     fclose(f);
     return result;
 }
 
+STBIDEF stbi_uc *stbi_load_alloc(char const *filename, int *x, int *y, int *comp, int req_comp, stbi_allocator const *allocator)
+{
+    FILE *f;
+    unsigned char *result;
+#ifdef STBI__MMAP
+    stbi__map m;
+    if (stbi__map_file(&m, filename)) {
+        result = stbi_load_from_memory_alloc(m.data, m.len, x, y, comp, req_comp, allocator);
+        stbi__unmap_file(&m);
+        return result;
+    }
+#endif
+    f = stbi__fopen(filename, "rb");
+    if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+    result = stbi_load_from_file_alloc(f, x, y, comp, req_comp, allocator);
+    fclose(f);
+    return result;
+}
+
 STBIDEF stbi_uc *stbi_load_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
 {
     unsigned char *result;
@@ -1241,6 +2774,90 @@ STBIDEF stbi_uc *stbi_load_from_file(FILE *f, int *x, int *y, int *comp, int req
     return result;
 }
 
+STBIDEF stbi_uc *stbi_load_ex(char const *filename, int *x, int *y, int *comp, stbi_load_options *options)
+{
+    FILE *f;
+    unsigned char *result;
+#ifdef STBI__MMAP
+    stbi__map m;
+    if (stbi__map_file(&m, filename)) {
+        result = stbi_load_from_memory_ex(m.data, m.len, x, y, comp, options);
+        stbi__unmap_file(&m);
+        return result;
+    }
+#endif
+    f = stbi__fopen(filename, "rb");
+    if (!f) {
+        stbi__err("can't fopen", "Unable to open file");
+        options->failure_reason = stbi__g_failure_reason;
+        return NULL;
+    }
+    result = stbi_load_from_file_ex(f, x, y, comp, options);
+    fclose(f);
+    return result;
+}
+
+STBIDEF stbi_uc *stbi_load_from_file_ex(FILE *f, int *x, int *y, int *comp, stbi_load_options *options)
+{
+    unsigned char *result;
+    stbi__context s;
+    stbi__ex_scope scope;
+    stbi__start_file(&s, f);
+    stbi__ex_begin(&scope, options);
+    result = stbi__load_and_postprocess_8bit(&s, x, y, comp, options->desired_channels);
+    stbi__ex_end(&scope, options, result);
+    if (result) {
+        // need to 'unget' all the characters in the IO buffer
+        fseek(f, -(int)(s.img_buffer_end - s.img_buffer), SEEK_CUR);
+    }
+    return result;
+}
+
+STBIDEF int stbi_load_into(char const *filename, int *x, int *y, int *comp, int req_comp, stbi_uc *dest, int dest_stride, int dest_rows)
+{
+    FILE *f;
+    int result;
+#ifdef STBI__MMAP
+    stbi__map m;
+    if (stbi__map_file(&m, filename)) {
+        result = stbi_load_from_memory_into(m.data, m.len, x, y, comp, req_comp, dest, dest_stride, dest_rows);
+        stbi__unmap_file(&m);
+        return result;
+    }
+#endif
+    f = stbi__fopen(filename, "rb");
+    if (!f) return stbi__err("can't fopen", "Unable to open file");
+    result = stbi_load_from_file_into(f, x, y, comp, req_comp, dest, dest_stride, dest_rows);
+    fclose(f);
+    return result;
+}
+
+STBIDEF int stbi_load_from_file_into(FILE *f, int *x, int *y, int *comp, int req_comp, stbi_uc *dest, int dest_stride, int dest_rows)
+{
+    int result;
+    stbi__context s;
+    stbi__start_file(&s, f);
+    result = stbi__load_into(&s, x, y, comp, req_comp, dest, dest_stride, dest_rows);
+    if (result) {
+        // need to 'unget' all the characters in the IO buffer
+        fseek(f, -(int)(s.img_buffer_end - s.img_buffer), SEEK_CUR);
+    }
+    return result;
+}
+
+STBIDEF stbi_uc *stbi_load_from_file_alloc(FILE *f, int *x, int *y, int *comp, int req_comp, stbi_allocator const *allocator)
+{
+    unsigned char *result;
+    stbi__context s;
+    stbi__start_file(&s, f);
+    result = stbi__load_8bit_alloc(&s, x, y, comp, req_comp, allocator);
+    if (result) {
+        // need to 'unget' all the characters in the IO buffer
+        fseek(f, -(int)(s.img_buffer_end - s.img_buffer), SEEK_CUR);
+    }
+    return result;
+}
+
 STBIDEF stbi__uint16 *stbi_load_from_file_16(FILE *f, int *x, int *y, int *comp, int req_comp)
 {
     stbi__uint16 *result;
@@ -1256,8 +2873,19 @@ STBIDEF stbi__uint16 *stbi_load_from_file_16(FILE *f, int *x, int *y, int *comp,
 
 STBIDEF stbi_us *stbi_load_16(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
-    FILE *f = stbi__fopen(filename, "rb");
+    FILE *f;
     stbi__uint16 *result;
+#ifdef STBI__MMAP
+    stbi__map m;
+    if (stbi__map_file(&m, filename)) {
+        stbi__context s;
+        stbi__start_mem(&s, m.data, m.len);
+        result = stbi__load_and_postprocess_16bit(&s, x, y, comp, req_comp);
+        stbi__unmap_file(&m);
+        return result;
+    }
+#endif
+    f = stbi__fopen(filename, "rb");
     if (!f) return (stbi_us *)stbi__errpuc("can't fopen", "Unable to open file");
     result = stbi_load_from_file_16(f, x, y, comp, req_comp);
     fclose(f);
@@ -1281,6 +2909,58 @@ STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *u
     return stbi__load_and_postprocess_8bit(&s, x, y, comp, req_comp);
 }
 
+STBIDEF stbi_uc *stbi_load_from_memory_ex(stbi_uc const *buffer, int len, int *x, int *y, int *comp, stbi_load_options *options)
+{
+    stbi__context s;
+    stbi__ex_scope scope;
+    unsigned char *result;
+    stbi__start_mem(&s, buffer, len);
+    stbi__ex_begin(&scope, options);
+    result = stbi__load_and_postprocess_8bit(&s, x, y, comp, options->desired_channels);
+    stbi__ex_end(&scope, options, result);
+    return result;
+}
+
+STBIDEF stbi_uc *stbi_load_from_callbacks_ex(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, stbi_load_options *options)
+{
+    stbi__context s;
+    stbi__ex_scope scope;
+    unsigned char *result;
+    stbi__start_callbacks(&s, (stbi_io_callbacks *)clbk, user);
+    stbi__ex_begin(&scope, options);
+    result = stbi__load_and_postprocess_8bit(&s, x, y, comp, options->desired_channels);
+    stbi__ex_end(&scope, options, result);
+    return result;
+}
+
+STBIDEF int stbi_load_from_memory_into(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_uc *dest, int dest_stride, int dest_rows)
+{
+    stbi__context s;
+    stbi__start_mem(&s, buffer, len);
+    return stbi__load_into(&s, x, y, comp, req_comp, dest, dest_stride, dest_rows);
+}
+
+STBIDEF int stbi_load_from_callbacks_into(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, stbi_uc *dest, int dest_stride, int dest_rows)
+{
+    stbi__context s;
+    stbi__start_callbacks(&s, (stbi_io_callbacks *)clbk, user);
+    return stbi__load_into(&s, x, y, comp, req_comp, dest, dest_stride, dest_rows);
+}
+
+STBIDEF stbi_uc *stbi_load_from_memory_alloc(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_allocator const *allocator)
+{
+    stbi__context s;
+    stbi__start_mem(&s, buffer, len);
+    return stbi__load_8bit_alloc(&s, x, y, comp, req_comp, allocator);
+}
+
+STBIDEF stbi_uc *stbi_load_from_callbacks_alloc(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, stbi_allocator const *allocator)
+{
+    stbi__context s;
+    stbi__start_callbacks(&s, (stbi_io_callbacks *)clbk, user);
+    return stbi__load_8bit_alloc(&s, x, y, comp, req_comp, allocator);
+}
+
 #ifndef STBI_NO_LINEAR
 static float *stbi__loadf_main(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
@@ -1318,7 +2998,16 @@ STBIDEF float *stbi_loadf_from_callbacks(stbi_io_callbacks const *clbk, void *us
 STBIDEF float *stbi_loadf(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
     float *result;
-    FILE *f = stbi__fopen(filename, "rb");
+    FILE *f;
+#ifdef STBI__MMAP
+    stbi__map m;
+    if (stbi__map_file(&m, filename)) {
+        result = stbi_loadf_from_memory(m.data, m.len, x, y, comp, req_comp);
+        stbi__unmap_file(&m);
+        return result;
+    }
+#endif
+    f = stbi__fopen(filename, "rb");
     if (!f) return stbi__errpf("can't fopen", "Unable to open file");
     result = stbi_loadf_from_file(f, x, y, comp, req_comp);
     fclose(f);
@@ -1331,8 +3020,67 @@ STBIDEF float *stbi_loadf_from_file(FILE *f, int *x, int *y, int *comp, int req_
     stbi__start_file(&s, f);
     return stbi__loadf_main(&s, x, y, comp, req_comp);
 }
+
+STBIDEF float *stbi_loadf_ex(char const *filename, int *x, int *y, int *comp, stbi_load_options *options)
+{
+    float *result;
+    FILE *f;
+#ifdef STBI__MMAP
+    stbi__map m;
+    if (stbi__map_file(&m, filename)) {
+        result = stbi_loadf_from_memory_ex(m.data, m.len, x, y, comp, options);
+        stbi__unmap_file(&m);
+        return result;
+    }
+#endif
+    f = stbi__fopen(filename, "rb");
+    if (!f) {
+        stbi__err("can't fopen", "Unable to open file");
+        options->failure_reason = stbi__g_failure_reason;
+        return NULL;
+    }
+    result = stbi_loadf_from_file_ex(f, x, y, comp, options);
+    fclose(f);
+    return result;
+}
+
+STBIDEF float *stbi_loadf_from_file_ex(FILE *f, int *x, int *y, int *comp, stbi_load_options *options)
+{
+    stbi__context s;
+    stbi__ex_scope scope;
+    float *result;
+    stbi__start_file(&s, f);
+    stbi__ex_begin(&scope, options);
+    result = stbi__loadf_main(&s, x, y, comp, options->desired_channels);
+    stbi__ex_end(&scope, options, result);
+    return result;
+}
 #endif // !STBI_NO_STDIO
 
+STBIDEF float *stbi_loadf_from_memory_ex(stbi_uc const *buffer, int len, int *x, int *y, int *comp, stbi_load_options *options)
+{
+    stbi__context s;
+    stbi__ex_scope scope;
+    float *result;
+    stbi__start_mem(&s, buffer, len);
+    stbi__ex_begin(&scope, options);
+    result = stbi__loadf_main(&s, x, y, comp, options->desired_channels);
+    stbi__ex_end(&scope, options, result);
+    return result;
+}
+
+STBIDEF float *stbi_loadf_from_callbacks_ex(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, stbi_load_options *options)
+{
+    stbi__context s;
+    stbi__ex_scope scope;
+    float *result;
+    stbi__start_callbacks(&s, (stbi_io_callbacks *)clbk, user);
+    stbi__ex_begin(&scope, options);
+    result = stbi__loadf_main(&s, x, y, comp, options->desired_channels);
+    stbi__ex_end(&scope, options, result);
+    return result;
+}
+
 #endif // !STBI_NO_LINEAR
 
 // these is-hdr-or-not is defined independent of whether STBI_NO_LINEAR is
@@ -1355,8 +3103,17 @@ STBIDEF int stbi_is_hdr_from_memory(stbi_uc const *buffer, int len)
 #ifndef STBI_NO_STDIO
 STBIDEF int      stbi_is_hdr(char const *filename)
 {
-    FILE *f = stbi__fopen(filename, "rb");
+    FILE *f;
     int result = 0;
+#ifdef STBI__MMAP
+    stbi__map m;
+    if (stbi__map_file(&m, filename)) {
+        result = stbi_is_hdr_from_memory(m.data, m.len);
+        stbi__unmap_file(&m);
+        return result;
+    }
+#endif
+    f = stbi__fopen(filename, "rb");
     if (f) {
         result = stbi_is_hdr_from_file(f);
         fclose(f);
@@ -1415,9 +3172,169 @@ enum
     STBI__SCAN_header
 };
 
+#ifndef STBI_NO_PNG
+// CRC-32 as used by PNG chunks, kept in its pre-inverted form: start from
+// 0xffffffff and invert at the end
+static stbi__uint32 const stbi__crc_table[256] =
+{
+    0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
+    0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
+    0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
+    0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+    0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
+    0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
+    0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b, 0x35b5a8fa, 0x42b2986c,
+    0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+    0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
+    0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
+    0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190, 0x01db7106,
+    0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+    0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
+    0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
+    0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
+    0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+    0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
+    0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
+    0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
+    0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+    0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
+    0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
+    0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
+    0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+    0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
+    0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
+    0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
+    0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+    0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
+    0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
+    0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
+    0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+    0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
+    0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
+    0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
+    0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+    0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
+    0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
+    0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
+    0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+    0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
+    0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
+    0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
+};
+
+#ifdef STBI__PCLMUL
+// folds 64 bytes at a time with carry-less multiplies, then reduces to 32
+// bits; see Gopal et al, "Fast CRC Computation for Generic Polynomials Using
+// PCLMULQDQ Instruction". len must be a multiple of 16, at least 64
+STBI__PCLMUL_TARGET
+static stbi__uint32 stbi__crc32_pclmul(stbi__uint32 crc, stbi_uc const *p, size_t len)
+{
+    // the paper's bit-reflected constants, as pairs of 64-bit lanes:
+    // k1,k2 = 0x0154442bd4,0x01c6e41596  k3,k4 = 0x01751997d0,0x00ccaa009e
+    // k5 = 0x0163cd6124  P',mu = 0x01db710641,0x01f7011641
+    __m128i k1k2 = _mm_setr_epi32(0x54442bd4, 1, (int)0xc6e41596, 1);
+    __m128i k3k4 = _mm_setr_epi32(0x751997d0, 1, (int)0xccaa009e, 0);
+    __m128i k5k0 = _mm_setr_epi32(0x63cd6124, 1, 0, 0);
+    __m128i poly = _mm_setr_epi32((int)0xdb710641, 1, (int)0xf7011641, 1);
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, lo32;
+
+    x1 = _mm_xor_si128(_mm_loadu_si128((__m128i const *) p), _mm_cvtsi32_si128((int)crc));
+    x2 = _mm_loadu_si128((__m128i const *) (p + 16));
+    x3 = _mm_loadu_si128((__m128i const *) (p + 32));
+    x4 = _mm_loadu_si128((__m128i const *) (p + 48));
+    p += 64;
+    len -= 64;
+
+    // four lanes of 128 bits, each folded 512 bits forward per step
+    x0 = k1k2;
+    for (; len >= 64; p += 64, len -= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((__m128i const *) p));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((__m128i const *) (p + 16)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((__m128i const *) (p + 32)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((__m128i const *) (p + 48)));
+    }
+
+    // fold the lanes into one, then the rest of the data 128 bits at a time
+    x0 = k3k4;
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+    for (; len >= 16; p += 16, len -= 16) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((__m128i const *) p)), x5);
+    }
+
+    // 128 bits to 64
+    lo32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x0 = k5k0;
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, lo32), x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32
+    x0 = poly;
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, lo32), x0, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, lo32), x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (stbi__uint32)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+#endif
+
+static stbi__uint32 stbi__crc32(stbi__uint32 crc, stbi_uc const *p, size_t len, int simd)
+{
+#ifdef STBI__PCLMUL
+    if (simd && len >= 64) {
+        size_t n = len & ~(size_t)15;
+        crc = stbi__crc32_pclmul(crc, p, n);
+        p += n;
+        len -= n;
+    }
+#else
+    STBI_NOTUSED(simd);
+#endif
+    for (; len; --len)
+        crc = stbi__crc_table[(crc ^ *p++) & 255] ^ (crc >> 8);
+    return crc;
+}
+
+// fold the bytes read since crc_from into the context's running CRC
+static void stbi__crc_fold(stbi__context *s)
+{
+    stbi_uc *end = s->img_buffer < s->img_buffer_end ? s->img_buffer : s->img_buffer_end;
+    if (end > s->crc_from)
+        s->crc = stbi__crc32(s->crc, s->crc_from, end - s->crc_from, s->crc_simd);
+    s->crc_from = end;
+}
+#endif
+
 static void stbi__refill_buffer(stbi__context *s)
 {
-    int n = (s->io.read)(s->io_user_data, (char*)s->buffer_start, s->buflen);
+    int n;
+#ifndef STBI_NO_PNG
+    if (s->crc_from) {
+        stbi__crc_fold(s);
+        s->crc_from = s->buffer_start;
+    }
+#endif
+    n = (s->io.read)(s->io_user_data, (char*)s->buffer_start, s->buflen);
+    if (n > 0) STBI__STAT_ADD(bytes_read, (size_t)n);
     if (n == 0) {
         // at end of file, treat same as if from memory, but need to handle case
         // where s->img_buffer isn't pointing to safe memory, e.g. 0-byte file
@@ -1464,6 +3381,19 @@ static void stbi__skip(stbi__context *s, int n)
     if (s->io.read) {
         int blen = (int)(s->img_buffer_end - s->img_buffer);
         if (blen < n) {
+#ifndef STBI_NO_PNG
+            if (s->crc_from) {
+                // the CRC needs to see the skipped bytes, so read them
+                for (;;) {
+                    s->img_buffer += blen;
+                    n -= blen;
+                    if (!n || !s->read_from_callbacks) return;
+                    stbi__refill_buffer(s);
+                    blen = (int)(s->img_buffer_end - s->img_buffer);
+                    if (blen > n) blen = n;
+                }
+            }
+#endif
             s->img_buffer = s->img_buffer_end;
             (s->io.skip)(s->io_user_data, n - blen);
             return;
@@ -1484,6 +3414,15 @@ static int stbi__getn(stbi__context *s, stbi_uc *buffer, int n)
             count = (s->io.read)(s->io_user_data, (char*)buffer + blen, n - blen);
             res = (count == (n - blen));
             s->img_buffer = s->img_buffer_end;
+            if (count > 0) STBI__STAT_ADD(bytes_read, (size_t)count);
+#ifndef STBI_NO_PNG
+            if (s->crc_from) {
+                // the rest went straight to 'buffer'
+                stbi__crc_fold(s);
+                if (count > 0)
+                    s->crc = stbi__crc32(s->crc, buffer + blen, count, s->crc_simd);
+            }
+#endif
             return res;
         }
     }
@@ -1491,11 +3430,44 @@ static int stbi__getn(stbi__context *s, stbi_uc *buffer, int n)
     if (s->img_buffer + n <= s->img_buffer_end) {
         memcpy(buffer, s->img_buffer, n);
         s->img_buffer += n;
-        return 1;
+        return 1;
+    }
+    else
+        return 0;
+}
+
+#if defined(STBI_NO_BMP) && defined(STBI_NO_TGA)
+// nothing
+#else
+// n bytes of pixel data: a pointer straight into the buffer when they're all
+// there, else copied into 'scratch', with zeros past the end of the data
+// just as stbi__get8 would give
+static stbi_uc const *stbi__get_span(stbi__context *s, stbi_uc *scratch, int n)
+{
+    int i = 0;
+    if (s->img_buffer_end - s->img_buffer >= n) {
+        stbi_uc const *p = s->img_buffer;
+        s->img_buffer += n;
+        return p;
+    }
+    while (i < n) {
+        if (s->img_buffer < s->img_buffer_end) {
+            int k = (int)(s->img_buffer_end - s->img_buffer);
+            if (k > n - i) k = n - i;
+            memcpy(scratch + i, s->img_buffer, k);
+            s->img_buffer += k;
+            i += k;
+        }
+        else if (s->read_from_callbacks)
+            stbi__refill_buffer(s);
+        else {
+            memset(scratch + i, 0, n - i);
+            break;
+        }
     }
-    else
-        return 0;
+    return scratch;
 }
+#endif
 
 static int stbi__get16be(stbi__context *s)
 {
@@ -1546,47 +3518,72 @@ static stbi_uc stbi__compute_y(int r, int g, int b)
     return (stbi_uc)(((r * 77) + (g * 150) + (29 * b)) >> 8);
 }
 
+#define STBI__COMBO(a,b)  ((a)*8+(b))
+
+// the common conversions have their own (possibly SIMD) row kernels
+static stbi__row_kernel *stbi__convert_kernel(stbi__pixel_kernels const *k, int img_n, int req_comp)
+{
+    switch (STBI__COMBO(img_n, req_comp)) {
+    case STBI__COMBO(1, 4): return k->grey_to_rgba;
+    case STBI__COMBO(2, 4): return k->grey_alpha_to_rgba;
+    case STBI__COMBO(3, 4): return k->rgb_to_rgba;
+    case STBI__COMBO(4, 3): return k->rgba_to_rgb;
+    default: return NULL;
+    }
+}
+
+// convert one row of x pixels; 'kernel' is what stbi__convert_kernel gave
+static void stbi__convert_row(stbi__row_kernel *kernel, unsigned char *dest, unsigned char const *src, int img_n, int req_comp, unsigned int x)
+{
+    int i;
+
+    if (kernel) {
+        kernel(dest, src, (int)x);
+        return;
+    }
+
+#define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+    // convert source image with img_n components to one with req_comp components;
+    // avoid switch per pixel, so use switch per scanline and massive macros
+    switch (STBI__COMBO(img_n, req_comp)) {
+        STBI__CASE(1, 2) { dest[0] = src[0], dest[1] = 255; } break;
+        STBI__CASE(1, 3) { dest[0] = dest[1] = dest[2] = src[0]; } break;
+        STBI__CASE(2, 1) { dest[0] = src[0]; } break;
+        STBI__CASE(2, 3) { dest[0] = dest[1] = dest[2] = src[0]; } break;
+        STBI__CASE(3, 1) { dest[0] = stbi__compute_y(src[0], src[1], src[2]); } break;
+        STBI__CASE(3, 2) { dest[0] = stbi__compute_y(src[0], src[1], src[2]), dest[1] = 255; } break;
+        STBI__CASE(4, 1) { dest[0] = stbi__compute_y(src[0], src[1], src[2]); } break;
+        STBI__CASE(4, 2) { dest[0] = stbi__compute_y(src[0], src[1], src[2]), dest[1] = src[3]; } break;
+    default: STBI_ASSERT(0);
+    }
+#undef STBI__CASE
+}
+
 static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int req_comp, unsigned int x, unsigned int y)
 {
-    int i, j;
+    int j;
     unsigned char *good;
+    stbi__pixel_kernels k;
+    stbi__row_kernel *kernel;
+    STBI__STAT_TIMER(t)
 
     if (req_comp == img_n) return data;
     STBI_ASSERT(req_comp >= 1 && req_comp <= 4);
 
     good = (unsigned char *)stbi__malloc_mad3(req_comp, x, y, 0);
     if (good == NULL) {
-        STBI_FREE(data);
+        stbi__free(data);
         return stbi__errpuc("outofmem", "Out of memory");
     }
 
-    for (j = 0; j < (int)y; ++j) {
-        unsigned char *src = data + j * x * img_n;
-        unsigned char *dest = good + j * x * req_comp;
-
-#define STBI__COMBO(a,b)  ((a)*8+(b))
-#define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-        // convert source image with img_n components to one with req_comp components;
-        // avoid switch per pixel, so use switch per scanline and massive macros
-        switch (STBI__COMBO(img_n, req_comp)) {
-            STBI__CASE(1, 2) { dest[0] = src[0], dest[1] = 255; } break;
-            STBI__CASE(1, 3) { dest[0] = dest[1] = dest[2] = src[0]; } break;
-            STBI__CASE(1, 4) { dest[0] = dest[1] = dest[2] = src[0], dest[3] = 255; } break;
-            STBI__CASE(2, 1) { dest[0] = src[0]; } break;
-            STBI__CASE(2, 3) { dest[0] = dest[1] = dest[2] = src[0]; } break;
-            STBI__CASE(2, 4) { dest[0] = dest[1] = dest[2] = src[0], dest[3] = src[1]; } break;
-            STBI__CASE(3, 4) { dest[0] = src[0], dest[1] = src[1], dest[2] = src[2], dest[3] = 255; } break;
-            STBI__CASE(3, 1) { dest[0] = stbi__compute_y(src[0], src[1], src[2]); } break;
-            STBI__CASE(3, 2) { dest[0] = stbi__compute_y(src[0], src[1], src[2]), dest[1] = 255; } break;
-            STBI__CASE(4, 1) { dest[0] = stbi__compute_y(src[0], src[1], src[2]); } break;
-            STBI__CASE(4, 2) { dest[0] = stbi__compute_y(src[0], src[1], src[2]), dest[1] = src[3]; } break;
-            STBI__CASE(4, 3) { dest[0] = src[0], dest[1] = src[1], dest[2] = src[2]; } break;
-        default: STBI_ASSERT(0);
-        }
-#undef STBI__CASE
-    }
+    STBI__STAT_START(t);
+    stbi__setup_pixel_kernels(&k);
+    kernel = stbi__convert_kernel(&k, img_n, req_comp);
+    for (j = 0; j < (int)y; ++j)
+        stbi__convert_row(kernel, good + j * x * req_comp, data + j * x * img_n, img_n, req_comp, x);
 
-    STBI_FREE(data);
+    stbi__free(data);
+    STBI__STAT_PASS(t);
     return good;
 }
 
@@ -1595,88 +3592,242 @@ static stbi__uint16 stbi__compute_y_16(int r, int g, int b)
     return (stbi__uint16)(((r * 77) + (g * 150) + (29 * b)) >> 8);
 }
 
+static void stbi__convert_row16(stbi__uint16 *dest, stbi__uint16 const *src, int img_n, int req_comp, unsigned int x)
+{
+    int i;
+
+#define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+    // convert source image with img_n components to one with req_comp components;
+    // avoid switch per pixel, so use switch per scanline and massive macros
+    switch (STBI__COMBO(img_n, req_comp)) {
+        STBI__CASE(1, 2) { dest[0] = src[0], dest[1] = 0xffff; } break;
+        STBI__CASE(1, 3) { dest[0] = dest[1] = dest[2] = src[0]; } break;
+        STBI__CASE(1, 4) { dest[0] = dest[1] = dest[2] = src[0], dest[3] = 0xffff; } break;
+        STBI__CASE(2, 1) { dest[0] = src[0]; } break;
+        STBI__CASE(2, 3) { dest[0] = dest[1] = dest[2] = src[0]; } break;
+        STBI__CASE(2, 4) { dest[0] = dest[1] = dest[2] = src[0], dest[3] = src[1]; } break;
+        STBI__CASE(3, 4) { dest[0] = src[0], dest[1] = src[1], dest[2] = src[2], dest[3] = 0xffff; } break;
+        STBI__CASE(3, 1) { dest[0] = stbi__compute_y_16(src[0], src[1], src[2]); } break;
+        STBI__CASE(3, 2) { dest[0] = stbi__compute_y_16(src[0], src[1], src[2]), dest[1] = 0xffff; } break;
+        STBI__CASE(4, 1) { dest[0] = stbi__compute_y_16(src[0], src[1], src[2]); } break;
+        STBI__CASE(4, 2) { dest[0] = stbi__compute_y_16(src[0], src[1], src[2]), dest[1] = src[3]; } break;
+        STBI__CASE(4, 3) { dest[0] = src[0], dest[1] = src[1], dest[2] = src[2]; } break;
+    default: STBI_ASSERT(0);
+    }
+#undef STBI__CASE
+}
+
 static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int req_comp, unsigned int x, unsigned int y)
 {
-    int i, j;
+    int j;
     stbi__uint16 *good;
+    STBI__STAT_TIMER(t)
 
     if (req_comp == img_n) return data;
     STBI_ASSERT(req_comp >= 1 && req_comp <= 4);
 
     good = (stbi__uint16 *)stbi__malloc(req_comp * x * y * 2);
     if (good == NULL) {
-        STBI_FREE(data);
+        stbi__free(data);
         return (stbi__uint16 *)stbi__errpuc("outofmem", "Out of memory");
     }
 
-    for (j = 0; j < (int)y; ++j) {
-        stbi__uint16 *src = data + j * x * img_n;
-        stbi__uint16 *dest = good + j * x * req_comp;
+    STBI__STAT_START(t);
+    for (j = 0; j < (int)y; ++j)
+        stbi__convert_row16(good + j * x * req_comp, data + j * x * img_n, img_n, req_comp, x);
 
-#define STBI__COMBO(a,b)  ((a)*8+(b))
-#define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-        // convert source image with img_n components to one with req_comp components;
-        // avoid switch per pixel, so use switch per scanline and massive macros
-        switch (STBI__COMBO(img_n, req_comp)) {
-            STBI__CASE(1, 2) { dest[0] = src[0], dest[1] = 0xffff; } break;
-            STBI__CASE(1, 3) { dest[0] = dest[1] = dest[2] = src[0]; } break;
-            STBI__CASE(1, 4) { dest[0] = dest[1] = dest[2] = src[0], dest[3] = 0xffff; } break;
-            STBI__CASE(2, 1) { dest[0] = src[0]; } break;
-            STBI__CASE(2, 3) { dest[0] = dest[1] = dest[2] = src[0]; } break;
-            STBI__CASE(2, 4) { dest[0] = dest[1] = dest[2] = src[0], dest[3] = src[1]; } break;
-            STBI__CASE(3, 4) { dest[0] = src[0], dest[1] = src[1], dest[2] = src[2], dest[3] = 0xffff; } break;
-            STBI__CASE(3, 1) { dest[0] = stbi__compute_y_16(src[0], src[1], src[2]); } break;
-            STBI__CASE(3, 2) { dest[0] = stbi__compute_y_16(src[0], src[1], src[2]), dest[1] = 0xffff; } break;
-            STBI__CASE(4, 1) { dest[0] = stbi__compute_y_16(src[0], src[1], src[2]); } break;
-            STBI__CASE(4, 2) { dest[0] = stbi__compute_y_16(src[0], src[1], src[2]), dest[1] = src[3]; } break;
-            STBI__CASE(4, 3) { dest[0] = src[0], dest[1] = src[1], dest[2] = src[2]; } break;
-        default: STBI_ASSERT(0);
+    stbi__free(data);
+    STBI__STAT_PASS(t);
+    return good;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//  stbi_load_rows*: sending rows to the caller as they're decoded
+//
+
+#ifndef STBI_ROWS_BAND_BYTES
+#define STBI_ROWS_BAND_BYTES  (1 << 16)  // how much of the image stbi_load_rows* may hold at once, where that's up to it
+#endif
+
+// report the image size before the first row. If the options ask for a
+// region, only that part of the image is sent, and it's sent as if it were
+// the whole image; decoders can read the clipped region back from s->roi_*
+// to skip work outside it
+static int stbi__rows_begin(stbi__context *s, int x, int y, int comp, int n)
+{
+    int rw = stbi__option(roi_w, 0), rh = stbi__option(roi_h, 0);
+    s->roi_x0 = s->roi_y0 = 0;
+    s->roi_x1 = x;
+    s->roi_y1 = y;
+    if (rw > 0 && rh > 0) {
+        int rx = stbi__option(roi_x, 0), ry = stbi__option(roi_y, 0);
+        if (rx > 0) s->roi_x0 = rx;
+        if (ry > 0) s->roi_y0 = ry;
+        if (rx < x - rw) s->roi_x1 = rx + rw;
+        if (ry < y - rh) s->roi_y1 = ry + rh;
+    }
+    if (s->roi_x0 >= s->roi_x1 || s->roi_y0 >= s->roi_y1)
+        return stbi__err("bad region", "Region is outside the image");
+    s->rows_left = s->roi_y1 - s->roi_y0;
+    if (!s->rows->begin || s->rows->begin(s->rows_user, s->roi_x1 - s->roi_x0, s->rows_left, comp, n))
+        return 1;
+    return stbi__err("stopped", "Row callback stopped decoding");
+}
+
+// send rows y..y+count-1, holding columns x0 on, converting them from img_n
+// to n components if needed; the scratch used for that is kept until the
+// end of the decode. Returns 0 without an error once the last row has gone
+// out, so decoders stop there (see s->rows_left)
+static int stbi__rows_send(stbi__context *s, int y, int count, stbi_uc *pixels, int stride, int x0, int img_n, int n)
+{
+    int w = s->roi_x1 - s->roi_x0;
+    if (y < s->roi_y0) {
+        pixels += (ptrdiff_t)stride * (s->roi_y0 - y);
+        count -= s->roi_y0 - y;
+        y = s->roi_y0;
+    }
+    if (count > s->roi_y1 - y) count = s->roi_y1 - y;
+    if (count <= 0) return 1;
+    pixels += (s->roi_x0 - x0) * img_n;
+    if (img_n != n) {
+        stbi__pixel_kernels k;
+        stbi__row_kernel *kernel;
+        size_t len = (size_t)count * w * n;
+        int j;
+        if (len > s->rows_buf_len) {
+            stbi__free(s->rows_buf);
+            s->rows_buf = (stbi_uc *)stbi__malloc(len);
+            s->rows_buf_len = s->rows_buf ? len : 0;
+            if (!s->rows_buf) return stbi__err("outofmem", "Out of memory");
         }
-#undef STBI__CASE
+        stbi__setup_pixel_kernels(&k);
+        kernel = stbi__convert_kernel(&k, img_n, n);
+        for (j = 0; j < count; ++j)
+            stbi__convert_row(kernel, s->rows_buf + (size_t)j * w * n, pixels + (ptrdiff_t)j * stride, img_n, n, w);
+        pixels = s->rows_buf;
+        stride = w * n;
     }
-
-    STBI_FREE(data);
-    return good;
+    if (!s->rows->rows(s->rows_user, y - s->roi_y0, count, pixels, stride))
+        return stbi__err("stopped", "Row callback stopped decoding");
+    s->rows_left -= count;
+    return s->rows_left > 0;
 }
 
 #ifndef STBI_NO_LINEAR
 static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
 {
     int i, k, n;
-    float *output;
+    float *output, lut[256];
+    float gamma = stbi__option(ldr_to_hdr_gamma, stbi__l2h_gamma);
+    float scale = stbi__option(ldr_to_hdr_scale, stbi__l2h_scale);
+    STBI__STAT_TIMER(t)
     if (!data) return NULL;
     output = (float *)stbi__malloc_mad4(x, y, comp, sizeof(float), 0);
-    if (output == NULL) { STBI_FREE(data); return stbi__errpf("outofmem", "Out of memory"); }
+    if (output == NULL) { stbi__free(data); return stbi__errpf("outofmem", "Out of memory"); }
+    STBI__STAT_START(t);
+    // there are only 256 inputs, so compute each once
+    for (i = 0; i < 256; ++i)
+        lut[i] = (float)(pow(i / 255.0f, gamma) * scale);
     // compute number of non-alpha components
     if (comp & 1) n = comp; else n = comp - 1;
     for (i = 0; i < x*y; ++i) {
         for (k = 0; k < n; ++k) {
-            output[i*comp + k] = (float)(pow(data[i*comp + k] / 255.0f, stbi__l2h_gamma) * stbi__l2h_scale);
+            output[i*comp + k] = lut[data[i*comp + k]];
         }
         if (k < comp) output[i*comp + k] = data[i*comp + k] / 255.0f;
     }
-    STBI_FREE(data);
+    stbi__free(data);
+    STBI__STAT_PASS(t);
     return output;
 }
 #endif
 
 #ifndef STBI_NO_HDR
 #define stbi__float2int(x)   ((int) (x))
+
+// one channel, exactly as stbi__hdr_to_ldr has always converted it
+static int stbi__hdr_to_ldr_channel(float v, float scale_i, float gamma_i)
+{
+    float z = (float)pow(v * scale_i, gamma_i) * 255 + 0.5f;
+    if (z < 0) z = 0;
+    if (z > 255) z = 255;
+    return stbi__float2int(z);
+}
+
+static float stbi__float_from_bits(stbi__uint32 bits)
+{
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// the smallest float that converts to at least k (1..255). the conversion
+// only ever increases, so over the bit patterns of positive floats (which
+// sort like the floats themselves) bracket the analytic inverse and bisect
+static float stbi__hdr_to_ldr_threshold(int k, float scale_i, float gamma_i)
+{
+    stbi__uint32 lo, hi, mid, step;
+    float guess = (float)(pow((k - 0.5) / 255, 1 / gamma_i) / scale_i);
+    if (guess > 0 && guess < 1e38f)
+        memcpy(&mid, &guess, sizeof(mid));
+    else
+        mid = 0x3f800000; // 1.0f
+    // 0 converts to 0 and infinity to 255, so these always terminate
+    lo = hi = mid;
+    for (step = 1; lo > 0 && stbi__hdr_to_ldr_channel(stbi__float_from_bits(lo), scale_i, gamma_i) >= k; step *= 2)
+        lo = lo > step ? lo - step : 0;
+    for (step = 1; hi < 0x7f800000 && stbi__hdr_to_ldr_channel(stbi__float_from_bits(hi), scale_i, gamma_i) < k; step *= 2)
+        hi = 0x7f800000 - hi > step ? hi + step : 0x7f800000;
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (stbi__hdr_to_ldr_channel(stbi__float_from_bits(mid), scale_i, gamma_i) >= k)
+            hi = mid;
+        else
+            lo = mid;
+    }
+    return stbi__float_from_bits(hi);
+}
+
 static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
 {
     int i, k, n;
     stbi_uc *output;
+    float threshold[256];
+    float gamma_i = stbi__options ? 1 / stbi__options->hdr_to_ldr_gamma : stbi__h2l_gamma_i;
+    float scale_i = stbi__options ? 1 / stbi__options->hdr_to_ldr_scale : stbi__h2l_scale_i;
+    // with positive settings the conversion is monotonic, so instead of a
+    // pow() per channel, find the 255 inputs where the output steps up and
+    // binary search them; same results, bit for bit
+    int search = gamma_i > 0 && scale_i > 0 && gamma_i < 1e38f && scale_i < 1e38f;
+    STBI__STAT_TIMER(t)
     if (!data) return NULL;
     output = (stbi_uc *)stbi__malloc_mad3(x, y, comp, 0);
-    if (output == NULL) { STBI_FREE(data); return stbi__errpuc("outofmem", "Out of memory"); }
+    if (output == NULL) { stbi__free(data); return stbi__errpuc("outofmem", "Out of memory"); }
+    STBI__STAT_START(t);
+    if (search)
+        for (k = 1; k < 256; ++k)
+            threshold[k] = stbi__hdr_to_ldr_threshold(k, scale_i, gamma_i);
     // compute number of non-alpha components
     if (comp & 1) n = comp; else n = comp - 1;
     for (i = 0; i < x*y; ++i) {
         for (k = 0; k < n; ++k) {
-            float z = (float)pow(data[i*comp + k] * stbi__h2l_scale_i, stbi__h2l_gamma_i) * 255 + 0.5f;
-            if (z < 0) z = 0;
-            if (z > 255) z = 255;
-            output[i*comp + k] = (stbi_uc)stbi__float2int(z);
+            float v = data[i*comp + k];
+            if (search && v >= 0) {
+                // count the thresholds <= v
+                int j = 0;
+                if (v >= threshold[j + 128]) j += 128;
+                if (v >= threshold[j + 64]) j += 64;
+                if (v >= threshold[j + 32]) j += 32;
+                if (v >= threshold[j + 16]) j += 16;
+                if (v >= threshold[j + 8]) j += 8;
+                if (v >= threshold[j + 4]) j += 4;
+                if (v >= threshold[j + 2]) j += 2;
+                if (v >= threshold[j + 1]) j += 1;
+                output[i*comp + k] = (stbi_uc)j;
+            }
+            else
+                output[i*comp + k] = (stbi_uc)stbi__hdr_to_ldr_channel(v, scale_i, gamma_i);
         }
         if (k < comp) {
             float z = data[i*comp + k] * 255 + 0.5f;
@@ -1685,7 +3836,8 @@ static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
             output[i*comp + k] = (stbi_uc)stbi__float2int(z);
         }
     }
-    STBI_FREE(data);
+    stbi__free(data);
+    STBI__STAT_PASS(t);
     return output;
 }
 #endif
@@ -1750,14 +3902,17 @@ typedef struct
         int dc_pred;
 
         int x, y, w2, h2;
+        int strip_y;      // first row that data holds; nonzero only for a strip (see stream below)
         stbi_uc *data;
         void *raw_data, *raw_coeff;
         stbi_uc *linebuf;
         short   *coeff;   // progressive only
         int      coeff_w, coeff_h; // number of 8x8 coefficient blocks
+        stbi__uint64 coeff_final;  // coefficients that have all their bits
     } img_comp[4];
+    short coeff_scratch[64];   // stands in for blocks of finished components
 
-    stbi__uint32   code_buffer; // jpeg entropy-coded buffer
+    stbi__uint64   code_buffer; // jpeg entropy-coded buffer, msb-aligned
     int            code_bits;   // number of valid bits
     unsigned char  marker;      // marker seen while filling entropy buffer
     int            nomore;      // flag if we saw a marker so must stop
@@ -1772,11 +3927,28 @@ typedef struct
 
     int scan_n, order[4];
     int restart_interval, todo;
+    int scale_shift;   // components are decoded at 1/(1 << scale_shift) size
+
+    // stbi_load_rows*: the components hold a strip of rows rather than the
+    // whole image, and output rows are sent as soon as the strips cover them
+    int stream, stream_req;         // streaming, and the channels requested
+    int stream_h, stream_units;     // unit rows in the scan, and how many are decoded
+    stbi__uint32 stream_next;       // next output row to send
+    stbi_uc *stream_out;            // a band of converted rows
+
+    // the MCUs worth decoding (all of them unless there's a region), and
+    // the columns of the image that get color-converted
+    int roi_mx0, roi_my0, roi_mx1, roi_my1;
+    int conv_x0, conv_w;
 
     // kernels
     void(*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
+    // optional: dequantize (unless dequant is NULL) and idct two blocks at once
+    void(*idct_pair_kernel)(stbi_uc *out0, stbi_uc *out1, int out_stride, short *data0, short *data1, stbi_uc const *dequant);
     void(*YCbCr_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
     stbi_uc *(*resample_row_hv_2_kernel)(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs);
+    // optional: 2x chroma upsampling fused with YCbCr_to_RGB_kernel
+    void(*YCbCr_upsample_kernel)(stbi_uc *out, stbi_uc const *y, stbi_uc const *cb_near, stbi_uc const *cb_far, stbi_uc const *cr_near, stbi_uc const *cr_far, int w, int count, int v2, int step);
 } stbi__jpeg;
 
 static int stbi__build_huffman(stbi__huffman *h, int *count)
@@ -1834,7 +4006,13 @@ static void stbi__build_fast_ac(stbi__int16 *fast_ac, stbi__huffman *h)
             int magbits = rs & 15;
             int len = h->size[fast];
 
-            if (magbits && len + magbits <= FAST_BITS) {
+            if (!magbits) {
+                // end-of-block and run-of-16-zeros get a zero value so the
+                // decode loops can tell them apart without the slow path
+                if (rs == 0x00 || rs == 0xf0)
+                    fast_ac[i] = (stbi__int16)((run << 4) + len);
+            }
+            else if (len + magbits <= FAST_BITS) {
                 // magnitude code followed by receive_extend code
                 int k = ((i << len) & ((1 << FAST_BITS) - 1)) >> (FAST_BITS - magbits);
                 int m = 1 << (magbits - 1);
@@ -1849,24 +4027,35 @@ static void stbi__build_fast_ac(stbi__int16 *fast_ac, stbi__huffman *h)
 
 static void stbi__grow_buffer_unsafe(stbi__jpeg *j)
 {
+    stbi__context *s = j->s;
     do {
-        int b = j->nomore ? 0 : stbi__get8(j->s);
+        int b;
+        if (!j->nomore) {
+            // plain bytes go straight from the buffer; 0xff stuffing, markers
+            // and buffer refills are left to the byte-at-a-time path below
+            stbi_uc *p = s->img_buffer, *e = s->img_buffer_end;
+            if (e - p > (64 - j->code_bits) / 8) e = p + (64 - j->code_bits) / 8;
+            while (p < e && *p != 0xff) {
+                j->code_buffer |= (stbi__uint64)*p++ << (56 - j->code_bits);
+                j->code_bits += 8;
+            }
+            s->img_buffer = p;
+            if (j->code_bits > 56) return;
+        }
+        b = j->nomore ? 0 : stbi__get8(s);
         if (b == 0xff) {
-            int c = stbi__get8(j->s);
+            int c = stbi__get8(s);
             if (c != 0) {
                 j->marker = (unsigned char)c;
                 j->nomore = 1;
                 return;
             }
         }
-        j->code_buffer |= b << (24 - j->code_bits);
+        j->code_buffer |= (stbi__uint64)b << (56 - j->code_bits);
         j->code_bits += 8;
-    } while (j->code_bits <= 24);
+    } while (j->code_bits <= 56);
 }
 
-// (1 << n) - 1
-static stbi__uint32 stbi__bmask[17] = { 0,1,3,7,15,31,63,127,255,511,1023,2047,4095,8191,16383,32767,65535 };
-
 // decode a jpeg huffman value from the bitstream
 stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
 {
@@ -1877,7 +4066,7 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
 
     // look at the top FAST_BITS and determine what symbol ID it is,
     // if the code is <= FAST_BITS
-    c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS) - 1);
+    c = (int)(j->code_buffer >> (64 - FAST_BITS));
     k = h->fast[c];
     if (k < 255) {
         int s = h->size[k];
@@ -1894,7 +4083,7 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
     // end; in other words, regardless of the number of bits, it
     // wants to be compared against something shifted to have 16;
     // that way we don't need to shift inside the loop.
-    temp = j->code_buffer >> 16;
+    temp = (unsigned int)(j->code_buffer >> 48);
     for (k = FAST_BITS + 1; ; ++k)
         if (temp < h->maxcode[k])
             break;
@@ -1908,8 +4097,8 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
         return -1;
 
     // convert the huffman code to the symbol id
-    c = ((j->code_buffer >> (32 - k)) & stbi__bmask[k]) + h->delta[k];
-    STBI_ASSERT((((j->code_buffer) >> (32 - h->size[c])) & stbi__bmask[h->size[c]]) == h->code[c]);
+    c = (int)(j->code_buffer >> (64 - k)) + h->delta[k];
+    STBI_ASSERT((int)(j->code_buffer >> (64 - h->size[c])) == h->code[c]);
 
     // convert the id to a symbol
     j->code_bits -= k;
@@ -1928,11 +4117,10 @@ stbi_inline static int stbi__extend_receive(stbi__jpeg *j, int n)
     int sgn;
     if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
 
-    sgn = (stbi__int32)j->code_buffer >> 31; // sign bit is always in MSB
-    k = stbi_lrot(j->code_buffer, n);
-    STBI_ASSERT(n >= 0 && n < (int)(sizeof(stbi__bmask) / sizeof(*stbi__bmask)));
-    j->code_buffer = k & ~stbi__bmask[n];
-    k &= stbi__bmask[n];
+    sgn = (stbi__int32)(j->code_buffer >> 32) >> 31; // sign bit is always in MSB
+    STBI_ASSERT(n > 0 && n <= 16);
+    k = (unsigned int)(j->code_buffer >> (64 - n));
+    j->code_buffer <<= n;
     j->code_bits -= n;
     return k + (stbi__jbias[n] & ~sgn);
 }
@@ -1942,9 +4130,9 @@ stbi_inline static int stbi__jpeg_get_bits(stbi__jpeg *j, int n)
 {
     unsigned int k;
     if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
-    k = stbi_lrot(j->code_buffer, n);
-    j->code_buffer = k & ~stbi__bmask[n];
-    k &= stbi__bmask[n];
+    STBI_ASSERT(n > 0 && n <= 16);
+    k = (unsigned int)(j->code_buffer >> (64 - n));
+    j->code_buffer <<= n;
     j->code_bits -= n;
     return k;
 }
@@ -1953,10 +4141,10 @@ stbi_inline static int stbi__jpeg_get_bit(stbi__jpeg *j)
 {
     unsigned int k;
     if (j->code_bits < 1) stbi__grow_buffer_unsafe(j);
-    k = j->code_buffer;
+    k = (unsigned int)(j->code_buffer >> 63);
     j->code_buffer <<= 1;
     --j->code_bits;
-    return k & 0x80000000;
+    return k;
 }
 
 // given a value that's at position X in the zigzag stream,
@@ -1984,7 +4172,7 @@ static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman
 
     if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
     t = stbi__jpeg_huff_decode(j, hdc);
-    if (t < 0) return stbi__err("bad huffman code", "Corrupt JPEG");
+    if (t < 0 || t > 15) return stbi__err("bad huffman code", "Corrupt JPEG");
 
     // 0 all the ac values now so we can do it 32-bits at a time
     memset(data, 0, 64 * sizeof(data[0]));
@@ -2000,13 +4188,18 @@ static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman
         unsigned int zig;
         int c, r, s;
         if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-        c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS) - 1);
+        c = (int)(j->code_buffer >> (64 - FAST_BITS));
         r = fac[c];
         if (r) { // fast-AC path
-            k += (r >> 4) & 15; // run
             s = r & 15; // combined length
             j->code_buffer <<= s;
             j->code_bits -= s;
+            if ((r >> 8) == 0) { // no value: end of block or 16 zeros
+                if (!(r & 0xf0)) break;
+                k += 16;
+                continue;
+            }
+            k += (r >> 4) & 15; // run
             // decode into unzigzag'd location
             zig = stbi__jpeg_dezigzag[k++];
             data[zig] = (short)((r >> 8) * dequant[zig]);
@@ -2043,6 +4236,7 @@ static int stbi__jpeg_decode_block_prog_dc(stbi__jpeg *j, short data[64], stbi__
         // first scan for DC coefficient, must be first
         memset(data, 0, 64 * sizeof(data[0])); // 0 all the ac values now
         t = stbi__jpeg_huff_decode(j, hdc);
+        if (t < 0 || t > 15) return stbi__err("bad huffman code", "Corrupt JPEG");
         diff = t ? stbi__extend_receive(j, t) : 0;
 
         dc = j->img_comp[b].dc_pred + diff;
@@ -2077,13 +4271,18 @@ static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__
             unsigned int zig;
             int c, r, s;
             if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-            c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS) - 1);
+            c = (int)(j->code_buffer >> (64 - FAST_BITS));
             r = fac[c];
             if (r) { // fast-AC path
-                k += (r >> 4) & 15; // run
                 s = r & 15; // combined length
                 j->code_buffer <<= s;
                 j->code_bits -= s;
+                if ((r >> 8) == 0) { // no value: EOB0 or 16 zeros
+                    if (!(r & 0xf0)) break;
+                    k += 16;
+                    continue;
+                }
+                k += (r >> 4) & 15; // run
                 zig = stbi__jpeg_dezigzag[k++];
                 data[zig] = (short)((r >> 8) << shift);
             }
@@ -2297,6 +4496,64 @@ static void stbi__idct_block(stbi_uc *out, int out_stride, short data[64])
     }
 }
 
+// reduced IDCTs for scaled decoding. an n x n output pixel is the average of
+// the (8/n) x (8/n) square the full IDCT would give, approximated from the
+// n x n lowest frequencies. entry [x][u] is 0.5*c(u)*cos((2x+1)u*pi/2n)
+// times the cos(u*pi/16), cos(u*pi/8) factors of averaging, in 12 bits
+static const short stbi__idct4_coeff[4][4] =
+{
+    { 1448,  1856,  1338,   652 },
+    { 1448,   769, -1338, -1573 },
+    { 1448,  -769, -1338,  1573 },
+    { 1448, -1856,  1338,  -652 },
+};
+
+static const short stbi__idct2_coeff[2][2] =
+{
+    { 1448,  1312 },
+    { 1448, -1312 },
+};
+
+static void stbi__idct_reduced(stbi_uc *out, int out_stride, short data[64], int n, const short *m)
+{
+    int tmp[16], i, j, u;
+    // rows, for the n lowest vertical frequencies
+    for (j = 0; j < n; ++j) {
+        for (i = 0; i < n; ++i) {
+            int t = 0;
+            for (u = 0; u < n; ++u)
+                t += m[i * n + u] * data[j * 8 + u];
+            tmp[j * n + i] = (t + 2048) >> 12;
+        }
+    }
+    // columns, then undo the level shift
+    for (j = 0; j < n; ++j, out += out_stride) {
+        for (i = 0; i < n; ++i) {
+            int t = 0;
+            for (u = 0; u < n; ++u)
+                t += m[j * n + u] * tmp[u * n + i];
+            out[i] = stbi__clamp(((t + 2048) >> 12) + 128);
+        }
+    }
+}
+
+static void stbi__idct_4x4(stbi_uc *out, int out_stride, short data[64])
+{
+    stbi__idct_reduced(out, out_stride, data, 4, stbi__idct4_coeff[0]);
+}
+
+static void stbi__idct_2x2(stbi_uc *out, int out_stride, short data[64])
+{
+    stbi__idct_reduced(out, out_stride, data, 2, stbi__idct2_coeff[0]);
+}
+
+static void stbi__idct_1x1(stbi_uc *out, int out_stride, short data[64])
+{
+    // the dc coefficient is 8x the block average
+    STBI_NOTUSED(out_stride);
+    out[0] = stbi__clamp(((data[0] + 4) >> 3) + 128);
+}
+
 #ifdef STBI_SSE2
 // sse2 integer IDCT. not the fastest possible implementation but it
 // produces bit-identical results to the generic C version so it's
@@ -2373,8 +4630,180 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
          /* odd part */ \
          dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
          dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
-         __m128i sum17 = _mm_add_epi16(row1, row7); \
-         __m128i sum35 = _mm_add_epi16(row3, row5); \
+         __m128i sum17 = _mm_add_epi16(row1, row7); \
+         __m128i sum35 = _mm_add_epi16(row3, row5); \
+         dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+         dct_wadd(x4, y0o, y4o); \
+         dct_wadd(x5, y1o, y5o); \
+         dct_wadd(x6, y2o, y5o); \
+         dct_wadd(x7, y3o, y4o); \
+         dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+      }
+
+    __m128i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+    __m128i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f(0.765366865f), stbi__f2f(0.5411961f));
+    __m128i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+    __m128i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+    __m128i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f(0.298631336f), stbi__f2f(-1.961570560f));
+    __m128i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f(3.072711026f));
+    __m128i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f(2.053119869f), stbi__f2f(-0.390180644f));
+    __m128i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f(1.501321110f));
+
+    // rounding biases in column/row passes, see stbi__idct_block for explanation.
+    __m128i bias_0 = _mm_set1_epi32(512);
+    __m128i bias_1 = _mm_set1_epi32(65536 + (128 << 17));
+
+    // load
+    row0 = _mm_load_si128((const __m128i *) (data + 0 * 8));
+    row1 = _mm_load_si128((const __m128i *) (data + 1 * 8));
+    row2 = _mm_load_si128((const __m128i *) (data + 2 * 8));
+    row3 = _mm_load_si128((const __m128i *) (data + 3 * 8));
+    row4 = _mm_load_si128((const __m128i *) (data + 4 * 8));
+    row5 = _mm_load_si128((const __m128i *) (data + 5 * 8));
+    row6 = _mm_load_si128((const __m128i *) (data + 6 * 8));
+    row7 = _mm_load_si128((const __m128i *) (data + 7 * 8));
+
+    // column pass
+    dct_pass(bias_0, 10);
+
+    {
+        // 16bit 8x8 transpose pass 1
+        dct_interleave16(row0, row4);
+        dct_interleave16(row1, row5);
+        dct_interleave16(row2, row6);
+        dct_interleave16(row3, row7);
+
+        // transpose pass 2
+        dct_interleave16(row0, row2);
+        dct_interleave16(row1, row3);
+        dct_interleave16(row4, row6);
+        dct_interleave16(row5, row7);
+
+        // transpose pass 3
+        dct_interleave16(row0, row1);
+        dct_interleave16(row2, row3);
+        dct_interleave16(row4, row5);
+        dct_interleave16(row6, row7);
+    }
+
+    // row pass
+    dct_pass(bias_1, 17);
+
+    {
+        // pack
+        __m128i p0 = _mm_packus_epi16(row0, row1); // a0a1a2a3...a7b0b1b2b3...b7
+        __m128i p1 = _mm_packus_epi16(row2, row3);
+        __m128i p2 = _mm_packus_epi16(row4, row5);
+        __m128i p3 = _mm_packus_epi16(row6, row7);
+
+        // 8bit 8x8 transpose pass 1
+        dct_interleave8(p0, p2); // a0e0a1e1...
+        dct_interleave8(p1, p3); // c0g0c1g1...
+
+                                 // transpose pass 2
+        dct_interleave8(p0, p1); // a0c0e0g0...
+        dct_interleave8(p2, p3); // b0d0f0h0...
+
+                                 // transpose pass 3
+        dct_interleave8(p0, p2); // a0b0c0d0...
+        dct_interleave8(p1, p3); // a4b4c4d4...
+
+                                 // store
+        _mm_storel_epi64((__m128i *) out, p0); out += out_stride;
+        _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p0, 0x4e)); out += out_stride;
+        _mm_storel_epi64((__m128i *) out, p2); out += out_stride;
+        _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p2, 0x4e)); out += out_stride;
+        _mm_storel_epi64((__m128i *) out, p1); out += out_stride;
+        _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p1, 0x4e)); out += out_stride;
+        _mm_storel_epi64((__m128i *) out, p3); out += out_stride;
+        _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p3, 0x4e));
+    }
+
+#undef dct_const
+#undef dct_rot
+#undef dct_widen
+#undef dct_wadd
+#undef dct_wsub
+#undef dct_bfly32o
+#undef dct_interleave8
+#undef dct_interleave16
+#undef dct_pass
+}
+
+#endif // STBI_SSE2
+
+#ifdef STBI__AVX2
+// avx2 version of stbi__idct_simd that does two blocks at once, one in each
+// 128-bit lane. every step is the sse2 one applied per lane, so the results
+// are bit-identical. dequantization is folded into the loads.
+STBI__AVX2_TARGET
+static void stbi__idct_avx2_pair(stbi_uc *out0, stbi_uc *out1, int out_stride, short *data0, short *data1, stbi_uc const *dequant)
+{
+    __m256i row0, row1, row2, row3, row4, row5, row6, row7;
+    __m256i tmp;
+
+#define dct_const(x,y)  _mm256_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y))
+
+#define dct_rot(out0,out1, x,y,c0,c1) \
+      __m256i c0##lo = _mm256_unpacklo_epi16((x),(y)); \
+      __m256i c0##hi = _mm256_unpackhi_epi16((x),(y)); \
+      __m256i out0##_l = _mm256_madd_epi16(c0##lo, c0); \
+      __m256i out0##_h = _mm256_madd_epi16(c0##hi, c0); \
+      __m256i out1##_l = _mm256_madd_epi16(c0##lo, c1); \
+      __m256i out1##_h = _mm256_madd_epi16(c0##hi, c1)
+
+#define dct_widen(out, in) \
+      __m256i out##_l = _mm256_srai_epi32(_mm256_unpacklo_epi16(_mm256_setzero_si256(), (in)), 4); \
+      __m256i out##_h = _mm256_srai_epi32(_mm256_unpackhi_epi16(_mm256_setzero_si256(), (in)), 4)
+
+#define dct_wadd(out, a, b) \
+      __m256i out##_l = _mm256_add_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_add_epi32(a##_h, b##_h)
+
+#define dct_wsub(out, a, b) \
+      __m256i out##_l = _mm256_sub_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_sub_epi32(a##_h, b##_h)
+
+#define dct_bfly32o(out0, out1, a,b,bias,s) \
+      { \
+         __m256i abiased_l = _mm256_add_epi32(a##_l, bias); \
+         __m256i abiased_h = _mm256_add_epi32(a##_h, bias); \
+         dct_wadd(sum, abiased, b); \
+         dct_wsub(dif, abiased, b); \
+         out0 = _mm256_packs_epi32(_mm256_srai_epi32(sum_l, s), _mm256_srai_epi32(sum_h, s)); \
+         out1 = _mm256_packs_epi32(_mm256_srai_epi32(dif_l, s), _mm256_srai_epi32(dif_h, s)); \
+      }
+
+#define dct_interleave8(a, b) \
+      tmp = a; \
+      a = _mm256_unpacklo_epi8(a, b); \
+      b = _mm256_unpackhi_epi8(tmp, b)
+
+#define dct_interleave16(a, b) \
+      tmp = a; \
+      a = _mm256_unpacklo_epi16(a, b); \
+      b = _mm256_unpackhi_epi16(tmp, b)
+
+#define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+         __m256i sum04 = _mm256_add_epi16(row0, row4); \
+         __m256i dif04 = _mm256_sub_epi16(row0, row4); \
+         dct_widen(t0e, sum04); \
+         dct_widen(t1e, dif04); \
+         dct_wadd(x0, t0e, t3e); \
+         dct_wsub(x3, t0e, t3e); \
+         dct_wadd(x1, t1e, t2e); \
+         dct_wsub(x2, t1e, t2e); \
+         /* odd part */ \
+         dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+         dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+         __m256i sum17 = _mm256_add_epi16(row1, row7); \
+         __m256i sum35 = _mm256_add_epi16(row3, row5); \
          dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
          dct_wadd(x4, y0o, y4o); \
          dct_wadd(x5, y1o, y5o); \
@@ -2386,28 +4815,47 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
          dct_bfly32o(row3,row4, x3,x4,bias,shift); \
       }
 
-    __m128i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
-    __m128i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f(0.765366865f), stbi__f2f(0.5411961f));
-    __m128i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
-    __m128i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
-    __m128i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f(0.298631336f), stbi__f2f(-1.961570560f));
-    __m128i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f(3.072711026f));
-    __m128i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f(2.053119869f), stbi__f2f(-0.390180644f));
-    __m128i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f(1.501321110f));
+    // row r of block 0 in the low lane, row r of block 1 in the high lane
+#define dct_load(r) \
+      _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) (data0 + (r) * 8))), \
+         _mm_loadu_si128((const __m128i *) (data1 + (r) * 8)), 1)
+
+    // same 8 dequantization factors for both lanes
+#define dct_dequant(row, r) \
+      row = _mm256_mullo_epi16(row, _mm256_broadcastsi128_si256(_mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *) (dequant + (r) * 8)))))
+
+    __m256i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+    __m256i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f(0.765366865f), stbi__f2f(0.5411961f));
+    __m256i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+    __m256i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+    __m256i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f(0.298631336f), stbi__f2f(-1.961570560f));
+    __m256i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f(3.072711026f));
+    __m256i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f(2.053119869f), stbi__f2f(-0.390180644f));
+    __m256i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f(1.501321110f));
 
     // rounding biases in column/row passes, see stbi__idct_block for explanation.
-    __m128i bias_0 = _mm_set1_epi32(512);
-    __m128i bias_1 = _mm_set1_epi32(65536 + (128 << 17));
+    __m256i bias_0 = _mm256_set1_epi32(512);
+    __m256i bias_1 = _mm256_set1_epi32(65536 + (128 << 17));
 
     // load
-    row0 = _mm_load_si128((const __m128i *) (data + 0 * 8));
-    row1 = _mm_load_si128((const __m128i *) (data + 1 * 8));
-    row2 = _mm_load_si128((const __m128i *) (data + 2 * 8));
-    row3 = _mm_load_si128((const __m128i *) (data + 3 * 8));
-    row4 = _mm_load_si128((const __m128i *) (data + 4 * 8));
-    row5 = _mm_load_si128((const __m128i *) (data + 5 * 8));
-    row6 = _mm_load_si128((const __m128i *) (data + 6 * 8));
-    row7 = _mm_load_si128((const __m128i *) (data + 7 * 8));
+    row0 = dct_load(0);
+    row1 = dct_load(1);
+    row2 = dct_load(2);
+    row3 = dct_load(3);
+    row4 = dct_load(4);
+    row5 = dct_load(5);
+    row6 = dct_load(6);
+    row7 = dct_load(7);
+    if (dequant) {
+        dct_dequant(row0, 0);
+        dct_dequant(row1, 1);
+        dct_dequant(row2, 2);
+        dct_dequant(row3, 3);
+        dct_dequant(row4, 4);
+        dct_dequant(row5, 5);
+        dct_dequant(row6, 6);
+        dct_dequant(row7, 7);
+    }
 
     // column pass
     dct_pass(bias_0, 10);
@@ -2437,32 +4885,33 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
 
     {
         // pack
-        __m128i p0 = _mm_packus_epi16(row0, row1); // a0a1a2a3...a7b0b1b2b3...b7
-        __m128i p1 = _mm_packus_epi16(row2, row3);
-        __m128i p2 = _mm_packus_epi16(row4, row5);
-        __m128i p3 = _mm_packus_epi16(row6, row7);
-
-        // 8bit 8x8 transpose pass 1
-        dct_interleave8(p0, p2); // a0e0a1e1...
-        dct_interleave8(p1, p3); // c0g0c1g1...
-
-                                 // transpose pass 2
-        dct_interleave8(p0, p1); // a0c0e0g0...
-        dct_interleave8(p2, p3); // b0d0f0h0...
-
-                                 // transpose pass 3
-        dct_interleave8(p0, p2); // a0b0c0d0...
-        dct_interleave8(p1, p3); // a4b4c4d4...
+        __m256i p0 = _mm256_packus_epi16(row0, row1);
+        __m256i p1 = _mm256_packus_epi16(row2, row3);
+        __m256i p2 = _mm256_packus_epi16(row4, row5);
+        __m256i p3 = _mm256_packus_epi16(row6, row7);
+        __m128i q[8];
+        int k;
 
-                                 // store
-        _mm_storel_epi64((__m128i *) out, p0); out += out_stride;
-        _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p0, 0x4e)); out += out_stride;
-        _mm_storel_epi64((__m128i *) out, p2); out += out_stride;
-        _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p2, 0x4e)); out += out_stride;
-        _mm_storel_epi64((__m128i *) out, p1); out += out_stride;
-        _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p1, 0x4e)); out += out_stride;
-        _mm_storel_epi64((__m128i *) out, p3); out += out_stride;
-        _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p3, 0x4e));
+        // 8bit 8x8 transpose
+        dct_interleave8(p0, p2);
+        dct_interleave8(p1, p3);
+        dct_interleave8(p0, p1);
+        dct_interleave8(p2, p3);
+        dct_interleave8(p0, p2);
+        dct_interleave8(p1, p3);
+
+        // store: rows 0-7 come out of p0,p0',p2,p2',p1,p1',p3,p3' per lane
+        q[0] = _mm256_castsi256_si128(p0); q[1] = _mm256_extracti128_si256(p0, 1);
+        q[2] = _mm256_castsi256_si128(p2); q[3] = _mm256_extracti128_si256(p2, 1);
+        q[4] = _mm256_castsi256_si128(p1); q[5] = _mm256_extracti128_si256(p1, 1);
+        q[6] = _mm256_castsi256_si128(p3); q[7] = _mm256_extracti128_si256(p3, 1);
+        for (k = 0; k < 4; ++k) {
+            __m128i lo = q[k * 2], hi = q[k * 2 + 1];
+            _mm_storel_epi64((__m128i *) out0, lo); out0 += out_stride;
+            _mm_storel_epi64((__m128i *) out0, _mm_shuffle_epi32(lo, 0x4e)); out0 += out_stride;
+            _mm_storel_epi64((__m128i *) out1, hi); out1 += out_stride;
+            _mm_storel_epi64((__m128i *) out1, _mm_shuffle_epi32(hi, 0x4e)); out1 += out_stride;
+        }
     }
 
 #undef dct_const
@@ -2474,9 +4923,10 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
 #undef dct_interleave8
 #undef dct_interleave16
 #undef dct_pass
+#undef dct_load
+#undef dct_dequant
 }
-
-#endif // STBI_SSE2
+#endif // STBI__AVX2
 
 #ifdef STBI_NEON
 
@@ -2720,68 +5170,322 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
     // since we don't even allow 1<<30 pixels
 }
 
+// baseline blocks are idct'd in pairs when there's a two-block kernel: each
+// decoded block is held back until the next one with the same stride arrives
+typedef struct
+{
+    STBI_SIMD_ALIGN(short, data[2][64]);
+    short *pending;
+    stbi_uc *out;
+    int out_stride;
+} stbi__idct_queue;
+
+static void stbi__idct_queue_init(stbi__idct_queue *q)
+{
+    q->pending = NULL;
+}
+
+// where the next block should be decoded to
+static short *stbi__idct_queue_slot(stbi__idct_queue *q)
+{
+    return q->pending == q->data[0] ? q->data[1] : q->data[0];
+}
+
+static void stbi__idct_queue_flush(stbi__jpeg *z, stbi__idct_queue *q)
+{
+    if (q->pending) {
+        z->idct_block_kernel(q->out, q->out_stride, q->pending);
+        q->pending = NULL;
+        STBI__STAT_ADD(idct_blocks, 1);
+    }
+}
+
+static void stbi__idct_queue_push(stbi__jpeg *z, stbi__idct_queue *q, stbi_uc *out, int out_stride)
+{
+    short *data = stbi__idct_queue_slot(q);
+    if (!z->idct_pair_kernel) {
+        z->idct_block_kernel(out, out_stride, data);
+        STBI__STAT_ADD(idct_blocks, 1);
+        return;
+    }
+    if (q->pending && q->out_stride == out_stride) {
+        z->idct_pair_kernel(q->out, out, out_stride, q->pending, data, NULL);
+        q->pending = NULL;
+        STBI__STAT_ADD(idct_blocks, 2);
+        return;
+    }
+    stbi__idct_queue_flush(z, q);
+    q->pending = data;
+    q->out = out;
+    q->out_stride = out_stride;
+}
+
+// whether block i,j of component n lies in an MCU worth decoding; the others
+// only need entropy decoding, to get past them
+stbi_inline static int stbi__jpeg_block_needed(stbi__jpeg *z, int n, int i, int j)
+{
+    int h = z->img_comp[n].h, v = z->img_comp[n].v;
+    return i >= z->roi_mx0 * h && i < z->roi_mx1 * h && j >= z->roi_my0 * v && j < z->roi_my1 * v;
+}
+
+// whether any unit from u on, up to the end of its restart interval, is
+// worth decoding, in a scan w units wide and h high
+static int stbi__jpeg_interval_needed(stbi__jpeg *z, int u, int w, int h)
+{
+    int u_end = u + z->restart_interval < w * h ? u + z->restart_interval : w * h;
+    int n = z->order[0];
+    for (; u < u_end; u = (u / w + 1) * w) {
+        // the units of row u/w from u on
+        int j = u / w, i0 = u % w, i1 = u_end - j * w < w ? u_end - j * w : w;
+        if (z->scan_n == 1) {
+            if (j >= z->roi_my0 * z->img_comp[n].v && j < z->roi_my1 * z->img_comp[n].v &&
+                i0 < z->roi_mx1 * z->img_comp[n].h && i1 > z->roi_mx0 * z->img_comp[n].h)
+                return 1;
+        }
+        else if (j >= z->roi_my0 && j < z->roi_my1 && i0 < z->roi_mx1 && i1 > z->roi_mx0)
+            return 1;
+    }
+    return 0;
+}
+
+// pass over the entropy-coded data of a restart interval without decoding
+// it, leaving the marker after it for stbi__grow_buffer_unsafe to report
+static void stbi__jpeg_skip_interval(stbi__jpeg *z)
+{
+    stbi__context *s = z->s;
+    for (;;) {
+        int c;
+        if (!s->read_from_callbacks) {
+            stbi_uc *p = (stbi_uc *)memchr(s->img_buffer, 0xff, s->img_buffer_end - s->img_buffer);
+            s->img_buffer = p ? p : s->img_buffer_end;
+        }
+        if (stbi__at_eof(s)) break;
+        if (stbi__get8(s) != 0xff) continue;
+        c = stbi__get8(s);
+        while (c == 0xff) c = stbi__get8(s);
+        if (c != 0) {
+            z->marker = (unsigned char)c;
+            break;
+        }
+    }
+    z->code_bits = 0;
+    z->code_buffer = 0;
+    z->nomore = 1;
+}
+
+// decode one restart unit of a baseline scan at unit position i,j: a single
+// block if the scan has one component, else a whole interleaved MCU
+stbi_inline static int stbi__jpeg_decode_unit(stbi__jpeg *z, stbi__idct_queue *q, int i, int j)
+{
+    int k, x, y;
+    STBI__STAT_ADD(jpeg_mcus, 1);
+    if (z->scan_n == 1) {
+        int n = z->order[0];
+        int ha = z->img_comp[n].ha;
+        if (!stbi__jpeg_decode_block(z, stbi__idct_queue_slot(q), z->huff_dc + z->img_comp[n].hd, z->huff_ac + ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+        if (stbi__jpeg_block_needed(z, n, i, j))
+            stbi__idct_queue_push(z, q, z->img_comp[n].data + z->img_comp[n].w2 * (j * (8 >> z->scale_shift) - z->img_comp[n].strip_y) + i * (8 >> z->scale_shift), z->img_comp[n].w2);
+        return 1;
+    }
+    // scan an interleaved mcu... process scan_n components in order
+    for (k = 0; k < z->scan_n; ++k) {
+        int n = z->order[k];
+        // scan out an mcu's worth of this component; that's just determined
+        // by the basic H and V specified for the component
+        for (y = 0; y < z->img_comp[n].v; ++y) {
+            for (x = 0; x < z->img_comp[n].h; ++x) {
+                int x2 = (i*z->img_comp[n].h + x) * (8 >> z->scale_shift);
+                int y2 = (j*z->img_comp[n].v + y) * (8 >> z->scale_shift);
+                int ha = z->img_comp[n].ha;
+                if (!stbi__jpeg_decode_block(z, stbi__idct_queue_slot(q), z->huff_dc + z->img_comp[n].hd, z->huff_ac + ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                if (stbi__jpeg_block_needed(z, n, i*z->img_comp[n].h + x, j*z->img_comp[n].v + y))
+                    stbi__idct_queue_push(z, q, z->img_comp[n].data + z->img_comp[n].w2*(y2 - z->img_comp[n].strip_y) + x2, z->img_comp[n].w2);
+            }
+        }
+    }
+    return 1;
+}
+
+#ifdef STBI_THREADS
+// a baseline scan with restart markers is a run of independently coded
+// intervals, so when the whole file is in memory they can be found up front
+// and decoded on separate threads. each task takes a run of intervals.
+#define STBI__JPEG_MAX_TASKS  (STBI_MAX_THREADS * 4)
+
+typedef struct
+{
+    stbi__jpeg *z;
+    stbi_uc **start;   // where each interval's entropy-coded data begins
+    stbi_uc *end;
+    int intervals, per_task;
+    int units, w;
+    stbi_uc ok[STBI__JPEG_MAX_TASKS];
+    // how the last interval left the stream, for the marker parsing after it
+    stbi_uc *final_pos;
+    unsigned char final_marker;
+} stbi__jpeg_scan;
+
+// find the start of each of 'count' intervals, or fail if the scan doesn't
+// consist of exactly that many
+static int stbi__jpeg_find_restarts(stbi_uc *p, stbi_uc *end, stbi_uc **start, int count)
+{
+    int k = 1;
+    start[0] = p;
+    while (k < count) {
+        p = (stbi_uc *)memchr(p, 0xff, end - p);
+        if (!p || end - p < 2) return 0;
+        if (p[1] == 0)
+            p += 2; // stuffed zero
+        else if (STBI__RESTART(p[1]))
+            p += 2, start[k++] = p;
+        else
+            return 0;
+    }
+    return 1;
+}
+
+static void stbi__jpeg_scan_task(void *data, int index)
+{
+    stbi__jpeg_scan *d = (stbi__jpeg_scan *)data;
+    stbi__jpeg j = *d->z; // private bit reader and dc predictors
+    stbi__context s;
+    stbi__idct_queue q;
+    int t = index * d->per_task;
+    int t_end = t + d->per_task < d->intervals ? t + d->per_task : d->intervals;
+    d->ok[index] = 0;
+    j.s = &s;
+    stbi__idct_queue_init(&q);
+    for (; t < t_end; ++t) {
+        int u = t * d->z->restart_interval;
+        int u_end = u + d->z->restart_interval < d->units ? u + d->z->restart_interval : d->units;
+        stbi__start_mem(&s, d->start[t], (int)(d->end - d->start[t]));
+        stbi__jpeg_reset(&j);
+        for (; u < u_end; ++u)
+            if (!stbi__jpeg_decode_unit(&j, &q, u % d->w, u / d->w)) return;
+        // the serial decoder only carries on if each interval ends right at
+        // the next marker and that is a restart; anything else goes back to it
+        if (u_end - t * d->z->restart_interval == d->z->restart_interval) {
+            if (j.code_bits < 24) stbi__grow_buffer_unsafe(&j);
+            if (t + 1 < d->intervals) {
+                if (!STBI__RESTART(j.marker) || s.img_buffer != d->start[t + 1]) return;
+            }
+            else if (STBI__RESTART(j.marker))
+                return;
+        }
+        if (t + 1 == d->intervals) {
+            d->final_pos = s.img_buffer;
+            d->final_marker = j.marker;
+        }
+    }
+    stbi__idct_queue_flush(&j, &q);
+    d->ok[index] = 1;
+}
+
+// returns -1 if the scan should be decoded serially instead
+static int stbi__jpeg_parallel_scan(stbi__jpeg *z, int w, int h)
+{
+    stbi__jpeg_scan d;
+    const char *reason = stbi__g_failure_reason;
+    int threads, tasks, i, ok = 1;
+    if (!z->restart_interval || z->s->read_from_callbacks || z->stream || (stbi__uint32)w * h < 2 * (stbi__uint32)z->restart_interval)
+        return -1;
+    if (z->s->img_x * z->s->img_y < 65536 || (threads = stbi__threads_available()) < 2)
+        return -1;
+    d.z = z;
+    d.w = w;
+    d.units = w * h;
+    d.intervals = (d.units + z->restart_interval - 1) / z->restart_interval;
+    d.end = z->s->img_buffer_end;
+    d.start = (stbi_uc **)stbi__malloc_mad2(d.intervals, sizeof(stbi_uc *), 0);
+    if (!d.start) return -1;
+    if (!stbi__jpeg_find_restarts(z->s->img_buffer, d.end, d.start, d.intervals)) {
+        stbi__free(d.start);
+        return -1;
+    }
+    tasks = threads * 4 < STBI__JPEG_MAX_TASKS ? threads * 4 : STBI__JPEG_MAX_TASKS;
+    if (tasks > d.intervals) tasks = d.intervals;
+    d.per_task = (d.intervals + tasks - 1) / tasks;
+    tasks = (d.intervals + d.per_task - 1) / d.per_task;
+    stbi__parallel_for(stbi__jpeg_scan_task, &d, tasks, 1);
+    stbi__free(d.start);
+    for (i = 0; i < tasks; ++i)
+        ok &= d.ok[i];
+    if (!ok) {
+        // let the serial decoder have the final say, errors included
+        stbi__g_failure_reason = reason;
+        return -1;
+    }
+    z->s->img_buffer = d.final_pos;
+    z->marker = d.final_marker;
+    return 1;
+}
+#endif
+
+// progressive coefficient block (x,y) of component n; a component only shows
+// up again after being finished in a malformed file, and then decodes into
+// a scratch block
+static short *stbi__jpeg_coeff_block(stbi__jpeg *z, int n, int x, int y)
+{
+    if (!z->img_comp[n].coeff) return z->coeff_scratch;
+    return z->img_comp[n].coeff + 64 * (x + y * z->img_comp[n].coeff_w);
+}
+
+static int stbi__jpeg_stream_start(stbi__jpeg *z, int h);
+static int stbi__jpeg_stream_rows(stbi__jpeg *z, int units);
+
 static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
 {
     stbi__jpeg_reset(z);
     if (!z->progressive) {
+        stbi__idct_queue q;
+        int i, j, w, h, skip = 0;
         if (z->scan_n == 1) {
-            int i, j;
-            STBI_SIMD_ALIGN(short, data[64]);
             int n = z->order[0];
             // non-interleaved data, we just need to process one block at a time,
             // in trivial scanline order
             // number of blocks to do just depends on how many actual "pixels" this
             // component has, independent of interleaved MCU blocking and such
-            int w = (z->img_comp[n].x + 7) >> 3;
-            int h = (z->img_comp[n].y + 7) >> 3;
-            for (j = 0; j < h; ++j) {
-                for (i = 0; i < w; ++i) {
-                    int ha = z->img_comp[n].ha;
-                    if (!stbi__jpeg_decode_block(z, data, z->huff_dc + z->img_comp[n].hd, z->huff_ac + ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                    z->idct_block_kernel(z->img_comp[n].data + z->img_comp[n].w2*j * 8 + i * 8, z->img_comp[n].w2, data);
-                    // every data block is an MCU, so countdown the restart interval
-                    if (--z->todo <= 0) {
-                        if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                        // if it's NOT a restart, then just bail, so we get corrupt data
-                        // rather than no data
-                        if (!STBI__RESTART(z->marker)) return 1;
-                        stbi__jpeg_reset(z);
-                    }
-                }
-            }
-            return 1;
+            w = (z->img_comp[n].x + 7) >> 3;
+            h = (z->img_comp[n].y + 7) >> 3;
         }
         else { // interleaved
-            int i, j, k, x, y;
-            STBI_SIMD_ALIGN(short, data[64]);
-            for (j = 0; j < z->img_mcu_y; ++j) {
-                for (i = 0; i < z->img_mcu_x; ++i) {
-                    // scan an interleaved mcu... process scan_n components in order
-                    for (k = 0; k < z->scan_n; ++k) {
-                        int n = z->order[k];
-                        // scan out an mcu's worth of this component; that's just determined
-                        // by the basic H and V specified for the component
-                        for (y = 0; y < z->img_comp[n].v; ++y) {
-                            for (x = 0; x < z->img_comp[n].h; ++x) {
-                                int x2 = (i*z->img_comp[n].h + x) * 8;
-                                int y2 = (j*z->img_comp[n].v + y) * 8;
-                                int ha = z->img_comp[n].ha;
-                                if (!stbi__jpeg_decode_block(z, data, z->huff_dc + z->img_comp[n].hd, z->huff_ac + ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                                z->idct_block_kernel(z->img_comp[n].data + z->img_comp[n].w2*y2 + x2, z->img_comp[n].w2, data);
-                            }
-                        }
-                    }
-                    // after all interleaved components, that's an interleaved MCU,
-                    // so now count down the restart interval
-                    if (--z->todo <= 0) {
-                        if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                        if (!STBI__RESTART(z->marker)) return 1;
-                        stbi__jpeg_reset(z);
+            w = z->img_mcu_x;
+            h = z->img_mcu_y;
+        }
+        if (z->stream && !stbi__jpeg_stream_start(z, h)) return 0;
+#ifdef STBI_THREADS
+        i = stbi__jpeg_parallel_scan(z, w, h);
+        if (i >= 0) return i;
+#endif
+        stbi__idct_queue_init(&q);
+        for (j = 0; j < h; ++j) {
+            for (i = 0; i < w; ++i) {
+                // restart intervals that miss the region can be skipped whole
+                if (z->restart_interval && z->todo == z->restart_interval) {
+                    skip = !stbi__jpeg_interval_needed(z, j * w + i, w, h);
+                    if (skip) stbi__jpeg_skip_interval(z);
+                }
+                if (!skip && !stbi__jpeg_decode_unit(z, &q, i, j)) return 0;
+                // every block or interleaved MCU counts toward the restart interval
+                if (--z->todo <= 0) {
+                    if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+                    // if it's NOT a restart, then just bail, so we get corrupt data
+                    // rather than no data
+                    if (!STBI__RESTART(z->marker)) {
+                        stbi__idct_queue_flush(z, &q);
+                        return 1;
                     }
+                    stbi__jpeg_reset(z);
                 }
             }
-            return 1;
+            if (z->stream) {
+                // this unit row is done, so send the output rows it completes
+                stbi__idct_queue_flush(z, &q);
+                if (!stbi__jpeg_stream_rows(z, j + 1)) return 0;
+            }
         }
+        stbi__idct_queue_flush(z, &q);
+        return 1;
     }
     else {
         if (z->scan_n == 1) {
@@ -2795,7 +5499,7 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
             int h = (z->img_comp[n].y + 7) >> 3;
             for (j = 0; j < h; ++j) {
                 for (i = 0; i < w; ++i) {
-                    short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
+                    short *data = stbi__jpeg_coeff_block(z, n, i, j);
                     if (z->spec_start == 0) {
                         if (!stbi__jpeg_decode_block_prog_dc(z, data, &z->huff_dc[z->img_comp[n].hd], n))
                             return 0;
@@ -2806,6 +5510,7 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                             return 0;
                     }
                     // every data block is an MCU, so countdown the restart interval
+                    STBI__STAT_ADD(jpeg_mcus, 1);
                     if (--z->todo <= 0) {
                         if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
                         if (!STBI__RESTART(z->marker)) return 1;
@@ -2828,7 +5533,7 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                             for (x = 0; x < z->img_comp[n].h; ++x) {
                                 int x2 = (i*z->img_comp[n].h + x);
                                 int y2 = (j*z->img_comp[n].v + y);
-                                short *data = z->img_comp[n].coeff + 64 * (x2 + y2 * z->img_comp[n].coeff_w);
+                                short *data = stbi__jpeg_coeff_block(z, n, x2, y2);
                                 if (!stbi__jpeg_decode_block_prog_dc(z, data, &z->huff_dc[z->img_comp[n].hd], n))
                                     return 0;
                             }
@@ -2836,6 +5541,7 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                     }
                     // after all interleaved components, that's an interleaved MCU,
                     // so now count down the restart interval
+                    STBI__STAT_ADD(jpeg_mcus, 1);
                     if (--z->todo <= 0) {
                         if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
                         if (!STBI__RESTART(z->marker)) return 1;
@@ -2855,22 +5561,100 @@ static void stbi__jpeg_dequantize(short *data, stbi_uc *dequant)
         data[i] *= dequant[i];
 }
 
+typedef struct
+{
+    stbi__jpeg *z;
+    int n, row0;
+} stbi__jpeg_finish_rows;
+
+// dequantize and idct one row of blocks of a progressive component
+static void stbi__jpeg_finish_task(void *data, int index)
+{
+    stbi__jpeg_finish_rows *d = (stbi__jpeg_finish_rows *)data;
+    stbi__jpeg *z = d->z;
+    int i = 0, j = d->row0 + index, n = d->n;
+    int w = (z->img_comp[n].x + 7) >> 3;
+    if (j < z->roi_my0 * z->img_comp[n].v || j >= z->roi_my1 * z->img_comp[n].v) return;
+    if (w > z->roi_mx1 * z->img_comp[n].h) w = z->roi_mx1 * z->img_comp[n].h;
+    i = z->roi_mx0 * z->img_comp[n].h;
+    if (w > i) STBI__STAT_ADD(idct_blocks, (size_t)(w - i));
+    if (z->idct_pair_kernel) {
+        // neighbouring blocks in a row, dequantized as they're loaded (the
+        // pair kernel is only set for full-size decoding)
+        for (; i + 1 < w; i += 2) {
+            short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
+            stbi_uc *out = z->img_comp[n].data + z->img_comp[n].w2*j * 8 + i * 8;
+            z->idct_pair_kernel(out, out + 8, z->img_comp[n].w2, data, data + 64, z->dequant[z->img_comp[n].tq]);
+        }
+    }
+    for (; i < w; ++i) {
+        short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
+        stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
+        z->idct_block_kernel(z->img_comp[n].data + (z->img_comp[n].w2*j + i) * (8 >> z->scale_shift), z->img_comp[n].w2, data);
+    }
+}
+
+// turn a progressive component's coefficients into samples, written over
+// the top of the same buffer, then give back the part that's left over.
+// The samples for block row j only reach coefficient rows above (j - 1) / 2,
+// so rows go in waves that each only overwrite rows from earlier waves; the
+// rows within a wave are independent and are handed out one per task
+static void stbi__jpeg_finish_component(stbi__jpeg *z, int n)
+{
+    stbi__jpeg_finish_rows d;
+    int rows = (z->img_comp[n].y + 7) >> 3, a, b;
+    size_t old_size, size, off;
+    stbi_uc *raw;
+
+    if (!z->img_comp[n].coeff) return;
+    z->img_comp[n].data = (stbi_uc *)(z->img_comp[n].coeff - 64 * z->img_comp[n].coeff_w);
+    d.z = z;
+    d.n = n;
+    for (a = 0; a < rows; a = b) {
+        b = 2 * a + 1 < rows ? 2 * a + 1 : rows;
+        d.row0 = a;
+        stbi__parallel_for(stbi__jpeg_finish_task, &d, b - a, z->s->img_x * z->s->img_y >= 65536);
+    }
+
+    raw = (stbi_uc *)z->img_comp[n].raw_coeff;
+    off = z->img_comp[n].data - raw;
+    old_size = (size_t)z->img_comp[n].coeff_w * 8 * (z->img_comp[n].coeff_h + 1) * 8 * sizeof(short) + 15;
+    size = (size_t)z->img_comp[n].w2 * z->img_comp[n].h2 + 15;
+    raw = (stbi_uc *)stbi__realloc_sized(raw, old_size, size);
+    if (raw) {
+        // keep the samples aligned if the block moved
+        size_t moved = (((size_t)raw + 15) & ~(size_t)15) - (size_t)raw;
+        if (moved != off) memmove(raw + moved, raw + off, size - 15);
+        z->img_comp[n].data = raw + moved;
+    }
+    else
+        raw = (stbi_uc *)z->img_comp[n].raw_coeff;
+    z->img_comp[n].raw_data = raw;
+    z->img_comp[n].raw_coeff = NULL;
+    z->img_comp[n].coeff = NULL;
+}
+
+// note which coefficients a progressive scan brought to full precision;
+// components with nothing left to refine are finished straight away
+static void stbi__jpeg_scan_done(stbi__jpeg *z)
+{
+    int k;
+    if (!z->progressive || z->succ_low) return;
+    for (k = 0; k < z->scan_n; ++k) {
+        int n = z->order[k];
+        z->img_comp[n].coeff_final |= (~(stbi__uint64)0 >> (63 - z->spec_end)) & (~(stbi__uint64)0 << z->spec_start);
+        if (z->img_comp[n].coeff_final == ~(stbi__uint64)0)
+            stbi__jpeg_finish_component(z, n);
+    }
+}
+
 static void stbi__jpeg_finish(stbi__jpeg *z)
 {
     if (z->progressive) {
-        // dequantize and idct the data
-        int i, j, n;
-        for (n = 0; n < z->s->img_n; ++n) {
-            int w = (z->img_comp[n].x + 7) >> 3;
-            int h = (z->img_comp[n].y + 7) >> 3;
-            for (j = 0; j < h; ++j) {
-                for (i = 0; i < w; ++i) {
-                    short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
-                    stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-                    z->idct_block_kernel(z->img_comp[n].data + z->img_comp[n].w2*j * 8 + i * 8, z->img_comp[n].w2, data);
-                }
-            }
-        }
+        // whatever a truncated file never completed
+        int n;
+        for (n = 0; n < z->s->img_n; ++n)
+            stbi__jpeg_finish_component(z, n);
     }
 }
 
@@ -2984,23 +5768,41 @@ static int stbi__free_jpeg_components(stbi__jpeg *z, int ncomp, int why)
     int i;
     for (i = 0; i < ncomp; ++i) {
         if (z->img_comp[i].raw_data) {
-            STBI_FREE(z->img_comp[i].raw_data);
+            stbi__free(z->img_comp[i].raw_data);
             z->img_comp[i].raw_data = NULL;
             z->img_comp[i].data = NULL;
         }
         if (z->img_comp[i].raw_coeff) {
-            STBI_FREE(z->img_comp[i].raw_coeff);
+            stbi__free(z->img_comp[i].raw_coeff);
             z->img_comp[i].raw_coeff = 0;
             z->img_comp[i].coeff = 0;
         }
         if (z->img_comp[i].linebuf) {
-            STBI_FREE(z->img_comp[i].linebuf);
+            stbi__free(z->img_comp[i].linebuf);
             z->img_comp[i].linebuf = NULL;
         }
     }
     return why;
 }
 
+// stbi_load_rows*: report the size the image will be decoded at, then
+// narrow the MCUs worth decoding down to those under the region, plus one
+// all round for the upsampling to lean on
+static int stbi__jpeg_rows_begin(stbi__jpeg *z)
+{
+    stbi__context *s = z->s;
+    int round = (1 << z->scale_shift) - 1;
+    int mcu_w = z->img_mcu_w >> z->scale_shift, mcu_h = z->img_mcu_h >> z->scale_shift;
+    int n = z->stream_req ? z->stream_req : s->img_n;
+    if (!stbi__rows_begin(s, (s->img_x + round) >> z->scale_shift, (s->img_y + round) >> z->scale_shift, s->img_n, n))
+        return 0;
+    z->roi_mx0 = s->roi_x0 / mcu_w > 0 ? s->roi_x0 / mcu_w - 1 : 0;
+    z->roi_my0 = s->roi_y0 / mcu_h > 0 ? s->roi_y0 / mcu_h - 1 : 0;
+    if ((s->roi_x1 + mcu_w - 1) / mcu_w < z->img_mcu_x) z->roi_mx1 = (s->roi_x1 + mcu_w - 1) / mcu_w + 1;
+    if ((s->roi_y1 + mcu_h - 1) / mcu_h < z->img_mcu_y) z->roi_my1 = (s->roi_y1 + mcu_h - 1) / mcu_h + 1;
+    return 1;
+}
+
 static int stbi__process_frame_header(stbi__jpeg *z, int scan)
 {
     stbi__context *s = z->s;
@@ -3044,6 +5846,11 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
         if (z->img_comp[i].h > h_max) h_max = z->img_comp[i].h;
         if (z->img_comp[i].v > v_max) v_max = z->img_comp[i].v;
     }
+    // rows can only be streamed from a baseline image whose components
+    // all cover a whole number of output rows per row of their own
+    if (z->progressive) z->stream = 0;
+    for (i = 0; i < s->img_n; ++i)
+        if (v_max % z->img_comp[i].v) z->stream = 0;
 
     // compute interleaved mcu info
     z->img_h_max = h_max;
@@ -3053,6 +5860,10 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
     // these sizes can't be more than 17 bits
     z->img_mcu_x = (s->img_x + z->img_mcu_w - 1) / z->img_mcu_w;
     z->img_mcu_y = (s->img_y + z->img_mcu_h - 1) / z->img_mcu_h;
+    z->roi_mx0 = z->roi_my0 = 0;
+    z->roi_mx1 = z->img_mcu_x;
+    z->roi_my1 = z->img_mcu_y;
+    if (s->rows && !stbi__jpeg_rows_begin(z)) return 0;
 
     for (i = 0; i < s->img_n; ++i) {
         // number of effective pixels (e.g. for non-interleaved MCU)
@@ -3065,24 +5876,35 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
         //
         // img_mcu_x, img_mcu_y: <=17 bits; comp[i].h and .v are <=4 (checked earlier)
         // so these muls can't overflow with 32-bit ints (which we require)
-        z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-        z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+        // when scaling, each block decodes to fewer pixels
+        z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * (8 >> z->scale_shift);
+        z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * (8 >> z->scale_shift);
+        z->img_comp[i].strip_y = 0;
         z->img_comp[i].coeff = 0;
         z->img_comp[i].raw_coeff = 0;
         z->img_comp[i].linebuf = NULL;
-        z->img_comp[i].raw_data = stbi__malloc_mad2(z->img_comp[i].w2, z->img_comp[i].h2, 15);
-        if (z->img_comp[i].raw_data == NULL)
-            return stbi__free_jpeg_components(z, i + 1, stbi__err("outofmem", "Out of memory"));
-        // align blocks for idct using mmx/sse
-        z->img_comp[i].data = (stbi_uc*)(((size_t)z->img_comp[i].raw_data + 15) & ~15);
+        z->img_comp[i].raw_data = NULL;
+        z->img_comp[i].data = NULL;
         if (z->progressive) {
-            // w2, h2 are multiples of 8 (see above)
-            z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
-            z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
-            z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].w2, z->img_comp[i].h2, sizeof(short), 15);
+            // the sample plane is idct'd over the coefficients once they're
+            // final (see stbi__jpeg_finish_component), so there's no separate
+            // buffer for it; the coefficients start one block row in
+            z->img_comp[i].coeff_w = z->img_mcu_x * z->img_comp[i].h;
+            z->img_comp[i].coeff_h = z->img_mcu_y * z->img_comp[i].v;
+            z->img_comp[i].coeff_final = 0;
+            z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].coeff_w * 8, (z->img_comp[i].coeff_h + 1) * 8, sizeof(short), 15);
             if (z->img_comp[i].raw_coeff == NULL)
                 return stbi__free_jpeg_components(z, i + 1, stbi__err("outofmem", "Out of memory"));
-            z->img_comp[i].coeff = (short*)(((size_t)z->img_comp[i].raw_coeff + 15) & ~15);
+            z->img_comp[i].coeff = (short*)(((size_t)z->img_comp[i].raw_coeff + 15) & ~15) + 64 * z->img_comp[i].coeff_w;
+        }
+        else {
+            // a strip has room for two MCU rows plus the few rows kept from before them
+            int rows = z->stream ? 2 * z->img_comp[i].v * (8 >> z->scale_shift) + 4 : z->img_comp[i].h2;
+            z->img_comp[i].raw_data = stbi__malloc_mad2(z->img_comp[i].w2, rows, 15);
+            if (z->img_comp[i].raw_data == NULL)
+                return stbi__free_jpeg_components(z, i + 1, stbi__err("outofmem", "Out of memory"));
+            // align blocks for idct using mmx/sse
+            z->img_comp[i].data = (stbi_uc*)(((size_t)z->img_comp[i].raw_data + 15) & ~15);
         }
     }
 
@@ -3124,12 +5946,14 @@ static int stbi__decode_jpeg_header(stbi__jpeg *z, int scan)
 static int stbi__decode_jpeg_image(stbi__jpeg *j)
 {
     int m;
+    STBI__STAT_TIMER(t)
     for (m = 0; m < 4; m++) {
         j->img_comp[m].raw_data = NULL;
         j->img_comp[m].raw_coeff = NULL;
     }
     j->restart_interval = 0;
     if (!stbi__decode_jpeg_header(j, STBI__SCAN_load)) return 0;
+    STBI__STAT_START(t);
     m = stbi__get_marker(j);
     while (!stbi__EOI(m)) {
         if (stbi__SOS(m)) {
@@ -3149,6 +5973,7 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
                 }
                 // if we reach eof without hitting a marker, stbi__get_marker() below will fail and we'll eventually return 0
             }
+            stbi__jpeg_scan_done(j);
         }
         else {
             if (!stbi__process_marker(j, m)) return 0;
@@ -3157,6 +5982,7 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
     }
     if (j->progressive)
         stbi__jpeg_finish(j);
+    STBI__STAT_STOP(t, jpeg_scan_seconds);
     return 1;
 }
 
@@ -3561,36 +6387,347 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
 }
 #endif
 
+#if !defined(STBI_JPEG_OLD) && (defined(STBI_SSE2) || defined(STBI_NEON))
+// chroma upsampling fused with color conversion, for the common h2v1 and
+// h2v2 layouts: each output pixel's chroma is computed where it's needed
+// instead of going through line buffers. w is the chroma width, v2 says
+// whether to filter vertically with the far rows, and the results match
+// stbi__resample_row_h_2 / hv_2 followed by the row kernels exactly.
+// this scalar version does the edges for the simd ones; unlike the row
+// kernels, it only stores a 4th byte when step is 4.
+static void stbi__YCbCr_upsample_span(stbi_uc *out, stbi_uc const *y, stbi_uc const *cb_near, stbi_uc const *cb_far, stbi_uc const *cr_near, stbi_uc const *cr_far, int w, int x0, int x1, int v2, int step)
+{
+    int x;
+    out += x0 * step;
+    for (x = x0; x < x1; ++x) {
+        int y_fixed = (y[x] << 20) + (1 << 19); // rounding
+        int r, g, b, cr, cb;
+        // k is this pixel's chroma sample, j the neighbour it's filtered with
+        int k = x >> 1;
+        int j = (x & 1) ? (k + 1 < w ? k + 1 : k) : (k > 0 ? k - 1 : 0);
+        if (v2) {
+            cb = (3 * (3 * cb_near[k] + cb_far[k]) + 3 * cb_near[j] + cb_far[j] + 8) >> 4;
+            cr = (3 * (3 * cr_near[k] + cr_far[k]) + 3 * cr_near[j] + cr_far[j] + 8) >> 4;
+        }
+        else {
+            // stbi__resample_row_h_2 weights the last even sample the other way
+            if (!(x & 1) && k == w - 1 && k > 0) j = k, k = k - 1;
+            cb = (3 * cb_near[k] + cb_near[j] + 2) >> 2;
+            cr = (3 * cr_near[k] + cr_near[j] + 2) >> 2;
+        }
+        cr -= 128;
+        cb -= 128;
+        r = y_fixed + cr* float2fixed(1.40200f);
+        g = y_fixed + (cr*-float2fixed(0.71414f)) + ((cb*-float2fixed(0.34414f)) & 0xffff0000);
+        b = y_fixed + cb* float2fixed(1.77200f);
+        r >>= 20;
+        g >>= 20;
+        b >>= 20;
+        if ((unsigned)r > 255) { if (r < 0) r = 0; else r = 255; }
+        if ((unsigned)g > 255) { if (g < 0) g = 0; else g = 255; }
+        if ((unsigned)b > 255) { if (b < 0) b = 0; else b = 255; }
+        out[0] = (stbi_uc)r;
+        out[1] = (stbi_uc)g;
+        out[2] = (stbi_uc)b;
+        if (step == 4) out[3] = 255;
+        out += step;
+    }
+}
+
+// the simd versions do 16 output pixels at a time from chroma samples k..k+7,
+// filtering with k-1 and k+8, so they start at k=1 and stop before the last
+// sample. for h2v1, far is near, and 3*near+far is just 4x the sample, which
+// makes the h2v2 arithmetic give the h2v1 result.
+#ifdef STBI_SSE2
+// 3*near+far for 8 chroma samples
+#define stbi__sse2_chroma_t(near, far, k) \
+    _mm_add_epi16(_mm_slli_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *) ((near) + (k))), _mm_setzero_si128()), 2), \
+        _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *) ((far) + (k))), _mm_setzero_si128()), \
+                      _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *) ((near) + (k))), _mm_setzero_si128())))
+
+// chroma for output pixels 2k..2k+7 (lo) and 2k+8..2k+15 (hi)
+stbi_inline static void stbi__upsample16_sse2(__m128i *lo, __m128i *hi, stbi_uc const *near, stbi_uc const *far, int k)
+{
+    __m128i bias = _mm_set1_epi16(8);
+    __m128i cur = stbi__sse2_chroma_t(near, far, k);
+    __m128i prv = _mm_insert_epi16(_mm_slli_si128(cur, 2), 3 * near[k - 1] + far[k - 1], 0);
+    __m128i nxt = _mm_insert_epi16(_mm_srli_si128(cur, 2), 3 * near[k + 8] + far[k + 8], 7);
+    __m128i cur3 = _mm_add_epi16(_mm_add_epi16(cur, _mm_add_epi16(cur, cur)), bias);
+    __m128i even = _mm_srli_epi16(_mm_add_epi16(cur3, prv), 4);
+    __m128i odd = _mm_srli_epi16(_mm_add_epi16(cur3, nxt), 4);
+    *lo = _mm_unpacklo_epi16(even, odd);
+    *hi = _mm_unpackhi_epi16(even, odd);
+}
+
+// same arithmetic as stbi__YCbCr_to_RGB_simd, for 8 pixels with 16-bit chroma
+stbi_inline static void stbi__YCbCr8_sse2(stbi_uc *out, __m128i y_bytes, __m128i cb, __m128i cr)
+{
+    __m128i cr_const0 = _mm_set1_epi16((short)(1.40200f*4096.0f + 0.5f));
+    __m128i cr_const1 = _mm_set1_epi16(-(short)(0.71414f*4096.0f + 0.5f));
+    __m128i cb_const0 = _mm_set1_epi16(-(short)(0.34414f*4096.0f + 0.5f));
+    __m128i cb_const1 = _mm_set1_epi16((short)(1.77200f*4096.0f + 0.5f));
+    __m128i y_bias = _mm_set1_epi8((char)(unsigned char)128);
+    __m128i c128 = _mm_set1_epi16(128);
+    __m128i xw = _mm_set1_epi16(255); // alpha channel
+
+    __m128i yw = _mm_unpacklo_epi8(y_bias, y_bytes);
+    __m128i crw = _mm_slli_epi16(_mm_sub_epi16(cr, c128), 8);
+    __m128i cbw = _mm_slli_epi16(_mm_sub_epi16(cb, c128), 8);
+
+    // color transform
+    __m128i yws = _mm_srli_epi16(yw, 4);
+    __m128i cr0 = _mm_mulhi_epi16(cr_const0, crw);
+    __m128i cb0 = _mm_mulhi_epi16(cb_const0, cbw);
+    __m128i cb1 = _mm_mulhi_epi16(cbw, cb_const1);
+    __m128i cr1 = _mm_mulhi_epi16(crw, cr_const1);
+    __m128i rws = _mm_add_epi16(cr0, yws);
+    __m128i gwt = _mm_add_epi16(cb0, yws);
+    __m128i bws = _mm_add_epi16(yws, cb1);
+    __m128i gws = _mm_add_epi16(gwt, cr1);
+
+    // descale
+    __m128i rw = _mm_srai_epi16(rws, 4);
+    __m128i bw = _mm_srai_epi16(bws, 4);
+    __m128i gw = _mm_srai_epi16(gws, 4);
+
+    // back to byte, set up for transpose
+    __m128i brb = _mm_packus_epi16(rw, bw);
+    __m128i gxb = _mm_packus_epi16(gw, xw);
+
+    // transpose to interleave channels
+    __m128i t0 = _mm_unpacklo_epi8(brb, gxb);
+    __m128i t1 = _mm_unpackhi_epi8(brb, gxb);
+    __m128i o0 = _mm_unpacklo_epi16(t0, t1);
+    __m128i o1 = _mm_unpackhi_epi16(t0, t1);
+
+    // store
+    _mm_storeu_si128((__m128i *) (out + 0), o0);
+    _mm_storeu_si128((__m128i *) (out + 16), o1);
+}
+
+static int stbi__YCbCr_upsample16_sse2(stbi_uc *out, stbi_uc const *y, stbi_uc const *cb_near, stbi_uc const *cb_far, stbi_uc const *cr_near, stbi_uc const *cr_far, int w, int k)
+{
+    for (; k + 8 < w; k += 8) {
+        __m128i cb_lo, cb_hi, cr_lo, cr_hi;
+        stbi__upsample16_sse2(&cb_lo, &cb_hi, cb_near, cb_far, k);
+        stbi__upsample16_sse2(&cr_lo, &cr_hi, cr_near, cr_far, k);
+        stbi__YCbCr8_sse2(out + k * 8, _mm_loadl_epi64((__m128i const *) (y + k * 2)), cb_lo, cr_lo);
+        stbi__YCbCr8_sse2(out + k * 8 + 32, _mm_loadl_epi64((__m128i const *) (y + k * 2 + 8)), cb_hi, cr_hi);
+    }
+    return k;
+}
+#endif
+
+static void stbi__YCbCr_upsample_simd(stbi_uc *out, stbi_uc const *y, stbi_uc const *cb_near, stbi_uc const *cb_far, stbi_uc const *cr_near, stbi_uc const *cr_far, int w, int count, int v2, int step)
+{
+    int k = 1;
+    if (!v2) cb_far = cb_near, cr_far = cr_near;
+    if (step != 4 || w < 10) {
+        stbi__YCbCr_upsample_span(out, y, cb_near, cb_far, cr_near, cr_far, w, 0, count, v2, step);
+        return;
+    }
+    stbi__YCbCr_upsample_span(out, y, cb_near, cb_far, cr_near, cr_far, w, 0, 2, v2, step);
+
+#ifdef STBI_SSE2
+    k = stbi__YCbCr_upsample16_sse2(out, y, cb_near, cb_far, cr_near, cr_far, w, k);
+#endif
+
+#ifdef STBI_NEON
+    {
+        int16x8_t cr_const0 = vdupq_n_s16((short)(1.40200f*4096.0f + 0.5f));
+        int16x8_t cr_const1 = vdupq_n_s16(-(short)(0.71414f*4096.0f + 0.5f));
+        int16x8_t cb_const0 = vdupq_n_s16(-(short)(0.34414f*4096.0f + 0.5f));
+        int16x8_t cb_const1 = vdupq_n_s16((short)(1.77200f*4096.0f + 0.5f));
+        int16x8_t c128 = vdupq_n_s16(128);
+
+        for (; k + 8 < w; k += 8) {
+            int h;
+            // 3*near+far around samples k..k+7, then the horizontal filter
+            uint16x8_t cbt = vmlal_u8(vmovl_u8(vld1_u8(cb_far + k)), vld1_u8(cb_near + k), vdup_n_u8(3));
+            uint16x8_t cbp = vmlal_u8(vmovl_u8(vld1_u8(cb_far + k - 1)), vld1_u8(cb_near + k - 1), vdup_n_u8(3));
+            uint16x8_t cbn = vmlal_u8(vmovl_u8(vld1_u8(cb_far + k + 1)), vld1_u8(cb_near + k + 1), vdup_n_u8(3));
+            uint16x8_t crt = vmlal_u8(vmovl_u8(vld1_u8(cr_far + k)), vld1_u8(cr_near + k), vdup_n_u8(3));
+            uint16x8_t crp = vmlal_u8(vmovl_u8(vld1_u8(cr_far + k - 1)), vld1_u8(cr_near + k - 1), vdup_n_u8(3));
+            uint16x8_t crn = vmlal_u8(vmovl_u8(vld1_u8(cr_far + k + 1)), vld1_u8(cr_near + k + 1), vdup_n_u8(3));
+            uint16x8x2_t cb = vzipq_u16(vrshrq_n_u16(vmlaq_n_u16(cbp, cbt, 3), 4), vrshrq_n_u16(vmlaq_n_u16(cbn, cbt, 3), 4));
+            uint16x8x2_t cr = vzipq_u16(vrshrq_n_u16(vmlaq_n_u16(crp, crt, 3), 4), vrshrq_n_u16(vmlaq_n_u16(crn, crt, 3), 4));
+
+            // then stbi__YCbCr_to_RGB_simd on each half
+            for (h = 0; h < 2; ++h) {
+                uint8x8_t y_bytes = vld1_u8(y + k * 2 + h * 8);
+                int16x8_t yws = vreinterpretq_s16_u16(vshll_n_u8(y_bytes, 4));
+                int16x8_t crw = vshlq_n_s16(vsubq_s16(vreinterpretq_s16_u16(cr.val[h]), c128), 7);
+                int16x8_t cbw = vshlq_n_s16(vsubq_s16(vreinterpretq_s16_u16(cb.val[h]), c128), 7);
+                int16x8_t cr0 = vqdmulhq_s16(crw, cr_const0);
+                int16x8_t cb0 = vqdmulhq_s16(cbw, cb_const0);
+                int16x8_t cr1 = vqdmulhq_s16(crw, cr_const1);
+                int16x8_t cb1 = vqdmulhq_s16(cbw, cb_const1);
+                int16x8_t rws = vaddq_s16(yws, cr0);
+                int16x8_t gws = vaddq_s16(vaddq_s16(yws, cb0), cr1);
+                int16x8_t bws = vaddq_s16(yws, cb1);
+                uint8x8x4_t o;
+                o.val[0] = vqrshrun_n_s16(rws, 4);
+                o.val[1] = vqrshrun_n_s16(gws, 4);
+                o.val[2] = vqrshrun_n_s16(bws, 4);
+                o.val[3] = vdup_n_u8(255);
+                vst4_u8(out + k * 8 + h * 32, o);
+            }
+        }
+    }
+#endif
+
+    stbi__YCbCr_upsample_span(out, y, cb_near, cb_far, cr_near, cr_far, w, k * 2, count, v2, step);
+}
+
+#ifdef STBI__AVX2
+// as stbi__YCbCr_upsample_simd, 32 pixels at a time; each 128-bit lane does
+// the sse2 arithmetic for 16 of them
+#define stbi__avx2_chroma_t(near, far, k) \
+    _mm256_add_epi16(_mm256_slli_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i const *) ((near) + (k)))), 2), \
+        _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i const *) ((far) + (k)))), \
+                         _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i const *) ((near) + (k))))))
+
+STBI__AVX2_TARGET
+static void stbi__YCbCr_upsample_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *cb_near, stbi_uc const *cb_far, stbi_uc const *cr_near, stbi_uc const *cr_far, int w, int count, int v2, int step)
+{
+    int k = 1;
+    if (!v2) cb_far = cb_near, cr_far = cr_near;
+    if (step != 4 || w < 10) {
+        stbi__YCbCr_upsample_span(out, y, cb_near, cb_far, cr_near, cr_far, w, 0, count, v2, step);
+        return;
+    }
+    stbi__YCbCr_upsample_span(out, y, cb_near, cb_far, cr_near, cr_far, w, 0, 2, v2, step);
+
+    {
+        __m256i cr_const0 = _mm256_set1_epi16((short)(1.40200f*4096.0f + 0.5f));
+        __m256i cr_const1 = _mm256_set1_epi16(-(short)(0.71414f*4096.0f + 0.5f));
+        __m256i cb_const0 = _mm256_set1_epi16(-(short)(0.34414f*4096.0f + 0.5f));
+        __m256i cb_const1 = _mm256_set1_epi16((short)(1.77200f*4096.0f + 0.5f));
+        __m256i y_bias = _mm256_set1_epi8((char)(unsigned char)128);
+        __m256i c128 = _mm256_set1_epi16(128);
+        __m256i bias = _mm256_set1_epi16(8);
+        __m256i xw = _mm256_set1_epi16(255); // alpha channel
+
+        for (; k + 16 < w; k += 16) {
+            __m256i c[4], o[4], y_bytes;
+            int h;
+            // chroma: lane 0 gets samples k..k+7, lane 1 k+8..k+15, so after
+            // interleaving even/odd, the lo halves are pixels 0-7 | 16-23
+            // and the hi halves 8-15 | 24-31
+            for (h = 0; h < 2; ++h) {
+                stbi_uc const *near = h ? cr_near : cb_near;
+                stbi_uc const *far = h ? cr_far : cb_far;
+                __m256i cur = stbi__avx2_chroma_t(near, far, k);
+                __m256i prv = stbi__avx2_chroma_t(near, far, k - 1);
+                __m256i nxt = stbi__avx2_chroma_t(near, far, k + 1);
+                __m256i cur3 = _mm256_add_epi16(_mm256_add_epi16(cur, _mm256_add_epi16(cur, cur)), bias);
+                __m256i even = _mm256_srli_epi16(_mm256_add_epi16(cur3, prv), 4);
+                __m256i odd = _mm256_srli_epi16(_mm256_add_epi16(cur3, nxt), 4);
+                c[h * 2 + 0] = _mm256_unpacklo_epi16(even, odd);
+                c[h * 2 + 1] = _mm256_unpackhi_epi16(even, odd);
+            }
+            y_bytes = _mm256_loadu_si256((__m256i const *) (y + k * 2));
+            for (h = 0; h < 2; ++h) {
+                __m256i yw = h ? _mm256_unpackhi_epi8(y_bias, y_bytes) : _mm256_unpacklo_epi8(y_bias, y_bytes);
+                __m256i cbw = _mm256_slli_epi16(_mm256_sub_epi16(c[h], c128), 8);
+                __m256i crw = _mm256_slli_epi16(_mm256_sub_epi16(c[2 + h], c128), 8);
+
+                // color transform
+                __m256i yws = _mm256_srli_epi16(yw, 4);
+                __m256i cr0 = _mm256_mulhi_epi16(cr_const0, crw);
+                __m256i cb0 = _mm256_mulhi_epi16(cb_const0, cbw);
+                __m256i cb1 = _mm256_mulhi_epi16(cbw, cb_const1);
+                __m256i cr1 = _mm256_mulhi_epi16(crw, cr_const1);
+                __m256i rws = _mm256_add_epi16(cr0, yws);
+                __m256i gwt = _mm256_add_epi16(cb0, yws);
+                __m256i bws = _mm256_add_epi16(yws, cb1);
+                __m256i gws = _mm256_add_epi16(gwt, cr1);
+
+                // descale, back to byte, interleave channels
+                __m256i brb = _mm256_packus_epi16(_mm256_srai_epi16(rws, 4), _mm256_srai_epi16(bws, 4));
+                __m256i gxb = _mm256_packus_epi16(_mm256_srai_epi16(gws, 4), xw);
+                __m256i t0 = _mm256_unpacklo_epi8(brb, gxb);
+                __m256i t1 = _mm256_unpackhi_epi8(brb, gxb);
+                o[h * 2 + 0] = _mm256_unpacklo_epi16(t0, t1);
+                o[h * 2 + 1] = _mm256_unpackhi_epi16(t0, t1);
+            }
+            // o[0],o[1]: pixels 0-3,4-7 | 16-19,20-23; o[2],o[3]: 8-15 | 24-31
+            _mm256_storeu_si256((__m256i *) (out + k * 8 + 0), _mm256_permute2x128_si256(o[0], o[1], 0x20));
+            _mm256_storeu_si256((__m256i *) (out + k * 8 + 32), _mm256_permute2x128_si256(o[2], o[3], 0x20));
+            _mm256_storeu_si256((__m256i *) (out + k * 8 + 64), _mm256_permute2x128_si256(o[0], o[1], 0x31));
+            _mm256_storeu_si256((__m256i *) (out + k * 8 + 96), _mm256_permute2x128_si256(o[2], o[3], 0x31));
+        }
+    }
+
+    k = stbi__YCbCr_upsample16_sse2(out, y, cb_near, cb_far, cr_near, cr_far, w, k);
+    stbi__YCbCr_upsample_span(out, y, cb_near, cb_far, cr_near, cr_far, w, k * 2, count, v2, step);
+}
+#endif
+#endif // !STBI_JPEG_OLD && simd
+
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
 {
+    j->scale_shift = 0;
     j->idct_block_kernel = stbi__idct_block;
+    j->idct_pair_kernel = NULL;
     j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
     j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
+    j->YCbCr_upsample_kernel = NULL;
+    j->stream = 0;
+    j->stream_h = 0;
+    j->stream_out = NULL;
 
 #ifdef STBI_SSE2
     if (stbi__sse2_available()) {
         j->idct_block_kernel = stbi__idct_simd;
 #ifndef STBI_JPEG_OLD
         j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
+        j->YCbCr_upsample_kernel = stbi__YCbCr_upsample_simd;
 #endif
         j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
     }
 #endif
 
+#ifdef STBI__AVX2
+    if (stbi__avx2_available()) {
+        j->idct_pair_kernel = stbi__idct_avx2_pair;
+#ifndef STBI_JPEG_OLD
+        j->YCbCr_upsample_kernel = stbi__YCbCr_upsample_avx2;
+#endif
+    }
+#endif
+
 #ifdef STBI_NEON
     j->idct_block_kernel = stbi__idct_simd;
 #ifndef STBI_JPEG_OLD
     j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
+    j->YCbCr_upsample_kernel = stbi__YCbCr_upsample_simd;
 #endif
     j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
 #endif
 }
 
+// decode at 1/2, 1/4 or 1/8 size; anything else means full size
+static void stbi__jpeg_set_scale(stbi__jpeg *j, int scale)
+{
+    static void(*const reduced[4])(stbi_uc *out, int out_stride, short data[64]) =
+    {
+        NULL, stbi__idct_4x4, stbi__idct_2x2, stbi__idct_1x1
+    };
+    j->scale_shift = scale == 2 ? 1 : scale == 4 ? 2 : scale == 8 ? 3 : 0;
+    if (j->scale_shift) {
+        j->idct_block_kernel = reduced[j->scale_shift];
+        j->idct_pair_kernel = NULL;
+    }
+}
+
 // clean up the temporary component buffers
 static void stbi__cleanup_jpeg(stbi__jpeg *j)
 {
     stbi__free_jpeg_components(j, j->s->img_n, 0);
+    stbi__free(j->stream_out);
+    j->stream_out = NULL;
 }
 
 typedef struct
@@ -3603,6 +6740,281 @@ typedef struct
     int ypos;    // which pre-expansion row we're on
 } stbi__resample;
 
+typedef struct
+{
+    stbi__jpeg *z;
+    stbi__resample *res_comp;   // resampler state at the top of the image
+    stbi_uc *linebuf;           // line buffers for bands after the first
+    stbi_uc *output;
+    int out_stride, n, decode_n, rows_per_band;
+} stbi__jpeg_convert;
+
+// resample and color-convert columns conv_x0..conv_x0+conv_w-1 of output rows
+// y0..y1-1, to output and the rows after it
+static void stbi__jpeg_convert_rows(stbi__jpeg *z, stbi__resample const *res_top, stbi_uc **linebuf, stbi_uc *output, int out_stride, int n, int decode_n, unsigned int y0, unsigned int y1)
+{
+    int k, fused;
+    unsigned int i, j, w = z->conv_w;
+    stbi_uc *coutput[4];
+    stbi_uc *cnear[4], *cfar[4];
+    stbi__resample res[4];
+
+    // step each resampler forward to row y0; every vs rows it moves down
+    // a source line until it reaches the last one
+    for (k = 0; k < decode_n; ++k) {
+        stbi__resample *r = &res[k];
+        int t, wraps, last = z->img_comp[k].y - 1;
+        *r = res_top[k];
+        t = r->ystep + (int)y0;
+        wraps = t / r->vs;
+        r->ystep = t % r->vs;
+        r->ypos = wraps;
+        r->line1 = z->img_comp[k].data + z->img_comp[k].w2 * ((wraps < last ? wraps : last) - z->img_comp[k].strip_y) + z->conv_x0 / r->hs;
+        if (wraps > 0)
+            r->line0 = z->img_comp[k].data + z->img_comp[k].w2 * ((wraps - 1 < last ? wraps - 1 : last) - z->img_comp[k].strip_y) + z->conv_x0 / r->hs;
+    }
+
+    // rgba output from full size luma with h2v1 or h2v2 chroma can skip the
+    // chroma line buffers
+    fused = z->YCbCr_upsample_kernel && decode_n == 3 && n == 4 && z->rgb != 3 &&
+        res[0].hs == 1 && res[0].vs == 1 && res[1].hs == 2 && res[1].vs <= 2 &&
+        res[2].hs == 2 && res[2].vs == res[1].vs;
+
+    for (j = y0; j < y1; ++j) {
+        stbi_uc *out = output + (ptrdiff_t)out_stride * (int)(j - y0);
+        for (k = 0; k < decode_n; ++k) {
+            stbi__resample *r = &res[k];
+            int y_bot = r->ystep >= (r->vs >> 1);
+            cnear[k] = y_bot ? r->line1 : r->line0;
+            cfar[k] = y_bot ? r->line0 : r->line1;
+            if (!fused || k == 0)
+                coutput[k] = r->resample(linebuf[k], cnear[k], cfar[k], r->w_lores, r->hs);
+            if (++r->ystep >= r->vs) {
+                r->ystep = 0;
+                r->line0 = r->line1;
+                if (++r->ypos < z->img_comp[k].y)
+                    r->line1 += z->img_comp[k].w2;
+            }
+        }
+        if (fused) {
+            z->YCbCr_upsample_kernel(out, coutput[0], cnear[1], cfar[1], cnear[2], cfar[2], res[1].w_lores, w, res[1].vs == 2, n);
+        }
+        else if (n >= 3) {
+            stbi_uc *y = coutput[0];
+            if (z->s->img_n == 3) {
+                if (z->rgb == 3) {
+                    for (i = 0; i < w; ++i) {
+                        out[0] = y[i];
+                        out[1] = coutput[1][i];
+                        out[2] = coutput[2][i];
+                        if (n == 4) out[3] = 255;
+                        out += n;
+                    }
+                }
+                else if (n == 3 && (z->s->dest || (j + 1 == y1 && y1 < z->s->img_y))) {
+                    // the kernels store a 4th byte after every pixel, so
+                    // convert the last one aside to stay inside the row,
+                    // which may belong to the caller or to another band
+                    stbi_uc last[4];
+                    i = w - 1;
+                    z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], i, n);
+                    z->YCbCr_to_RGB_kernel(last, y + i, coutput[1] + i, coutput[2] + i, 1, n);
+                    memcpy(out + i * 3, last, 3);
+                }
+                else {
+                    z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], w, n);
+                }
+            }
+            else
+                for (i = 0; i < w; ++i) {
+                    out[0] = out[1] = out[2] = y[i];
+                    if (n == 4) out[3] = 255;
+                    out += n;
+                }
+        }
+        else {
+            stbi_uc *y = coutput[0];
+            if (n == 1)
+                for (i = 0; i < w; ++i) out[i] = y[i];
+            else
+                for (i = 0; i < w; ++i) *out++ = y[i], *out++ = 255;
+        }
+    }
+}
+
+static void stbi__jpeg_convert_task(void *data, int index)
+{
+    stbi__jpeg_convert *d = (stbi__jpeg_convert *)data;
+    stbi__jpeg *z = d->z;
+    stbi_uc *linebuf[4];
+    unsigned int y0 = (unsigned int)(index * d->rows_per_band);
+    unsigned int y1 = y0 + d->rows_per_band < z->s->img_y ? y0 + d->rows_per_band : z->s->img_y;
+    int k;
+    for (k = 0; k < d->decode_n; ++k)
+        linebuf[k] = index ? d->linebuf + ((index - 1) * d->decode_n + k) * (z->s->img_x + 3) : z->img_comp[k].linebuf;
+    if (y0 < y1)
+        stbi__jpeg_convert_rows(z, d->res_comp, linebuf, d->output + (ptrdiff_t)d->out_stride * (int)y0, d->out_stride, d->n, d->decode_n, y0, y1);
+}
+
+// from here on, a scaled image is just a smaller one
+static void stbi__jpeg_scale_sizes(stbi__jpeg *z)
+{
+    int n;
+    if (z->scale_shift) {
+        int round = (1 << z->scale_shift) - 1;
+        z->s->img_x = (z->s->img_x + round) >> z->scale_shift;
+        z->s->img_y = (z->s->img_y + round) >> z->scale_shift;
+        for (n = 0; n < z->s->img_n; ++n) {
+            z->img_comp[n].x = (z->img_comp[n].x + round) >> z->scale_shift;
+            z->img_comp[n].y = (z->img_comp[n].y + round) >> z->scale_shift;
+        }
+    }
+}
+
+// how many components have to be resampled to produce n channels
+static int stbi__jpeg_decode_n(stbi__jpeg *z, int n)
+{
+    if (z->s->img_n == 3 && n < 3)
+        return 1;
+    else
+        return z->s->img_n;
+}
+
+static int stbi__jpeg_alloc_linebufs(stbi__jpeg *z, int decode_n)
+{
+    int k;
+    for (k = 0; k < decode_n; ++k) {
+        // allocate line buffer big enough for upsampling off the edges
+        // with upsample factor of 4
+        z->img_comp[k].linebuf = (stbi_uc *)stbi__malloc(z->s->img_x + 3);
+        if (!z->img_comp[k].linebuf) return stbi__err("outofmem", "Out of memory");
+    }
+    return 1;
+}
+
+// resampler state at the top of the image
+static void stbi__jpeg_resamplers(stbi__jpeg *z, stbi__resample *res_comp, int decode_n)
+{
+    int k;
+    for (k = 0; k < decode_n; ++k) {
+        stbi__resample *r = &res_comp[k];
+
+        r->hs = z->img_h_max / z->img_comp[k].h;
+        r->vs = z->img_v_max / z->img_comp[k].v;
+        r->ystep = r->vs >> 1;
+        r->w_lores = (z->conv_w + r->hs - 1) / r->hs;
+        r->ypos = 0;
+        r->line0 = r->line1 = z->img_comp[k].data + z->conv_x0 / r->hs;
+
+        if (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
+        else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
+        else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
+        else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
+        else                               r->resample = stbi__resample_row_generic;
+    }
+}
+
+// stbi_load_rows*: a baseline image is decoded a row of MCUs at a time into
+// a strip of each component, a few rows more than one MCU row high, and the
+// output rows are sent as soon as the strips cover them
+
+// rows of component k that one unit row of the scan decodes
+static int stbi__jpeg_unit_rows(stbi__jpeg *z, int k)
+{
+    return (z->scan_n == 1 ? 1 : z->img_comp[k].v) * (8 >> z->scale_shift);
+}
+
+// called at the start of the scan, which has h unit rows. if the components
+// come in separate scans, go back to decoding the whole image instead
+// size the image and the converted window, and get the buffers for
+// converting it a band at a time
+static int stbi__jpeg_stream_prepare(stbi__jpeg *z)
+{
+    int n = z->stream_req ? z->stream_req : z->s->img_n;
+    int mcu_w = z->img_mcu_w >> z->scale_shift;
+    z->stream_units = 0;
+    z->stream_next = 0;
+    stbi__jpeg_scale_sizes(z);
+    z->conv_x0 = z->roi_mx0 * mcu_w;
+    z->conv_w = (z->roi_mx1 * mcu_w < (int)z->s->img_x ? z->roi_mx1 * mcu_w : (int)z->s->img_x) - z->conv_x0;
+    if (!stbi__jpeg_alloc_linebufs(z, stbi__jpeg_decode_n(z, n))) return 0;
+    z->stream_out = (stbi_uc *)stbi__malloc_mad3(n, z->conv_w, z->img_mcu_h >> z->scale_shift, 1);
+    if (!z->stream_out) return stbi__err("outofmem", "Out of memory");
+    return 1;
+}
+
+static int stbi__jpeg_stream_start(stbi__jpeg *z, int h)
+{
+    int k;
+    if (z->stream_h) return stbi__err("multiple scans", "Corrupt JPEG");
+    if (z->scan_n != z->s->img_n) {
+        for (k = 0; k < z->s->img_n; ++k) {
+            stbi__free(z->img_comp[k].raw_data);
+            z->img_comp[k].raw_data = stbi__malloc_mad2(z->img_comp[k].w2, z->img_comp[k].h2, 15);
+            if (z->img_comp[k].raw_data == NULL) return stbi__err("outofmem", "Out of memory");
+            z->img_comp[k].data = (stbi_uc*)(((size_t)z->img_comp[k].raw_data + 15) & ~15);
+        }
+        z->stream = 0;
+        return 1;
+    }
+    z->stream_h = h;
+    return stbi__jpeg_stream_prepare(z);
+}
+
+// unit rows up to 'units' are decoded: send the output rows they complete,
+// then move each strip up to the first row still needed
+static int stbi__jpeg_stream_rows(stbi__jpeg *z, int units)
+{
+    stbi__context *s = z->s;
+    stbi__resample res_comp[4];
+    stbi_uc *linebuf[4];
+    int k, n = z->stream_req ? z->stream_req : s->img_n;
+    int decode_n = stbi__jpeg_decode_n(z, n);
+    int band = z->img_mcu_h >> z->scale_shift;
+
+    stbi__jpeg_resamplers(z, res_comp, decode_n);
+    for (k = 0; k < decode_n; ++k)
+        linebuf[k] = z->img_comp[k].linebuf;
+
+    while (z->stream_units < units) {
+        int u = ++z->stream_units;
+        stbi__uint32 y, y_end = s->img_y;
+
+        // output row y needs rows up to (y + vs/2) / vs of each component
+        for (k = 0; k < decode_n; ++k) {
+            int vs = res_comp[k].vs;
+            int have = u * stbi__jpeg_unit_rows(z, k);
+            if (u < z->stream_h && have < z->img_comp[k].y && (stbi__uint32)(have * vs - (vs >> 1)) < y_end)
+                y_end = have * vs - (vs >> 1);
+        }
+        // only rows in the region are converted; after its last one,
+        // stbi__rows_send stops the decode
+        y = z->stream_next > (stbi__uint32)s->roi_y0 ? z->stream_next : (stbi__uint32)s->roi_y0;
+        for (; y < y_end; y += band) {
+            stbi__uint32 y1 = y + band < y_end ? y + band : y_end;
+            stbi__jpeg_convert_rows(z, res_comp, linebuf, z->stream_out, n * z->conv_w, n, decode_n, y, y1);
+            if (!stbi__rows_send(s, (int)y, (int)(y1 - y), z->stream_out, n * z->conv_w, z->conv_x0, n, n)) return 0;
+        }
+        if (y_end > z->stream_next) z->stream_next = y_end;
+        if (u == z->stream_h) break;
+
+        // the next output row needs component rows from (y + vs/2) / vs - 1
+        for (k = 0; k < s->img_n; ++k) {
+            int vs = z->img_v_max / z->img_comp[k].v;
+            int have = u * stbi__jpeg_unit_rows(z, k);
+            int keep = (int)(((vs >> 1) + z->stream_next) / vs) - 1;
+            if (keep > z->img_comp[k].y - 1) keep = z->img_comp[k].y - 1;
+            if (keep > z->img_comp[k].strip_y) {
+                int w2 = z->img_comp[k].w2;
+                STBI_ASSERT(keep <= have);
+                memmove(z->img_comp[k].data, z->img_comp[k].data + w2 * (keep - z->img_comp[k].strip_y), (size_t)w2 * (have - keep));
+                z->img_comp[k].strip_y = keep;
+            }
+        }
+    }
+    return 1;
+}
+
 static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
 {
     int n, decode_n;
@@ -3611,100 +7023,85 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
                      // validate req_comp
     if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
 
+    z->stream = z->s->rows != NULL;
+    z->stream_req = req_comp;
+    z->stream_h = 0;
+    z->stream_out = NULL;
+
     // load a jpeg image from whichever source, but leave in YCbCr format
     if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
 
+    if (z->s->rows) {
+        // the scan may have ended early, leaving rows unsent; an image that
+        // couldn't stream has been decoded whole, as if in one unit row
+        int ok;
+        if (z->stream)
+            ok = z->stream_h ? stbi__jpeg_stream_rows(z, z->stream_h) : stbi__err("no SOS", "Corrupt JPEG");
+        else {
+            z->stream_h = 1;
+            ok = stbi__jpeg_stream_prepare(z) && stbi__jpeg_stream_rows(z, 1);
+        }
+        stbi__cleanup_jpeg(z);
+        return ok ? (stbi_uc *)z->s->rows : NULL;
+    }
+
+    stbi__jpeg_scale_sizes(z);
+    z->conv_x0 = 0;
+    z->conv_w = z->s->img_x;
+
     // determine actual number of components to generate
     n = req_comp ? req_comp : z->s->img_n;
-
-    if (z->s->img_n == 3 && n < 3)
-        decode_n = 1;
-    else
-        decode_n = z->s->img_n;
+    decode_n = stbi__jpeg_decode_n(z, n);
 
     // resample and color-convert
     {
-        int k;
-        unsigned int i, j;
+        int bands;
         stbi_uc *output;
-        stbi_uc *coutput[4];
+        int out_stride;
+        stbi__jpeg_convert d;
 
         stbi__resample res_comp[4];
+        STBI__STAT_TIMER(t)
 
-        for (k = 0; k < decode_n; ++k) {
-            stbi__resample *r = &res_comp[k];
-
-            // allocate line buffer big enough for upsampling off the edges
-            // with upsample factor of 4
-            z->img_comp[k].linebuf = (stbi_uc *)stbi__malloc(z->s->img_x + 3);
-            if (!z->img_comp[k].linebuf) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-            r->hs = z->img_h_max / z->img_comp[k].h;
-            r->vs = z->img_v_max / z->img_comp[k].v;
-            r->ystep = r->vs >> 1;
-            r->w_lores = (z->s->img_x + r->hs - 1) / r->hs;
-            r->ypos = 0;
-            r->line0 = r->line1 = z->img_comp[k].data;
+        if (!stbi__jpeg_alloc_linebufs(z, decode_n)) { stbi__cleanup_jpeg(z); return NULL; }
+        stbi__jpeg_resamplers(z, res_comp, decode_n);
 
-            if (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
-            else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
-            else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
-            else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
-            else                               r->resample = stbi__resample_row_generic;
+        // can't error after this so, this is safe
+        if (z->s->dest) {
+            if (!stbi__dest_fits(z->s, z->s->img_x, z->s->img_y, n)) { stbi__cleanup_jpeg(z); return stbi__errpuc("dest too small", "Destination too small"); }
+            output = z->s->dest;
+            out_stride = z->s->dest_stride;
+        }
+        else {
+            output = (stbi_uc *)stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
+            if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+            out_stride = n * z->s->img_x;
         }
 
-        // can't error after this so, this is safe
-        output = (stbi_uc *)stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
-        if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-        // now go ahead and resample
-        for (j = 0; j < z->s->img_y; ++j) {
-            stbi_uc *out = output + n * z->s->img_x * j;
-            for (k = 0; k < decode_n; ++k) {
-                stbi__resample *r = &res_comp[k];
-                int y_bot = r->ystep >= (r->vs >> 1);
-                coutput[k] = r->resample(z->img_comp[k].linebuf,
-                    y_bot ? r->line1 : r->line0,
-                    y_bot ? r->line0 : r->line1,
-                    r->w_lores, r->hs);
-                if (++r->ystep >= r->vs) {
-                    r->ystep = 0;
-                    r->line0 = r->line1;
-                    if (++r->ypos < z->img_comp[k].y)
-                        r->line1 += z->img_comp[k].w2;
-                }
-            }
-            if (n >= 3) {
-                stbi_uc *y = coutput[0];
-                if (z->s->img_n == 3) {
-                    if (z->rgb == 3) {
-                        for (i = 0; i < z->s->img_x; ++i) {
-                            out[0] = y[i];
-                            out[1] = coutput[1][i];
-                            out[2] = coutput[2][i];
-                            out[3] = 255;
-                            out += n;
-                        }
-                    }
-                    else {
-                        z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                    }
-                }
-                else
-                    for (i = 0; i < z->s->img_x; ++i) {
-                        out[0] = out[1] = out[2] = y[i];
-                        out[3] = 255; // not used if n==3
-                        out += n;
-                    }
-            }
-            else {
-                stbi_uc *y = coutput[0];
-                if (n == 1)
-                    for (i = 0; i < z->s->img_x; ++i) out[i] = y[i];
-                else
-                    for (i = 0; i < z->s->img_x; ++i) *out++ = y[i], *out++ = 255;
+        // now go ahead and resample, in bands of rows if there are threads
+        // to spare; each band after the first needs its own line buffers
+        d.z = z;
+        d.res_comp = res_comp;
+        d.output = output;
+        d.out_stride = out_stride;
+        d.n = n;
+        d.decode_n = decode_n;
+        d.linebuf = NULL;
+        bands = 1;
+#ifdef STBI_THREADS
+        if (z->s->img_x * z->s->img_y >= 65536) {
+            bands = stbi__threads_available();
+            if (bands > 1) {
+                d.linebuf = (stbi_uc *)stbi__malloc_mad3(bands - 1, decode_n, z->s->img_x + 3, 0);
+                if (!d.linebuf) bands = 1;
             }
         }
+#endif
+        d.rows_per_band = (z->s->img_y + bands - 1) / bands;
+        STBI__STAT_START(t);
+        stbi__parallel_for(stbi__jpeg_convert_task, &d, bands, bands > 1);
+        STBI__STAT_PASS(t);
+        if (d.linebuf) stbi__free(d.linebuf);
         stbi__cleanup_jpeg(z);
         *out_x = z->s->img_x;
         *out_y = z->s->img_y;
@@ -3719,8 +7116,9 @@ static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int re
     stbi__jpeg* j = (stbi__jpeg*)stbi__malloc(sizeof(stbi__jpeg));
     j->s = s;
     stbi__setup_jpeg(j);
+    stbi__jpeg_set_scale(j, stbi__option(jpeg_scale, 1));
     result = load_jpeg_image(j, x, y, comp, req_comp);
-    STBI_FREE(j);
+    stbi__free(j);
     return result;
 }
 
@@ -3753,7 +7151,7 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
     stbi__jpeg* j = (stbi__jpeg*)(stbi__malloc(sizeof(stbi__jpeg)));
     j->s = s;
     result = stbi__jpeg_info_raw(j, x, y, comp);
-    STBI_FREE(j);
+    stbi__free(j);
     return result;
 }
 #endif
@@ -3864,6 +7262,19 @@ typedef struct
     char *zout_end;
     int   z_expandable;
 
+    // streaming output: when zout fills up, the bytes past zout_flushed are
+    // handed to flush(), which returns how many it consumed (or -1 on error),
+    // and the window slides down instead of growing
+    char *zout_flushed;
+    int (*flush)(void *user, stbi_uc *data, int len);
+    void *flush_user;
+
+    // the output's Adler-32, when it's being checked: bytes before
+    // adler_from are summed in 'adler' already
+    char *adler_from;
+    stbi__uint32 adler;
+    int adler_simd;
+
     stbi__zhuffman z_length, z_distance;
 } stbi__zbuf;
 
@@ -3897,6 +7308,7 @@ static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
     int b, s, k;
     // not resolved by fast table, so compute it the slow way
     // use jpeg approach, which requires MSbits at top
+    STBI__STAT_ADD(huffman_slow_decodes, 1);
     k = stbi__bit_reverse(a->code_buffer, 16);
     for (s = STBI__ZFAST_BITS + 1; ; ++s)
         if (k < z->maxcode[s])
@@ -3924,22 +7336,129 @@ stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
     return stbi__zhuffman_decode_slowpath(a, z);
 }
 
+#define STBI__ADLER_MOD   65521
+#define STBI__ADLER_NMAX  5552   // most bytes that can be summed before reducing
+
+#ifdef STBI__SSSE3
+// 32 bytes per step: psadbw adds them up for s1, and pmaddubsw weights each
+// by its distance from the end of the step for s2, which also gains 32 times
+// s1 as it was at the start of each step
+STBI__SSSE3_TARGET
+static stbi__uint32 stbi__adler32_ssse3(stbi__uint32 adler, stbi_uc const *p, size_t steps)
+{
+    __m128i const tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+    __m128i const tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    __m128i const zero = _mm_setzero_si128(), ones = _mm_set1_epi16(1);
+    stbi__uint32 s1 = adler & 0xffff, s2 = adler >> 16;
+
+    while (steps) {
+        int n = steps < STBI__ADLER_NMAX / 32 ? (int)steps : STBI__ADLER_NMAX / 32;
+        __m128i ps = _mm_cvtsi32_si128((int)(s1 * n)), v1 = zero, v2 = _mm_cvtsi32_si128((int)s2);
+        steps -= n;
+        do {
+            __m128i b1 = _mm_loadu_si128((__m128i const *) p);
+            __m128i b2 = _mm_loadu_si128((__m128i const *) (p + 16));
+            ps = _mm_add_epi32(ps, v1);
+            v1 = _mm_add_epi32(v1, _mm_add_epi32(_mm_sad_epu8(b1, zero), _mm_sad_epu8(b2, zero)));
+            v2 = _mm_add_epi32(v2, _mm_madd_epi16(_mm_maddubs_epi16(b1, tap1), ones));
+            v2 = _mm_add_epi32(v2, _mm_madd_epi16(_mm_maddubs_epi16(b2, tap2), ones));
+            p += 32;
+        } while (--n);
+        v2 = _mm_add_epi32(v2, _mm_slli_epi32(ps, 5));
+
+        v1 = _mm_add_epi32(v1, _mm_shuffle_epi32(v1, _MM_SHUFFLE(2, 3, 0, 1)));
+        v1 = _mm_add_epi32(v1, _mm_shuffle_epi32(v1, _MM_SHUFFLE(1, 0, 3, 2)));
+        v2 = _mm_add_epi32(v2, _mm_shuffle_epi32(v2, _MM_SHUFFLE(2, 3, 0, 1)));
+        v2 = _mm_add_epi32(v2, _mm_shuffle_epi32(v2, _MM_SHUFFLE(1, 0, 3, 2)));
+        s1 = (s1 + (stbi__uint32)_mm_cvtsi128_si32(v1)) % STBI__ADLER_MOD;
+        s2 = (stbi__uint32)_mm_cvtsi128_si32(v2) % STBI__ADLER_MOD;
+    }
+    return (s2 << 16) | s1;
+}
+#endif
+
+static stbi__uint32 stbi__adler32(stbi__uint32 adler, stbi_uc const *p, size_t len, int simd)
+{
+    stbi__uint32 s1, s2;
+#ifdef STBI__SSSE3
+    if (simd && len >= 32) {
+        adler = stbi__adler32_ssse3(adler, p, len / 32);
+        p += len & ~(size_t)31;
+        len &= 31;
+    }
+#else
+    STBI_NOTUSED(simd);
+#endif
+    s1 = adler & 0xffff;
+    s2 = adler >> 16;
+    while (len) {
+        size_t n = len < STBI__ADLER_NMAX ? len : STBI__ADLER_NMAX;
+        len -= n;
+        for (; n; --n) {
+            s1 += *p++;
+            s2 += s1;
+        }
+        s1 %= STBI__ADLER_MOD;
+        s2 %= STBI__ADLER_MOD;
+    }
+    return (s2 << 16) | s1;
+}
+
+// fold the output written since adler_from into the running Adler-32
+static void stbi__zadler_fold(stbi__zbuf *z)
+{
+    z->adler = stbi__adler32(z->adler, (stbi_uc *)z->adler_from, z->zout - z->adler_from, z->adler_simd);
+    z->adler_from = z->zout;
+}
+
+#define STBI__ZWINDOW  32768  // largest distance a back-reference can reach
+
+static int stbi__zflush(stbi__zbuf *z, int n)
+{
+    int used, keep, drop;
+    if (z->adler_from) stbi__zadler_fold(z);
+    used = z->flush(z->flush_user, (stbi_uc *)z->zout_flushed, (int)(z->zout - z->zout_flushed));
+    if (used < 0) return 0;
+    z->zout_flushed += used;
+    // keep the unconsumed bytes and enough history for back-references
+    keep = (int)(z->zout - z->zout_flushed);
+    if (keep < STBI__ZWINDOW) keep = STBI__ZWINDOW;
+    drop = (int)(z->zout - z->zout_start) - keep;
+    if (drop > 0) {
+        STBI__STAT_ADD(inflate_bytes, (size_t)drop);
+        memmove(z->zout_start, z->zout_start + drop, keep);
+        z->zout -= drop;
+        z->zout_flushed -= drop;
+        if (z->adler_from) z->adler_from -= drop;
+    }
+    if (z->zout + n > z->zout_end) return stbi__err("output buffer limit", "Corrupt PNG");
+    return 1;
+}
+
 static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room for n bytes
 {
     char *q;
-    int cur, limit, old_limit;
+    int cur, limit, old_limit, summed;
     z->zout = zout;
+    if (z->flush) return stbi__zflush(z, n);
     if (!z->z_expandable) return stbi__err("output buffer limit", "Corrupt PNG");
     cur = (int)(z->zout - z->zout_start);
+    summed = z->adler_from ? (int)(z->adler_from - z->zout_start) : -1;
     limit = old_limit = (int)(z->zout_end - z->zout_start);
-    while (cur + n > limit)
+    // a corrupt stream can keep producing output; stop before the size overflows
+    if (n > INT_MAX - cur) return stbi__err("output buffer limit", "Corrupt PNG");
+    while (cur + n > limit) {
+        if (limit > INT_MAX / 2) return stbi__err("output buffer limit", "Corrupt PNG");
         limit *= 2;
-    q = (char *)STBI_REALLOC_SIZED(z->zout_start, old_limit, limit);
+    }
+    q = (char *)stbi__realloc_sized(z->zout_start, old_limit, limit);
     STBI_NOTUSED(old_limit);
     if (q == NULL) return stbi__err("outofmem", "Out of memory");
+    STBI__STAT_ADD(zexpand_reallocs, 1);
     z->zout_start = q;
     z->zout = q + cur;
     z->zout_end = q + limit;
+    if (summed >= 0) z->adler_from = q + summed;
     return 1;
 }
 
@@ -4106,13 +7625,39 @@ static void stbi__init_zdefaults(void)
     for (i = 0; i <= 31; ++i)     stbi__zdefault_distance[i] = 5;
 }
 
+// the Adler-32 that ends a zlib stream, on the byte boundary after the data
+static int stbi__zcheck_adler(stbi__zbuf *a)
+{
+    stbi__uint32 stored = 0;
+    int k;
+    if (a->num_bits & 7)
+        stbi__zreceive(a, a->num_bits & 7);
+    for (k = 0; k < 4; ++k)
+        stored = (stored << 8) | (a->num_bits ? stbi__zreceive(a, 8) : stbi__zget8(a));
+    return stored == a->adler ? 1 : stbi__err("bad adler32", "Corrupt PNG");
+}
+
+#define STBI__ZLIB_CHECK_ADLER  2   // parse_header flag: also verify the stream's Adler-32
+
 static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
 {
     int final, type;
+    STBI__STAT_TIMER(t)
+    STBI__STAT_START(t);
     if (parse_header)
         if (!stbi__parse_zlib_header(a)) return 0;
     a->num_bits = 0;
     a->code_buffer = 0;
+    a->adler_from = NULL;
+    if (parse_header & STBI__ZLIB_CHECK_ADLER) {
+        a->adler = 1;
+        a->adler_from = a->zout;
+#ifdef STBI__SSSE3
+        a->adler_simd = stbi__ssse3_available();
+#else
+        a->adler_simd = 0;
+#endif
+    }
     do {
         final = stbi__zreceive(a, 1);
         type = stbi__zreceive(a, 2);
@@ -4134,8 +7679,13 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
             }
             if (!stbi__parse_huffman_block(a)) return 0;
         }
+        // sum each block's output while it's still in cache
+        if (a->adler_from) stbi__zadler_fold(a);
     } while (!final);
-    return 1;
+    // a window that has slid along counted what it dropped as it went
+    STBI__STAT_ADD(inflate_bytes, (size_t)(a->zout - a->zout_start));
+    STBI__STAT_STOP(t, inflate_seconds);
+    return a->adler_from ? stbi__zcheck_adler(a) : 1;
 }
 
 static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse_header)
@@ -4144,10 +7694,27 @@ static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse
     a->zout = obuf;
     a->zout_end = obuf + olen;
     a->z_expandable = exp;
+    a->flush = NULL;
 
     return stbi__parse_zlib(a, parse_header);
 }
 
+// inflate through a window of olen bytes, handing output to 'flush' as it fills
+static int stbi__do_zlib_stream(stbi__zbuf *a, char *window, int olen, int parse_header, int(*flush)(void *user, stbi_uc *data, int len), void *user)
+{
+    a->zout_start = window;
+    a->zout = window;
+    a->zout_end = window + olen;
+    a->z_expandable = 0;
+    a->zout_flushed = window;
+    a->flush = flush;
+    a->flush_user = user;
+
+    if (!stbi__parse_zlib(a, parse_header)) return 0;
+    // hand over whatever is left
+    return flush(user, (stbi_uc *)a->zout_flushed, (int)(a->zout - a->zout_flushed)) >= 0;
+}
+
 STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen)
 {
     stbi__zbuf a;
@@ -4160,7 +7727,7 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int
         return a.zout_start;
     }
     else {
-        STBI_FREE(a.zout_start);
+        stbi__free(a.zout_start);
         return NULL;
     }
 }
@@ -4182,7 +7749,7 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, i
         return a.zout_start;
     }
     else {
-        STBI_FREE(a.zout_start);
+        stbi__free(a.zout_start);
         return NULL;
     }
 }
@@ -4210,7 +7777,7 @@ STBIDEF char *stbi_zlib_decode_noheader_malloc(char const *buffer, int len, int
         return a.zout_start;
     }
     else {
-        STBI_FREE(a.zout_start);
+        stbi__free(a.zout_start);
         return NULL;
     }
 }
@@ -4230,7 +7797,7 @@ STBIDEF int stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const char
 // public domain "baseline" PNG decoder   v0.10  Sean Barrett 2006-11-18
 //    simple implementation
 //      - only 8-bit samples
-//      - no CRC checking
+//      - CRC and Adler-32 checking only if asked for
 //      - allocates lots of intermediate memory
 //        - avoids problem of streaming data between subsystems
 //        - avoids explicit window management
@@ -4266,8 +7833,16 @@ typedef struct
     stbi__context *s;
     stbi_uc *idata, *expanded, *out;
     int depth;
+    int out_stride; // nonzero if out is the caller's memory, with this row pitch
+    int ring;       // nonzero if out only holds two scanlines, used alternately
 } stbi__png;
 
+// scanline j of a->out
+static stbi_uc *stbi__png_row(stbi__png *a, ptrdiff_t pitch, stbi__uint32 j)
+{
+    return a->out + pitch * (ptrdiff_t)(a->ring ? (j & 1) : j);
+}
+
 
 enum {
     STBI__F_none = 0,
@@ -4302,40 +7877,61 @@ static int stbi__paeth(int a, int b, int c)
 
 static stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
 
-// create the png data from post-deflated data
-static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
+// Adam7 pass origins and spacing
+static int stbi__png_xorig[7] = { 0,4,0,2,0,1,0 };
+static int stbi__png_yorig[7] = { 0,0,4,0,2,0,1 };
+static int stbi__png_xspc[7] = { 8,8,4,4,2,2,1 };
+static int stbi__png_yspc[7] = { 8,8,8,4,4,2,2 };
+
+// size of the inflated image data: a filter byte plus the packed samples for
+// every scanline, summed over the seven passes if interlaced
+static stbi__uint32 stbi__png_raw_size(stbi__uint32 x, stbi__uint32 y, int img_n, int depth, int interlaced)
+{
+    stbi__uint32 total = 0;
+    int p;
+    if (!interlaced)
+        return ((((img_n * x * depth) + 7) >> 3) + 1) * y;
+    for (p = 0; p < 7; ++p) {
+        stbi__uint32 px = (x - stbi__png_xorig[p] + stbi__png_xspc[p] - 1) / stbi__png_xspc[p];
+        stbi__uint32 py = (y - stbi__png_yorig[p] + stbi__png_yspc[p] - 1) / stbi__png_yspc[p];
+        if (px && py)
+            total += ((((img_n * px * depth) + 7) >> 3) + 1) * py;
+    }
+    return total;
+}
+
+// unfilter scanlines [j0,j1) of an x-pixel-wide (sub)image into a->out; raw
+// points at the filter byte of scanline j0. 1/2/4-bit rows are left packed at
+// the right end of their output row and 16-bit samples are left big-endian,
+// since the next scanline's filter reads them; stbi__finish_png_rows fixes
+// them up afterwards.
+static int stbi__unfilter_png_rows(stbi__png *a, stbi_uc *raw, int out_n, stbi__uint32 x, stbi__uint32 j0, stbi__uint32 j1, int depth)
 {
     int bytes = (depth == 16 ? 2 : 1);
     stbi__context *s = a->s;
     stbi__uint32 i, j, stride = x*out_n*bytes;
-    stbi__uint32 img_len, img_width_bytes;
+    stbi__uint32 img_width_bytes;
     int k;
     int img_n = s->img_n; // copy it into a local for later
 
     int output_bytes = out_n*bytes;
     int filter_bytes = img_n*bytes;
     int width = x;
+    ptrdiff_t pitch = a->out_stride ? a->out_stride : (ptrdiff_t)stride;
+    STBI__STAT_TIMER(t)
 
+    STBI__STAT_START(t);
     STBI_ASSERT(out_n == s->img_n || out_n == s->img_n + 1);
-    a->out = (stbi_uc *)stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
-    if (!a->out) return stbi__err("outofmem", "Out of memory");
-
     img_width_bytes = (((img_n * x * depth) + 7) >> 3);
-    img_len = (img_width_bytes + 1) * y;
-    if (s->img_x == x && s->img_y == y) {
-        if (raw_len != img_len) return stbi__err("not enough pixels", "Corrupt PNG");
-    }
-    else { // interlaced:
-        if (raw_len < img_len) return stbi__err("not enough pixels", "Corrupt PNG");
-    }
 
-    for (j = 0; j < y; ++j) {
-        stbi_uc *cur = a->out + stride*j;
-        stbi_uc *prior = cur - stride;
+    for (j = j0; j < j1; ++j) {
+        stbi_uc *cur = stbi__png_row(a, pitch, j);
+        stbi_uc *prior;
         int filter = *raw++;
 
         if (filter > 4)
             return stbi__err("invalid filter", "Corrupt PNG");
+        STBI__STAT_ADD(png_filters[filter], 1);
 
         if (depth < 8) {
             STBI_ASSERT(img_width_bytes <= x);
@@ -4343,6 +7939,8 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
             filter_bytes = 1;
             width = img_width_bytes;
         }
+        // in a ring, even scanlines have the previous one after them
+        prior = a->ring && !(j & 1) ? cur + pitch : cur - pitch;
 
         // if first row, use special filter that doesn't sample previous row
         if (j == 0) filter = first_row_filter[filter];
@@ -4421,21 +8019,35 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
             // the loop above sets the high byte of the pixels' alpha, but for
             // 16 bit png files we also need the low byte set. we'll do that here.
             if (depth == 16) {
-                cur = a->out + stride*j; // start at the beginning of the row again
+                cur = stbi__png_row(a, pitch, j); // start at the beginning of the row again
                 for (i = 0; i < x; ++i, cur += output_bytes) {
                     cur[filter_bytes + 1] = 255;
                 }
             }
         }
     }
+    STBI__STAT_STOP(t, unfilter_seconds);
+    return 1;
+}
+
+// expand 1/2/4-bit samples to bytes and swap 16-bit samples to native order
+// for scanlines [j0,j1). this overwrites what the following scanline's filter
+// reads, so run it at least one scanline behind stbi__unfilter_png_rows.
+static void stbi__finish_png_rows(stbi__png *a, int out_n, stbi__uint32 x, stbi__uint32 j0, stbi__uint32 j1, int depth, int color)
+{
+    int bytes = (depth == 16 ? 2 : 1);
+    int img_n = a->s->img_n;
+    stbi__uint32 i, j, stride = x*out_n*bytes;
+    stbi__uint32 img_width_bytes = (((img_n * x * depth) + 7) >> 3);
+    int k;
+
+    // only 8-bit images, which need nothing done here, go to caller memory
+    STBI_ASSERT(!a->out_stride || depth == 8);
 
-    // we make a separate pass to expand bits to pixels; for performance,
-    // this could run two scanlines behind the above code, so it won't
-    // intefere with filtering but will still be in the cache.
     if (depth < 8) {
-        for (j = 0; j < y; ++j) {
-            stbi_uc *cur = a->out + stride*j;
-            stbi_uc *in = a->out + stride*j + x*out_n - img_width_bytes;
+        for (j = j0; j < j1; ++j) {
+            stbi_uc *cur = stbi__png_row(a, stride, j);
+            stbi_uc *in = cur + x*out_n - img_width_bytes;
             // unpack 1/2/4-bit into a 8-bit buffer. allows us to keep the common 8-bit path optimal at minimal cost for 1/2/4-bit
             // png guarante byte alignment, if width is not multiple of 8/4/2 we'll decode dummy trailing data that will be skipped in the later loop
             stbi_uc scale = (color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
@@ -4486,7 +8098,7 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
             if (img_n != out_n) {
                 int q;
                 // insert alpha = 255
-                cur = a->out + stride*j;
+                cur = stbi__png_row(a, stride, j);
                 if (img_n == 1) {
                     for (q = x - 1; q >= 0; --q) {
                         cur[q * 2 + 1] = 255;
@@ -4507,95 +8119,342 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
     }
     else if (depth == 16) {
         // force the image data from big-endian to platform-native.
-        // this is done in a separate pass due to the decoding relying
-        // on the data being untouched, but could probably be done
-        // per-line during decode if care is taken.
-        stbi_uc *cur = a->out;
-        stbi__uint16 *cur16 = (stbi__uint16*)cur;
+        for (j = j0; j < j1; ++j) {
+            stbi_uc *cur = stbi__png_row(a, stride, j);
+            stbi__uint16 *cur16 = (stbi__uint16*)cur;
 
-        for (i = 0; i < x*y*out_n; ++i, cur16++, cur += 2) {
-            *cur16 = (cur[0] << 8) | cur[1];
+            for (i = 0; i < x*out_n; ++i, cur16++, cur += 2) {
+                *cur16 = (cur[0] << 8) | cur[1];
+            }
         }
     }
+}
+
+// create the png data from post-deflated data
+static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
+{
+    int bytes = (depth == 16 ? 2 : 1);
+    stbi__context *s = a->s;
+    stbi__uint32 img_len;
+
+    if (!a->out_stride) {
+        a->out = (stbi_uc *)stbi__malloc_mad3(x, y, out_n*bytes, 0); // extra bytes to write off the end into
+        if (!a->out) return stbi__err("outofmem", "Out of memory");
+    }
+
+    img_len = ((((s->img_n * x * depth) + 7) >> 3) + 1) * y;
+    if (s->img_x == x && s->img_y == y) {
+        if (raw_len != img_len) return stbi__err("not enough pixels", "Corrupt PNG");
+    }
+    else { // interlaced:
+        if (raw_len < img_len) return stbi__err("not enough pixels", "Corrupt PNG");
+    }
 
+    if (!stbi__unfilter_png_rows(a, raw, out_n, x, 0, y, depth)) return 0;
+    stbi__finish_png_rows(a, out_n, x, 0, y, depth, color);
     return 1;
 }
 
+// copy one scanline of an Adam7 pass to every xspc'th pixel of dest
+static void stbi__png_scatter_row(stbi_uc *dest, stbi_uc *src, int x, int xspc, int out_bytes)
+{
+    int i, step = xspc * out_bytes;
+    // constant-size copies, so the compiler can turn them into plain moves
+#define STBI__CASE(n) \
+        case n: for (i = 0; i < x; ++i, dest += step, src += n) memcpy(dest, src, n); break;
+    switch (out_bytes) {
+        STBI__CASE(1)
+        STBI__CASE(2)
+        STBI__CASE(3)
+        STBI__CASE(4)
+        STBI__CASE(6)
+        STBI__CASE(8)
+        default: STBI_ASSERT(0);
+    }
+#undef STBI__CASE
+}
+
+// copy the x*y pixels of Adam7 pass p from a->out into their places in final
+static void stbi__png_scatter_pass(stbi__png *a, stbi_uc *final, int p, int x, int y, int out_bytes)
+{
+    int j, stride = a->s->img_x * out_bytes;
+    for (j = 0; j < y; ++j)
+        stbi__png_scatter_row(final + (j*stbi__png_yspc[p] + stbi__png_yorig[p])*stride + stbi__png_xorig[p]*out_bytes,
+            a->out + j*x*out_bytes, x, stbi__png_xspc[p], out_bytes);
+}
+
+// once inflated, the seven passes are independent, so they're unfiltered in
+// parallel and then scattered into the final image one 8-scanline band at a
+// time, with every pass contributing to a band while it's in cache. all
+// memory is allocated up front, on the calling thread, so the tasks never
+// touch the allocator
+typedef struct
+{
+    stbi__png pass[7];
+    stbi_uc *raw[7];
+    int x[7], y[7], ok[7];
+    int out_n, depth, color;
+    stbi_uc *final;
+} stbi__png_adam7;
+
+static void stbi__png_unfilter_pass_task(void *data, int p)
+{
+    stbi__png_adam7 *d = (stbi__png_adam7 *)data;
+    if (d->x[p]) {
+        d->ok[p] = stbi__unfilter_png_rows(&d->pass[p], d->raw[p], d->out_n, d->x[p], 0, d->y[p], d->depth);
+        if (d->ok[p])
+            stbi__finish_png_rows(&d->pass[p], d->out_n, d->x[p], 0, d->y[p], d->depth, d->color);
+    }
+}
+
+static void stbi__png_scatter_band_task(void *data, int band)
+{
+    stbi__png_adam7 *d = (stbi__png_adam7 *)data;
+    stbi__context *s = d->pass[0].s;
+    int out_bytes = d->out_n * (d->depth == 16 ? 2 : 1);
+    int p, j, out_y, stride = s->img_x * out_bytes;
+    for (out_y = band * 8; out_y < band * 8 + 8 && out_y < (int)s->img_y; ++out_y) {
+        for (p = 0; p < 7; ++p) {
+            if (!d->x[p] || out_y < stbi__png_yorig[p] || (out_y - stbi__png_yorig[p]) % stbi__png_yspc[p]) continue;
+            j = (out_y - stbi__png_yorig[p]) / stbi__png_yspc[p];
+            stbi__png_scatter_row(d->final + out_y*stride + stbi__png_xorig[p]*out_bytes,
+                d->pass[p].out + j*d->x[p]*out_bytes, d->x[p], stbi__png_xspc[p], out_bytes);
+        }
+    }
+}
+
 static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint32 image_data_len, int out_n, int depth, int color, int interlaced)
 {
     int bytes = (depth == 16 ? 2 : 1);
     int out_bytes = out_n * bytes;
-    stbi_uc *final;
-    int p;
+    stbi__png_adam7 d;
+    int p, ok = 1;
     if (!interlaced)
         return stbi__create_png_image_raw(a, image_data, image_data_len, out_n, a->s->img_x, a->s->img_y, depth, color);
 
     // de-interlacing
-    final = (stbi_uc *)stbi__malloc_mad3(a->s->img_x, a->s->img_y, out_bytes, 0);
+    d.final = (stbi_uc *)stbi__malloc_mad3(a->s->img_x, a->s->img_y, out_bytes, 0);
+    if (!d.final) return stbi__err("outofmem", "Out of memory");
+    d.out_n = out_n;
+    d.depth = depth;
+    d.color = color;
+    for (p = 0; p < 7; ++p) {
+        d.pass[p].s = a->s;
+        d.pass[p].out = NULL;
+        d.pass[p].out_stride = 0;
+        d.pass[p].ring = 0;
+        d.ok[p] = 1;
+    }
     for (p = 0; p < 7; ++p) {
-        int xorig[] = { 0,4,0,2,0,1,0 };
-        int yorig[] = { 0,0,4,0,2,0,1 };
-        int xspc[] = { 8,8,4,4,2,2,1 };
-        int yspc[] = { 8,8,8,4,4,2,2 };
-        int i, j, x, y;
         // pass1_x[4] = 0, pass1_x[5] = 1, pass1_x[12] = 1
-        x = (a->s->img_x - xorig[p] + xspc[p] - 1) / xspc[p];
-        y = (a->s->img_y - yorig[p] + yspc[p] - 1) / yspc[p];
-        if (x && y) {
-            stbi__uint32 img_len = ((((a->s->img_n * x * depth) + 7) >> 3) + 1) * y;
-            if (!stbi__create_png_image_raw(a, image_data, image_data_len, out_n, x, y, depth, color)) {
-                STBI_FREE(final);
-                return 0;
+        d.x[p] = (a->s->img_x - stbi__png_xorig[p] + stbi__png_xspc[p] - 1) / stbi__png_xspc[p];
+        d.y[p] = (a->s->img_y - stbi__png_yorig[p] + stbi__png_yspc[p] - 1) / stbi__png_yspc[p];
+        if (!d.y[p]) d.x[p] = 0;
+        if (d.x[p]) {
+            stbi__uint32 img_len = ((((a->s->img_n * d.x[p] * depth) + 7) >> 3) + 1) * d.y[p];
+            d.raw[p] = image_data;
+            if (image_data_len < img_len) {
+                ok = stbi__err("not enough pixels", "Corrupt PNG");
+                break;
             }
-            for (j = 0; j < y; ++j) {
-                for (i = 0; i < x; ++i) {
-                    int out_y = j*yspc[p] + yorig[p];
-                    int out_x = i*xspc[p] + xorig[p];
-                    memcpy(final + out_y*a->s->img_x*out_bytes + out_x*out_bytes,
-                        a->out + (j*x + i)*out_bytes, out_bytes);
-                }
+            d.pass[p].out = (stbi_uc *)stbi__malloc_mad3(d.x[p], d.y[p], out_bytes, 0);
+            if (!d.pass[p].out) {
+                ok = stbi__err("outofmem", "Out of memory");
+                break;
+            }
+            image_data += img_len;
+            image_data_len -= img_len;
+        }
+    }
+    if (ok) {
+        int parallel = a->s->img_x * a->s->img_y >= 65536;
+        stbi__parallel_for(stbi__png_unfilter_pass_task, &d, 7, parallel);
+        for (p = 0; p < 7; ++p)
+            ok &= d.ok[p];
+        if (ok)
+            stbi__parallel_for(stbi__png_scatter_band_task, &d, (a->s->img_y + 7) / 8, parallel);
+    }
+    for (p = 0; p < 7; ++p)
+        stbi__free(d.pass[p].out);
+    if (!ok) {
+        stbi__free(d.final);
+        return 0;
+    }
+    a->out = d.final;
+
+    return 1;
+}
+
+// Streaming decode: rather than inflating the whole image before unfiltering
+// it, inflate into a window a few hundred KB in size and unfilter scanlines
+// as soon as they are complete, while they're still in the cache. Only the
+// output image (plus one Adam7 pass when interlaced) is ever fully resident.
+
+#ifndef STBI_PNG_STREAM_THRESHOLD
+#define STBI_PNG_STREAM_THRESHOLD  (1 << 20)  // stream images that inflate to more bytes than this
+#endif
+
+// stbi_load_rows*: what stbi__parse_png_file would do to the whole image,
+// for doing to each row before sending it
+typedef struct
+{
+    stbi_uc *palette;       // 256 RGBA entries
+    stbi_uc *tc;            // transparent color
+    stbi__uint16 *tc16;
+    stbi_uc *line;          // scratch for one converted row
+    int pal_img_n, has_trans, de_iphone, req_comp;
+} stbi__png_post;
+
+static int stbi__png_send_rows(stbi__png *a, stbi__png_post const *post, stbi__uint32 j0, stbi__uint32 j1);
+
+typedef struct
+{
+    stbi__png *a;
+    stbi__png_post const *post; // send each row once it's finished, if not NULL
+    stbi_uc *final;         // de-interlaced image, while decoding passes into a->out
+    int out_n, depth, color, interlaced, done;
+    int pass;               // current Adam7 pass
+    stbi__uint32 x, y;      // size of the current pass
+    stbi__uint32 row;       // next scanline to unfilter
+    stbi__uint32 finished;  // scanlines before this are fully expanded
+    stbi__uint32 row_bytes; // filter byte + packed samples
+} stbi__png_stream;
+
+// set up output for the next non-empty pass, or mark the image complete
+static int stbi__png_stream_next_pass(stbi__png_stream *st)
+{
+    stbi__png *a = st->a;
+    int out_bytes = st->out_n * (st->depth == 16 ? 2 : 1);
+    if (!st->interlaced) {
+        if (++st->pass) { st->done = 1; return 1; }
+        st->x = a->s->img_x;
+        st->y = a->s->img_y;
+    }
+    else {
+        if (a->out) {
+            stbi__png_scatter_pass(a, st->final, st->pass, st->x, st->y, out_bytes);
+            stbi__free(a->out); a->out = NULL;
+        }
+        for (;;) {
+            if (++st->pass == 7) {
+                a->out = st->final; st->final = NULL;
+                st->done = 1;
+                return 1;
             }
-            STBI_FREE(a->out);
-            image_data += img_len;
-            image_data_len -= img_len;
+            st->x = (a->s->img_x - stbi__png_xorig[st->pass] + stbi__png_xspc[st->pass] - 1) / stbi__png_xspc[st->pass];
+            st->y = (a->s->img_y - stbi__png_yorig[st->pass] + stbi__png_yspc[st->pass] - 1) / stbi__png_yspc[st->pass];
+            if (st->x && st->y) break;
         }
     }
-    a->out = final;
-
+    if (!a->out_stride) {
+        a->out = (stbi_uc *)stbi__malloc_mad3(st->x, a->ring ? 2 : st->y, out_bytes, 0);
+        if (!a->out) return stbi__err("outofmem", "Out of memory");
+    }
+    st->row = st->finished = 0;
+    st->row_bytes = (((a->s->img_n * st->x * st->depth) + 7) >> 3) + 1;
     return 1;
 }
 
+// zlib flush callback: unfilter every complete scanline in data
+static int stbi__png_stream_rows(void *user, stbi_uc *data, int len)
+{
+    stbi__png_stream *st = (stbi__png_stream *)user;
+    int used = 0;
+    while (!st->done) {
+        stbi__uint32 n = (stbi__uint32)(len - used) / st->row_bytes;
+        if (n == 0) break;
+        if (n > st->y - st->row) n = st->y - st->row;
+        // a ring has room for one new scanline at a time
+        if (st->a->ring) n = 1;
+        if (!stbi__unfilter_png_rows(st->a, data + used, st->out_n, st->x, st->row, st->row + n, st->depth)) return -1;
+        st->row += n;
+        used += n * st->row_bytes;
+        // the newest scanline stays packed until the next one has read it
+        if (st->row == st->y) {
+            stbi__finish_png_rows(st->a, st->out_n, st->x, st->finished, st->y, st->depth, st->color);
+            if (st->post && !stbi__png_send_rows(st->a, st->post, st->finished, st->y)) return -1;
+            if (!stbi__png_stream_next_pass(st)) return -1;
+        }
+        else {
+            stbi__finish_png_rows(st->a, st->out_n, st->x, st->finished, st->row - 1, st->depth, st->color);
+            if (st->post && !stbi__png_send_rows(st->a, st->post, st->finished, st->row - 1)) return -1;
+            st->finished = st->row - 1;
+        }
+    }
+    if (st->done && used < len) {
+        // same leniency as stbi__create_png_image_raw: extra data is only
+        // tolerated after an interlaced image
+        if (!st->interlaced) return stbi__err("not enough pixels", "Corrupt PNG");
+        used = len;
+    }
+    return used;
+}
+
+static int stbi__create_png_image_stream(stbi__png *a, stbi__uint32 idata_len, int out_n, int depth, int color, int interlaced, int parse_header, stbi__png_post const *post)
+{
+    stbi__png_stream st;
+    stbi__zbuf z;
+    stbi_uc *window;
+    int ok, window_len;
+
+    st.a = a;
+    st.post = post;
+    st.final = NULL;
+    st.out_n = out_n;
+    st.depth = depth;
+    st.color = color;
+    st.interlaced = interlaced;
+    st.done = 0;
+    st.pass = -1;
+    if (interlaced) {
+        st.final = (stbi_uc *)stbi__malloc_mad3(a->s->img_x, a->s->img_y, out_n * (depth == 16 ? 2 : 1), 0);
+        if (!st.final) return stbi__err("outofmem", "Out of memory");
+    }
+    if (!stbi__png_stream_next_pass(&st)) {
+        stbi__free(st.final);
+        return 0;
+    }
+
+    // room for the back-reference window and a couple of the widest scanlines
+    window_len = 8 * STBI__ZWINDOW + 2 * (int)st.row_bytes;
+    window = (stbi_uc *)stbi__malloc(window_len);
+    if (!window) {
+        stbi__free(st.final);
+        return stbi__err("outofmem", "Out of memory");
+    }
+    z.zbuffer = a->idata;
+    z.zbuffer_end = a->idata + idata_len;
+    ok = stbi__do_zlib_stream(&z, (char *)window, window_len, parse_header, stbi__png_stream_rows, &st);
+    stbi__free(window);
+    stbi__free(st.final);
+    if (ok && !st.done) return stbi__err("not enough pixels", "Corrupt PNG");
+    return ok;
+}
+
 static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
 {
     stbi__context *s = z->s;
-    stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-    stbi_uc *p = z->out;
+    stbi__uint32 pixel_count = s->img_x * s->img_y;
+    stbi__pixel_kernels k;
+    STBI__STAT_TIMER(t)
 
     // compute color-based transparency, assuming we've
     // already got 255 as the alpha value in the output
     STBI_ASSERT(out_n == 2 || out_n == 4);
 
-    if (out_n == 2) {
-        for (i = 0; i < pixel_count; ++i) {
-            p[1] = (p[0] == tc[0] ? 0 : 255);
-            p += 2;
-        }
-    }
-    else {
-        for (i = 0; i < pixel_count; ++i) {
-            if (p[0] == tc[0] && p[1] == tc[1] && p[2] == tc[2])
-                p[3] = 0;
-            p += 4;
-        }
-    }
+    STBI__STAT_START(t);
+    stbi__setup_pixel_kernels(&k);
+    if (out_n == 2)
+        k.key_grey(z->out, tc, (int)pixel_count);
+    else
+        k.key_rgb(z->out, tc, (int)pixel_count);
+    STBI__STAT_PASS(t);
     return 1;
 }
 
-static int stbi__compute_transparency16(stbi__png *z, stbi__uint16 tc[3], int out_n)
+static void stbi__compute_transparency16_row(stbi__uint16 *p, stbi__uint16 const tc[3], int out_n, stbi__uint32 pixel_count)
 {
-    stbi__context *s = z->s;
-    stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-    stbi__uint16 *p = (stbi__uint16*)z->out;
+    stbi__uint32 i;
 
     // compute color-based transparency, assuming we've
     // already got 65535 as the alpha value in the output
@@ -4614,13 +8473,24 @@ static int stbi__compute_transparency16(stbi__png *z, stbi__uint16 tc[3], int ou
             p += 4;
         }
     }
+}
+
+static int stbi__compute_transparency16(stbi__png *z, stbi__uint16 tc[3], int out_n)
+{
+    stbi__context *s = z->s;
+    STBI__STAT_TIMER(t)
+    STBI__STAT_START(t);
+    stbi__compute_transparency16_row((stbi__uint16*)z->out, tc, out_n, s->img_x * s->img_y);
+    STBI__STAT_PASS(t);
     return 1;
 }
 
 static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int pal_img_n)
 {
-    stbi__uint32 i, pixel_count = a->s->img_x * a->s->img_y;
+    stbi__uint32 pixel_count = a->s->img_x * a->s->img_y;
     stbi_uc *p, *temp_out, *orig = a->out;
+    stbi__pixel_kernels k;
+    STBI__STAT_TIMER(t)
 
     p = (stbi_uc *)stbi__malloc_mad2(pixel_count, pal_img_n, 0);
     if (p == NULL) return stbi__err("outofmem", "Out of memory");
@@ -4628,35 +8498,25 @@ static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int
     // between here and free(out) below, exitting would leak
     temp_out = p;
 
-    if (pal_img_n == 3) {
-        for (i = 0; i < pixel_count; ++i) {
-            int n = orig[i] * 4;
-            p[0] = palette[n];
-            p[1] = palette[n + 1];
-            p[2] = palette[n + 2];
-            p += 3;
-        }
-    }
-    else {
-        for (i = 0; i < pixel_count; ++i) {
-            int n = orig[i] * 4;
-            p[0] = palette[n];
-            p[1] = palette[n + 1];
-            p[2] = palette[n + 2];
-            p[3] = palette[n + 3];
-            p += 4;
-        }
-    }
-    STBI_FREE(a->out);
+    STBI__STAT_START(t);
+    // palette holds 256 entries of 4 bytes
+    stbi__setup_pixel_kernels(&k);
+    if (pal_img_n == 3)
+        k.palette3(p, orig, palette, (int)pixel_count);
+    else
+        k.palette4(p, orig, palette, (int)pixel_count);
+    stbi__free(a->out);
     a->out = temp_out;
 
     STBI_NOTUSED(len);
 
+    STBI__STAT_PASS(t);
     return 1;
 }
 
 static int stbi__unpremultiply_on_load = 0;
 static int stbi__de_iphone_flag = 0;
+static int stbi__png_verify_flag = 0;
 
 STBIDEF void stbi_set_unpremultiply_on_load(int flag_true_if_should_unpremultiply)
 {
@@ -4668,23 +8528,21 @@ STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert)
     stbi__de_iphone_flag = flag_true_if_should_convert;
 }
 
-static void stbi__de_iphone(stbi__png *z)
+STBIDEF void stbi_set_png_verify_checksums(int flag_true_if_should_verify)
 {
-    stbi__context *s = z->s;
-    stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-    stbi_uc *p = z->out;
+    stbi__png_verify_flag = flag_true_if_should_verify;
+}
 
-    if (s->img_out_n == 3) {  // convert bgr to rgb
-        for (i = 0; i < pixel_count; ++i) {
-            stbi_uc t = p[0];
-            p[0] = p[2];
-            p[2] = t;
-            p += 3;
-        }
+static void stbi__de_iphone_row(stbi__pixel_kernels const *k, stbi_uc *p, int out_n, stbi__uint32 pixel_count)
+{
+    stbi__uint32 i;
+
+    if (out_n == 3) {  // convert bgr to rgb
+        k->swap_rb3(p, p, (int)pixel_count);
     }
     else {
-        STBI_ASSERT(s->img_out_n == 4);
-        if (stbi__unpremultiply_on_load) {
+        STBI_ASSERT(out_n == 4);
+        if (stbi__option(unpremultiply, stbi__unpremultiply_on_load)) {
             // convert bgr to rgb and unpremultiply
             for (i = 0; i < pixel_count; ++i) {
                 stbi_uc a = p[3];
@@ -4703,30 +8561,220 @@ static void stbi__de_iphone(stbi__png *z)
         }
         else {
             // convert bgr to rgb
-            for (i = 0; i < pixel_count; ++i) {
-                stbi_uc t = p[0];
-                p[0] = p[2];
-                p[2] = t;
-                p += 4;
+            k->swap_rb4(p, p, (int)pixel_count);
+        }
+    }
+}
+
+static void stbi__de_iphone(stbi__png *z)
+{
+    stbi__context *s = z->s;
+    stbi__pixel_kernels k;
+    STBI__STAT_TIMER(t)
+
+    STBI__STAT_START(t);
+    stbi__setup_pixel_kernels(&k);
+    stbi__de_iphone_row(&k, z->out, s->img_out_n, s->img_x * s->img_y);
+    STBI__STAT_PASS(t);
+}
+
+// finish scanlines [j0,j1) of a->out the way a whole image would be finished,
+// then send them to the stbi_load_rows* callbacks
+static int stbi__png_send_rows(stbi__png *a, stbi__png_post const *post, stbi__uint32 j0, stbi__uint32 j1)
+{
+    stbi__context *s = a->s;
+    stbi__pixel_kernels k;
+    stbi__uint32 j, x = s->roi_x1 - s->roi_x0;
+    int out_n = s->img_out_n;
+    int n = post->req_comp ? post->req_comp : post->pal_img_n ? post->pal_img_n : out_n;
+    int bytes = a->depth == 16 ? 2 : 1;
+    ptrdiff_t stride = (ptrdiff_t)s->img_x * out_n * bytes;
+    stbi__uint16 *line16 = (stbi__uint16 *)post->line;
+    stbi_uc *line8 = post->line + s->img_x * 8;
+
+    // only the columns and rows of the region are worth finishing
+    if (j0 < (stbi__uint32)s->roi_y0) j0 = s->roi_y0;
+    if (j1 > (stbi__uint32)s->roi_y1) j1 = s->roi_y1;
+    stbi__setup_pixel_kernels(&k);
+    for (j = j0; j < j1; ++j) {
+        stbi_uc *p = stbi__png_row(a, stride, j) + s->roi_x0 * out_n * bytes;
+        int c = out_n;
+        if (post->has_trans) {
+            if (a->depth == 16)
+                stbi__compute_transparency16_row((stbi__uint16 *)p, post->tc16, out_n, x);
+            else if (out_n == 2)
+                k.key_grey(p, post->tc, (int)x);
+            else
+                k.key_rgb(p, post->tc, (int)x);
+        }
+        if (post->de_iphone) {
+            // work on a copy: the unfiltering of the next row reads this one
+            memcpy(line8, p, (size_t)x * out_n);
+            p = line8;
+            stbi__de_iphone_row(&k, p, out_n, x);
+        }
+        if (post->pal_img_n) {
+            c = post->req_comp >= 3 ? post->req_comp : post->pal_img_n;
+            if (c == 3)
+                k.palette3(line8, p, post->palette, (int)x);
+            else
+                k.palette4(line8, p, post->palette, (int)x);
+            p = line8;
+        }
+        else if (a->depth == 16) {
+            // convert at 16 bits, then narrow, as stbi_load does
+            stbi__uint16 *p16 = (stbi__uint16 *)p;
+            if (post->req_comp && post->req_comp != c) {
+                stbi__convert_row16(line16, p16, c, post->req_comp, x);
+                p16 = line16;
+                c = post->req_comp;
             }
+            k.narrow16(line8, p16, (int)x * c);
+            p = line8;
         }
+        if (!stbi__rows_send(s, (int)j, 1, p, (int)x * c, s->roi_x0, c, n)) return 0;
     }
+    return 1;
 }
 
 #define STBI__PNG_TYPE(a,b,c,d)  (((a) << 24) + ((b) << 16) + ((c) << 8) + (d))
 
-static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
+static stbi_uc *stbi__png_inflate_buffer = NULL;
+static stbi__uint32 stbi__png_inflate_buffer_size = 0;
+
+// the scratch buffer this decode may use, if any, and its size
+static stbi_uc *stbi__png_scratch(stbi__uint32 *size)
+{
+    if (stbi__options) {
+        int n = stbi__options->png_inflate_buffer_size;
+        *size = (stbi__options->png_inflate_buffer && n > 0) ? (stbi__uint32)n : 0;
+        return *size ? (stbi_uc *)stbi__options->png_inflate_buffer : NULL;
+    }
+    *size = stbi__png_inflate_buffer_size;
+    return stbi__png_inflate_buffer;
+}
+
+STBIDEF void stbi_set_png_inflate_buffer(void *buffer, int buffer_size)
+{
+    stbi__png_inflate_buffer = buffer ? (stbi_uc *)buffer : NULL;
+    stbi__png_inflate_buffer_size = (buffer && buffer_size > 0) ? (stbi__uint32)buffer_size : 0;
+}
+
+// inflate the concatenated IDAT data into a buffer of exactly raw_len bytes,
+// either the caller-supplied one or a fresh allocation owned by z->expanded
+static stbi_uc *stbi__png_inflate(stbi__png *z, stbi__uint32 idata_len, stbi__uint32 *raw_len, int parse_header)
+{
+    stbi__zbuf a;
+    stbi__uint32 scratch_size;
+    stbi_uc *scratch = stbi__png_scratch(&scratch_size);
+    a.zbuffer = z->idata;
+    a.zbuffer_end = z->idata + idata_len;
+    if (scratch && *raw_len <= scratch_size) {
+        // caller's memory can't be reallocated, so stop at its end
+        if (!stbi__do_zlib(&a, (char *)scratch, scratch_size, 0, parse_header)) return NULL;
+    }
+    else {
+        z->expanded = (stbi_uc *)stbi__malloc(*raw_len);
+        if (z->expanded == NULL) return stbi__errpuc("outofmem", "Out of memory");
+        // the header gives the exact size, so any more output means a corrupt file
+        if (!stbi__do_zlib(&a, (char *)z->expanded, *raw_len, 0, parse_header)) return NULL;
+    }
+    *raw_len = (stbi__uint32)(a.zout - a.zout_start);
+    return (stbi_uc *)a.zout_start;
+}
+
+static int stbi__png_inflate_size_raw(stbi__context *s)
+{
+    stbi__pngchunk c;
+    stbi__uint32 x, y, raw_len;
+    int depth, color, interlace, img_n;
+    if (!stbi__check_png_header(s)) return 0;
+    c = stbi__get_chunk_header(s);
+    if (c.type != STBI__PNG_TYPE('I', 'H', 'D', 'R')) return stbi__err("first not IHDR", "Corrupt PNG");
+    if (c.length != 13) return stbi__err("bad IHDR len", "Corrupt PNG");
+    x = stbi__get32be(s); if (x > (1 << 24)) return stbi__err("too large", "Very large image (corrupt?)");
+    y = stbi__get32be(s); if (y > (1 << 24)) return stbi__err("too large", "Very large image (corrupt?)");
+    depth = stbi__get8(s); if (depth != 1 && depth != 2 && depth != 4 && depth != 8 && depth != 16) return stbi__err("1/2/4/8/16-bit only", "PNG not supported: 1/2/4/8/16-bit only");
+    color = stbi__get8(s); if (color > 6 || (color != 3 && (color & 1))) return stbi__err("bad ctype", "Corrupt PNG");
+    stbi__get8(s); stbi__get8(s); // compression and filter method
+    interlace = stbi__get8(s); if (interlace > 1) return stbi__err("bad interlace method", "Corrupt PNG");
+    if (!x || !y) return stbi__err("0-pixel image", "Corrupt PNG");
+    img_n = color == 3 ? 1 : (color & 2 ? 3 : 1) + (color & 4 ? 1 : 0);
+    if ((1 << 30) / x / img_n < y) return stbi__err("too large", "Image too large to decode");
+    // 16-bit samples can take the inflated size past what an int can hold
+    raw_len = stbi__png_raw_size(x, y, img_n, depth, interlace);
+    if (raw_len > INT_MAX) return stbi__err("too large", "Image too large to decode");
+    return (int)raw_len;
+}
+
+STBIDEF int stbi_png_inflate_size_from_memory(stbi_uc const *buffer, int len)
+{
+    stbi__context s;
+    stbi__start_mem(&s, buffer, len);
+    return stbi__png_inflate_size_raw(&s);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_png_inflate_size(char const *filename)
+{
+    FILE *f;
+    stbi__context s;
+    int result;
+#ifdef STBI__MMAP
+    stbi__map m;
+    if (stbi__map_file(&m, filename)) {
+        stbi__start_mem(&s, m.data, m.len);
+        result = stbi__png_inflate_size_raw(&s);
+        stbi__unmap_file(&m);
+        return result;
+    }
+#endif
+    f = stbi__fopen(filename, "rb");
+    if (!f) return stbi__err("can't fopen", "Unable to open file");
+    stbi__start_file(&s, f);
+    result = stbi__png_inflate_size_raw(&s);
+    fclose(f);
+    return result;
+}
+#endif
+
+// start a chunk's CRC, which covers its type and data
+static void stbi__png_crc_begin(stbi__context *s, stbi__uint32 type)
+{
+    stbi_uc t[4];
+    t[0] = STBI__BYTECAST(type >> 24);
+    t[1] = STBI__BYTECAST(type >> 16);
+    t[2] = STBI__BYTECAST(type >> 8);
+    t[3] = STBI__BYTECAST(type);
+    s->crc = stbi__crc32(0xffffffff, t, 4, 0);
+    s->crc_from = s->img_buffer;
+}
+
+// finish it and compare it with the one stored after the data
+static int stbi__png_crc_end(stbi__context *s)
+{
+    stbi__uint32 crc;
+    stbi__crc_fold(s);
+    crc = ~s->crc;
+    s->crc_from = NULL;
+    return stbi__get32be(s) == crc ? 1 : stbi__err("bad CRC", "Corrupt PNG");
+}
+
+static int stbi__parse_png_chunks(stbi__png *z, int scan, int req_comp)
 {
     stbi_uc palette[1024], pal_img_n = 0;
     stbi_uc has_trans = 0, tc[3];
     stbi__uint16 tc16[3];
     stbi__uint32 ioff = 0, idata_limit = 0, i, pal_len = 0;
-    int first = 1, k, interlace = 0, color = 0, is_iphone = 0;
+    int first = 1, k, interlace = 0, color = 0, is_iphone = 0, zlib;
+    int verify = stbi__option(png_verify_checksums, stbi__png_verify_flag);
     stbi__context *s = z->s;
 
     z->expanded = NULL;
     z->idata = NULL;
     z->out = NULL;
+    z->out_stride = 0;
+    z->ring = 0;
 
     if (!stbi__check_png_header(s)) return 0;
 
@@ -4734,6 +8782,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 
     for (;;) {
         stbi__pngchunk c = stbi__get_chunk_header(s);
+        if (verify) stbi__png_crc_begin(s, c.type);
         switch (c.type) {
         case STBI__PNG_TYPE('C', 'g', 'B', 'I'):
             is_iphone = 1;
@@ -4820,7 +8869,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                 while (ioff + c.length > idata_limit)
                     idata_limit *= 2;
                 STBI_NOTUSED(idata_limit_old);
-                p = (stbi_uc *)STBI_REALLOC_SIZED(z->idata, idata_limit_old, idata_limit); if (p == NULL) return stbi__err("outofmem", "Out of memory");
+                p = (stbi_uc *)stbi__realloc_sized(z->idata, idata_limit_old, idata_limit); if (p == NULL) return stbi__err("outofmem", "Out of memory");
                 z->idata = p;
             }
             if (!stbi__getn(s, z->idata + ioff, c.length)) return stbi__err("outofdata", "Corrupt PNG");
@@ -4829,21 +8878,87 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
         }
 
         case STBI__PNG_TYPE('I', 'E', 'N', 'D'): {
-            stbi__uint32 raw_len, bpl;
+            stbi__uint32 raw_len;
+            stbi_uc *raw;
+            stbi__uint32 scratch_size;
+            int stream;
+            stbi__png_post post;
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (scan != STBI__SCAN_load) return 1;
             if (z->idata == NULL) return stbi__err("no IDAT", "Corrupt PNG");
-            // initial guess for decoded data size to avoid unnecessary reallocs
-            bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
-            raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
-            z->expanded = (stbi_uc *)stbi_zlib_decode_malloc_guesssize_headerflag((char *)z->idata, ioff, raw_len, (int *)&raw_len, !is_iphone);
-            if (z->expanded == NULL) return 0; // zlib should set error
-            STBI_FREE(z->idata); z->idata = NULL;
+            if (verify && !stbi__png_crc_end(s)) return 0;
+            // an iPhone PNG's data has no zlib header or trailer
+            zlib = is_iphone ? 0 : verify ? 1 | STBI__ZLIB_CHECK_ADLER : 1;
             if ((req_comp == s->img_n + 1 && req_comp != 3 && !pal_img_n) || has_trans)
                 s->img_out_n = s->img_n + 1;
             else
                 s->img_out_n = s->img_n;
-            if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
+            // write straight to stbi_load_*_into's destination if nothing needs
+            // converting afterwards
+            if (s->dest && !interlace && z->depth == 8 && !pal_img_n && !has_trans && !is_iphone
+                && (!req_comp || req_comp == s->img_out_n)) {
+                if (!stbi__dest_fits(s, s->img_x, s->img_y, s->img_out_n)) return stbi__err("dest too small", "Destination too small");
+                z->out = s->dest;
+                z->out_stride = s->dest_stride;
+            }
+            // the decoded data size is known exactly, so inflate never has to realloc
+            raw_len = stbi__png_raw_size(s->img_x, s->img_y, s->img_n, z->depth, interlace);
+            // interlaced passes can be rebuilt in parallel only once fully inflated
+            stream = raw_len > STBI_PNG_STREAM_THRESHOLD && !(stbi__png_scratch(&scratch_size) && raw_len <= scratch_size);
+#ifdef STBI_THREADS
+            if (interlace && stbi__threads_available() > 1) stream = 0;
+#endif
+            if (s->rows) {
+                // stbi_load_rows*: a non-interlaced image streams through a
+                // two-scanline ring, each row sent as soon as it's finished;
+                // an interlaced one can only be sent once it's complete
+                post.palette = palette;
+                post.tc = tc;
+                post.tc16 = tc16;
+                post.pal_img_n = pal_img_n;
+                post.has_trans = has_trans;
+                post.de_iphone = is_iphone && stbi__option(convert_iphone_png_to_rgb, stbi__de_iphone_flag) && s->img_out_n > 2;
+                post.req_comp = req_comp;
+                k = req_comp ? req_comp : pal_img_n ? pal_img_n : s->img_out_n;
+                if (!stbi__rows_begin(s, s->img_x, s->img_y, pal_img_n ? pal_img_n : s->img_n, k)) return 0;
+                // room for a 16-bit row and an 8-bit one, of up to 4 channels
+                post.line = (stbi_uc *)stbi__malloc_mad2(s->img_x, 12, 0);
+                if (!post.line) return stbi__err("outofmem", "Out of memory");
+                if (!interlace) stream = z->ring = 1;
+            }
+            else
+                post.line = NULL;
+            if (stream) {
+                if (!stbi__create_png_image_stream(z, ioff, s->img_out_n, z->depth, color, interlace, zlib, z->ring ? &post : NULL)) {
+                    stbi__free(post.line);
+                    return 0;
+                }
+                stbi__free(z->idata); z->idata = NULL;
+            }
+            else {
+                // inflating the whole image needs its size to fit in an int;
+                // streaming doesn't
+                if (raw_len > INT_MAX) {
+                    stbi__free(post.line);
+                    return stbi__err("too large", "Image too large to decode");
+                }
+                raw = stbi__png_inflate(z, ioff, &raw_len, zlib);
+                if (raw == NULL) {
+                    stbi__free(post.line);
+                    return 0; // zlib should set error
+                }
+                stbi__free(z->idata); z->idata = NULL;
+                if (!stbi__create_png_image(z, raw, raw_len, s->img_out_n, z->depth, color, interlace)) {
+                    stbi__free(post.line);
+                    return 0;
+                }
+            }
+            if (s->rows) {
+                k = z->ring ? 1 : stbi__png_send_rows(z, &post, 0, s->img_y);
+                stbi__free(post.line);
+                stbi__free(z->expanded); z->expanded = NULL;
+                return k;
+            }
             if (has_trans) {
                 if (z->depth == 16) {
                     if (!stbi__compute_transparency16(z, tc16, s->img_out_n)) return 0;
@@ -4852,7 +8967,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                     if (!stbi__compute_transparency(z, tc, s->img_out_n)) return 0;
                 }
             }
-            if (is_iphone && stbi__de_iphone_flag && s->img_out_n > 2)
+            if (is_iphone && stbi__option(convert_iphone_png_to_rgb, stbi__de_iphone_flag) && s->img_out_n > 2)
                 stbi__de_iphone(z);
             if (pal_img_n) {
                 // pal_img_n == 3 or 4
@@ -4862,7 +8977,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                 if (!stbi__expand_png_palette(z, palette, pal_len, s->img_out_n))
                     return 0;
             }
-            STBI_FREE(z->expanded); z->expanded = NULL;
+            stbi__free(z->expanded); z->expanded = NULL;
             return 1;
         }
 
@@ -4883,37 +8998,61 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             stbi__skip(s, c.length);
             break;
         }
-        // end of PNG chunk, read and skip CRC
-        stbi__get32be(s);
+        // end of PNG chunk, read and check or skip CRC
+        if (verify) {
+            if (!stbi__png_crc_end(s)) return 0;
+        }
+        else
+            stbi__get32be(s);
     }
 }
 
+static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
+{
+    int r;
+    z->s->crc_simd = 0;
+#ifdef STBI__PCLMUL
+    z->s->crc_simd = stbi__pclmul_available();
+#endif
+    r = stbi__parse_png_chunks(z, scan, req_comp);
+    z->s->crc_from = NULL; // in case it stopped partway through a chunk
+    return r;
+}
+
 static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, stbi__result_info *ri)
 {
     void *result = NULL;
     if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
     if (stbi__parse_png_file(p, STBI__SCAN_load, req_comp)) {
-        if (p->depth < 8)
-            ri->bits_per_channel = 8;
-        else
-            ri->bits_per_channel = p->depth;
-        result = p->out;
-        p->out = NULL;
-        if (req_comp && req_comp != p->s->img_out_n) {
-            if (ri->bits_per_channel == 8)
-                result = stbi__convert_format((unsigned char *)result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
+        if (p->s->rows) {
+            // every row has been sent already
+            result = (void *)p->s->rows;
+        }
+        else {
+            if (p->depth < 8)
+                ri->bits_per_channel = 8;
             else
-                result = stbi__convert_format16((stbi__uint16 *)result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
-            p->s->img_out_n = req_comp;
-            if (result == NULL) return result;
+                ri->bits_per_channel = p->depth;
+            result = p->out;
+            p->out = NULL;
+            if (req_comp && req_comp != p->s->img_out_n) {
+                if (ri->bits_per_channel == 8)
+                    result = stbi__convert_format((unsigned char *)result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
+                else
+                    result = stbi__convert_format16((stbi__uint16 *)result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
+                p->s->img_out_n = req_comp;
+                if (result == NULL) return result;
+            }
+            *x = p->s->img_x;
+            *y = p->s->img_y;
+            if (n) *n = p->s->img_n;
+            ri->num_channels = p->s->img_out_n;
         }
-        *x = p->s->img_x;
-        *y = p->s->img_y;
-        if (n) *n = p->s->img_n;
     }
-    STBI_FREE(p->out);      p->out = NULL;
-    STBI_FREE(p->expanded); p->expanded = NULL;
-    STBI_FREE(p->idata);    p->idata = NULL;
+    if (!p->out_stride) stbi__free(p->out);
+    p->out = NULL;
+    stbi__free(p->expanded); p->expanded = NULL;
+    stbi__free(p->idata);    p->idata = NULL;
 
     return result;
 }
@@ -5025,6 +9164,78 @@ typedef struct
     unsigned int mr, mg, mb, ma, all_a;
 } stbi__bmp_data;
 
+// how one bitfield of a 16 or 32-bit pixel becomes a channel. stbi__shiftsigned
+// only ever keeps the top 8 bits of a mask, so for masks without gaps the
+// result is looked up from those bits instead
+typedef struct
+{
+    int rshift, count;          // for stbi__shiftsigned
+    int shift;                  // the lookup index is (v >> shift) & bits
+    unsigned int bits;
+    int lut[256];
+} stbi__bmp_channel;
+
+// returns 0 if the mask has gaps, and so can't use the table
+static int stbi__bmp_channel_setup(stbi__bmp_channel *c, unsigned int mask)
+{
+    int i, high = stbi__high_bit(mask);
+    unsigned int m;
+    c->rshift = high - 7;
+    c->count = stbi__bitcount(mask);
+    c->shift = c->count > 8 ? high - 7 : high + 1 - c->count;
+    c->bits = (1u << (c->count > 8 ? 8 : c->count)) - 1;
+    if (mask == 0) return 1; // no alpha; never looked up
+    m = mask >> (high + 1 - c->count);
+    if (m & (m + 1)) return 0;
+    for (i = 0; i <= (int)c->bits; ++i)
+        c->lut[i] = stbi__shiftsigned((unsigned int)i << c->shift, c->rshift, c->count);
+    return 1;
+}
+
+#ifdef STBI_SSE2
+// can stbi__bmp_field_sse2 do this channel of a 16-bit pixel?
+static int stbi__bmp_channel_sse2(stbi__bmp_channel const *c)
+{
+    return c->count <= 8 && c->shift >= 0 && c->shift + c->count <= 16;
+}
+
+// one bitfield of 8 16-bit pixels, with stbi__shiftsigned's bit replication
+static __m128i stbi__bmp_field_sse2(__m128i v, stbi__bmp_channel const *c)
+{
+    __m128i x = _mm_and_si128(_mm_srl_epi16(v, _mm_cvtsi32_si128(c->shift)), _mm_set1_epi16((short)c->bits));
+    __m128i r;
+    int z;
+    x = _mm_sll_epi16(x, _mm_cvtsi32_si128(8 - c->count));
+    r = x;
+    for (z = c->count; z < 8; z += c->count)
+        r = _mm_add_epi16(r, _mm_srl_epi16(x, _mm_cvtsi32_si128(z)));
+    return r;
+}
+
+// 16-bit pixels to RGBA, 8 at a time. returns how many it did, and leaves
+// *all_a nonzero if any had alpha
+static int stbi__bmp_unpack16_sse2(stbi_uc *dest, stbi_uc const *src, stbi__bmp_channel const *ch, int has_alpha, int n, unsigned int *all_a)
+{
+    __m128i a = _mm_set1_epi16(255), seen = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((__m128i const *) (src + i * 2));
+        __m128i rg = _mm_or_si128(stbi__bmp_field_sse2(v, &ch[0]), _mm_slli_epi16(stbi__bmp_field_sse2(v, &ch[1]), 8));
+        __m128i ba;
+        if (has_alpha) {
+            a = stbi__bmp_field_sse2(v, &ch[3]);
+            seen = _mm_or_si128(seen, a);
+        }
+        ba = _mm_or_si128(stbi__bmp_field_sse2(v, &ch[2]), _mm_slli_epi16(a, 8));
+        _mm_storeu_si128((__m128i *) (dest + i * 4), _mm_unpacklo_epi16(rg, ba));
+        _mm_storeu_si128((__m128i *) (dest + i * 4 + 16), _mm_unpackhi_epi16(rg, ba));
+    }
+    if (!has_alpha || _mm_movemask_epi8(_mm_cmpeq_epi8(seen, _mm_setzero_si128())) != 0xffff)
+        *all_a |= 255;
+    return i;
+}
+#endif
+
 static void *stbi__bmp_parse_header(stbi__context *s, stbi__bmp_data *info)
 {
     int hsz;
@@ -5115,14 +9326,38 @@ static void *stbi__bmp_parse_header(stbi__context *s, stbi__bmp_data *info)
 }
 
 
+// stbi_load_rows*: BMPs are decoded a band of rows at a time. a bottom-up
+// file fills each band from the bottom, so the band still reads top-down
+static int stbi__bmp_band_row(stbi__context *s, int j, int band, int bottom_up, int target)
+{
+    return (bottom_up ? band - 1 - j % band : j % band) * s->img_x * target;
+}
+
+// where file row j goes in a whole image; bottom-up files are stored flipped
+static int stbi__bmp_row(stbi__context *s, int j, int bottom_up, int target)
+{
+    return (bottom_up ? (int)s->img_y - 1 - j : j) * s->img_x * target;
+}
+
+// send the band once file row j has completed it
+static int stbi__bmp_send_band(stbi__context *s, stbi_uc *out, int j, int band, int bottom_up, int target, int n)
+{
+    int count = j % band + 1;
+    if (count < band && j + 1 < (int)s->img_y) return 1;
+    if (bottom_up)
+        return stbi__rows_send(s, s->img_y - 1 - j, count, out + (band - count) * s->img_x * target, s->img_x * target, 0, target, n);
+    return stbi__rows_send(s, j + 1 - count, count, out, s->img_x * target, 0, target, n);
+}
+
 static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
 {
-    stbi_uc *out;
+    stbi_uc *out, *row;
     unsigned int mr = 0, mg = 0, mb = 0, ma = 0, all_a;
     stbi_uc pal[256][4];
-    int psize = 0, i, j, width;
-    int flip_vertically, pad, target;
+    int psize = 0, i, j, z, width;
+    int flip_vertically, pad, target, band = 0, n;
     stbi__bmp_data info;
+    stbi__pixel_kernels k;
     STBI_NOTUSED(ri);
 
     info.all_a = 255;
@@ -5157,11 +9392,27 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
     if (!stbi__mad3sizes_valid(target, s->img_x, s->img_y, 0))
         return stbi__errpuc("too large", "Corrupt BMP");
 
-    out = (stbi_uc *)stbi__malloc_mad3(target, s->img_x, s->img_y, 0);
+    // stbi_load_rows* gets a band at a time, unless an alpha channel might
+    // turn out to be all 0s (see below) and so has to be seen in full first
+    n = req_comp ? req_comp : target;
+    if (s->rows && !(target == 4 && all_a == 0)) {
+        if (!stbi__rows_begin(s, s->img_x, s->img_y, s->img_n, n)) return NULL;
+        band = 1;
+        if (s->img_x && s->img_x * target < STBI_ROWS_BAND_BYTES) band = STBI_ROWS_BAND_BYTES / (s->img_x * target);
+        if (band > (int)s->img_y && s->img_y) band = s->img_y;
+    }
+
+    out = (stbi_uc *)stbi__malloc_mad3(target, s->img_x, band ? band : (int)s->img_y, 0);
     if (!out) return stbi__errpuc("outofmem", "Out of memory");
+    // a file row, with its padding, for when it isn't all in the buffer; the
+    // second half holds 4-bit indices unpacked, or 16-bit pixels as RGBA
+    row = (stbi_uc *)stbi__malloc_mad2(s->img_x, 8, 4);
+    if (!row) { stbi__free(out); return stbi__errpuc("outofmem", "Out of memory"); }
+    stbi__setup_pixel_kernels(&k);
     if (info.bpp < 16) {
-        int z = 0;
-        if (psize == 0 || psize > 256) { STBI_FREE(out); return stbi__errpuc("invalid", "Corrupt BMP"); }
+        stbi_uc *index = row + s->img_x * 4 + 4;
+        if (psize == 0 || psize > 256) { stbi__free(row); stbi__free(out); return stbi__errpuc("invalid", "Corrupt BMP"); }
+        memset(pal, 0, sizeof(pal));
         for (i = 0; i < psize; ++i) {
             pal[i][2] = stbi__get8(s);
             pal[i][1] = stbi__get8(s);
@@ -5172,33 +9423,33 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
         stbi__skip(s, info.offset - 14 - info.hsz - psize * (info.hsz == 12 ? 3 : 4));
         if (info.bpp == 4) width = (s->img_x + 1) >> 1;
         else if (info.bpp == 8) width = s->img_x;
-        else { STBI_FREE(out); return stbi__errpuc("bad bpp", "Corrupt BMP"); }
+        else { stbi__free(row); stbi__free(out); return stbi__errpuc("bad bpp", "Corrupt BMP"); }
         pad = (-width) & 3;
         for (j = 0; j < (int)s->img_y; ++j) {
-            for (i = 0; i < (int)s->img_x; i += 2) {
-                int v = stbi__get8(s), v2 = 0;
-                if (info.bpp == 4) {
-                    v2 = v & 15;
-                    v >>= 4;
+            stbi_uc const *p = stbi__get_span(s, row, width + pad);
+            z = band ? stbi__bmp_band_row(s, j, band, flip_vertically, target) : stbi__bmp_row(s, j, flip_vertically, target);
+            if (info.bpp == 4) {
+                for (i = 0; i + 1 < (int)s->img_x; i += 2) {
+                    index[i] = p[i >> 1] >> 4;
+                    index[i + 1] = p[i >> 1] & 15;
                 }
-                out[z++] = pal[v][0];
-                out[z++] = pal[v][1];
-                out[z++] = pal[v][2];
-                if (target == 4) out[z++] = 255;
-                if (i + 1 == (int)s->img_x) break;
-                v = (info.bpp == 8) ? stbi__get8(s) : v2;
-                out[z++] = pal[v][0];
-                out[z++] = pal[v][1];
-                out[z++] = pal[v][2];
-                if (target == 4) out[z++] = 255;
+                if (i < (int)s->img_x)
+                    index[i] = p[i >> 1] >> 4;
+                p = index;
             }
-            stbi__skip(s, pad);
+            if (target == 4)
+                k.palette4(out + z, p, pal[0], s->img_x);
+            else
+                k.palette3(out + z, p, pal[0], s->img_x);
+            if (band && !stbi__bmp_send_band(s, out, j, band, flip_vertically, target, n)) { stbi__free(row); stbi__free(out); return NULL; }
         }
     }
     else {
-        int rshift = 0, gshift = 0, bshift = 0, ashift = 0, rcount = 0, gcount = 0, bcount = 0, acount = 0;
-        int z = 0;
-        int easy = 0;
+        stbi__bmp_channel ch[4];
+        int easy = 0, lut = 0, bytes = info.bpp == 16 ? 2 : info.bpp == 24 ? 3 : 4;
+#ifdef STBI_SSE2
+        int simd = 0;
+#endif
         stbi__skip(s, info.offset - 14 - info.hsz);
         if (info.bpp == 24) width = 3 * s->img_x;
         else if (info.bpp == 16) width = 2 * s->img_x;
@@ -5212,59 +9463,86 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
                 easy = 2;
         }
         if (!easy) {
-            if (!mr || !mg || !mb) { STBI_FREE(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
-            // right shift amt to put high bit in position #7
-            rshift = stbi__high_bit(mr) - 7; rcount = stbi__bitcount(mr);
-            gshift = stbi__high_bit(mg) - 7; gcount = stbi__bitcount(mg);
-            bshift = stbi__high_bit(mb) - 7; bcount = stbi__bitcount(mb);
-            ashift = stbi__high_bit(ma) - 7; acount = stbi__bitcount(ma);
+            if (!mr || !mg || !mb) { stbi__free(row); stbi__free(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
+            lut = stbi__bmp_channel_setup(&ch[0], mr) & stbi__bmp_channel_setup(&ch[1], mg) &
+                  stbi__bmp_channel_setup(&ch[2], mb) & stbi__bmp_channel_setup(&ch[3], ma);
+#ifdef STBI_SSE2
+            simd = lut && bytes == 2 && stbi__bmp_channel_sse2(&ch[0]) && stbi__bmp_channel_sse2(&ch[1]) &&
+                   stbi__bmp_channel_sse2(&ch[2]) && (!ma || stbi__bmp_channel_sse2(&ch[3])) && stbi__sse2_available();
+#endif
         }
         for (j = 0; j < (int)s->img_y; ++j) {
-            if (easy) {
-                for (i = 0; i < (int)s->img_x; ++i) {
-                    unsigned char a;
-                    out[z + 2] = stbi__get8(s);
-                    out[z + 1] = stbi__get8(s);
-                    out[z + 0] = stbi__get8(s);
-                    z += 3;
-                    a = (easy == 2 ? stbi__get8(s) : 255);
-                    all_a |= a;
-                    if (target == 4) out[z++] = a;
+            stbi_uc const *p = stbi__get_span(s, row, s->img_x * bytes + pad);
+            stbi_uc *o;
+            z = band ? stbi__bmp_band_row(s, j, band, flip_vertically, target) : stbi__bmp_row(s, j, flip_vertically, target);
+            o = out + z;
+            if (easy == 1) {
+                if (target == 4) {
+                    k.rgb_to_rgba(o, p, s->img_x);
+                    k.swap_rb4(o, o, s->img_x);
+                }
+                else
+                    k.swap_rb3(o, p, s->img_x);
+            }
+            else if (easy == 2) {
+                if (target == 4) {
+                    k.swap_rb4(o, p, s->img_x);
+                    for (i = 0; i < (int)s->img_x && !all_a; ++i)
+                        all_a |= p[i * 4 + 3];
+                }
+                else {
+                    k.rgba_to_rgb(o, p, s->img_x);
+                    k.swap_rb3(o, o, s->img_x);
                 }
             }
             else {
-                int bpp = info.bpp;
-                for (i = 0; i < (int)s->img_x; ++i) {
-                    stbi__uint32 v = (bpp == 16 ? (stbi__uint32)stbi__get16le(s) : stbi__get32le(s));
+                i = 0;
+#ifdef STBI_SSE2
+                if (simd) {
+                    stbi_uc *rgba = target == 4 ? o : row + s->img_x * 4 + 4;
+                    i = stbi__bmp_unpack16_sse2(rgba, p, ch, ma != 0, s->img_x, &all_a);
+                    if (target == 3) k.rgba_to_rgb(o, rgba, i);
+                    p += i * 2;
+                    o += i * target;
+                }
+#endif
+                for (; i < (int)s->img_x; ++i, p += bytes) {
+                    stbi__uint32 v = p[0] | (p[1] << 8);
                     int a;
-                    out[z++] = STBI__BYTECAST(stbi__shiftsigned(v & mr, rshift, rcount));
-                    out[z++] = STBI__BYTECAST(stbi__shiftsigned(v & mg, gshift, gcount));
-                    out[z++] = STBI__BYTECAST(stbi__shiftsigned(v & mb, bshift, bcount));
-                    a = (ma ? stbi__shiftsigned(v & ma, ashift, acount) : 255);
+                    if (bytes == 4) v |= (p[2] << 16) | ((stbi__uint32)p[3] << 24);
+                    if (lut) {
+                        o[0] = STBI__BYTECAST(ch[0].lut[(v >> ch[0].shift) & ch[0].bits]);
+                        o[1] = STBI__BYTECAST(ch[1].lut[(v >> ch[1].shift) & ch[1].bits]);
+                        o[2] = STBI__BYTECAST(ch[2].lut[(v >> ch[2].shift) & ch[2].bits]);
+                        a = (ma ? ch[3].lut[(v >> ch[3].shift) & ch[3].bits] : 255);
+                    }
+                    else {
+                        o[0] = STBI__BYTECAST(stbi__shiftsigned(v & mr, ch[0].rshift, ch[0].count));
+                        o[1] = STBI__BYTECAST(stbi__shiftsigned(v & mg, ch[1].rshift, ch[1].count));
+                        o[2] = STBI__BYTECAST(stbi__shiftsigned(v & mb, ch[2].rshift, ch[2].count));
+                        a = (ma ? stbi__shiftsigned(v & ma, ch[3].rshift, ch[3].count) : 255);
+                    }
                     all_a |= a;
-                    if (target == 4) out[z++] = STBI__BYTECAST(a);
+                    if (target == 4) o[3] = STBI__BYTECAST(a);
+                    o += target;
                 }
             }
-            stbi__skip(s, pad);
+            if (band && !stbi__bmp_send_band(s, out, j, band, flip_vertically, target, n)) { stbi__free(row); stbi__free(out); return NULL; }
         }
     }
+    stbi__free(row);
+
+    if (band) {
+        // every row has been sent already
+        stbi__free(out);
+        return (void *)s->rows;
+    }
 
     // if alpha channel is all 0s, replace with all 255s
     if (target == 4 && all_a == 0)
         for (i = 4 * s->img_x*s->img_y - 1; i >= 0; i -= 4)
             out[i] = 255;
 
-    if (flip_vertically) {
-        stbi_uc t;
-        for (j = 0; j < (int)s->img_y >> 1; ++j) {
-            stbi_uc *p1 = out + j     *s->img_x*target;
-            stbi_uc *p2 = out + (s->img_y - 1 - j)*s->img_x*target;
-            for (i = 0; i < (int)s->img_x*target; ++i) {
-                t = p1[i], p1[i] = p2[i], p2[i] = t;
-            }
-        }
-    }
-
     if (req_comp && req_comp != target) {
         out = stbi__convert_format(out, target, req_comp, s->img_x, s->img_y);
         if (out == NULL) return out; // stbi__convert_format frees input on failure
@@ -5396,11 +9674,10 @@ errorEnd:
     return res;
 }
 
-// read 16bit value and convert to 24bit RGB
-static void stbi__tga_read_rgb16(stbi__context *s, stbi_uc* out)
+// convert a 16bit value to 24bit RGB
+static void stbi__tga_rgb16(int px, stbi_uc* out)
 {
-    stbi__uint16 px = (stbi__uint16)stbi__get16le(s);
-    stbi__uint16 fiveBitMask = 31;
+    int fiveBitMask = 31;
     // we have 3 channels with 5bits each
     int r = (px >> 10) & fiveBitMask;
     int g = (px >> 5) & fiveBitMask;
@@ -5416,6 +9693,50 @@ static void stbi__tga_read_rgb16(stbi__context *s, stbi_uc* out)
     // so let's treat all 15 and 16bit TGAs as RGB with no alpha.
 }
 
+// turns runs of TGA pixels, as stored, into tga_comp bytes each
+typedef struct
+{
+    int comp;                   // bytes per pixel out
+    int indexed, rgb16;
+    int index_bytes;            // 1 or 2, for indexed images
+    stbi_uc *palette;           // palette_len entries of comp bytes
+    int palette_len;
+    stbi_uc pal4[256][4];       // the first 256 entries, 4 bytes apart for the palette kernels
+    stbi_uc *scratch;           // room for a row as stored
+    stbi__pixel_kernels k;
+} stbi__tga_reader;
+
+static void stbi__tga_read_pixels(stbi__context *s, stbi__tga_reader *r, stbi_uc *out, int n)
+{
+    int i, j;
+    if (r->indexed) {
+        stbi_uc const *p = stbi__get_span(s, r->scratch, n * r->index_bytes);
+        if (r->index_bytes == 1 && r->comp == 4)
+            r->k.palette4(out, p, r->pal4[0], n);
+        else if (r->index_bytes == 1 && r->comp == 3)
+            r->k.palette3(out, p, r->pal4[0], n);
+        else
+            for (i = 0; i < n; ++i, out += r->comp) {
+                int pal_idx = r->index_bytes == 1 ? p[i] : p[i * 2] | (p[i * 2 + 1] << 8);
+                if (pal_idx >= r->palette_len) {
+                    // invalid index
+                    pal_idx = 0;
+                }
+                for (j = 0; j < r->comp; ++j)
+                    out[j] = r->palette[pal_idx * r->comp + j];
+            }
+    }
+    else if (r->rgb16) {
+        stbi_uc const *p = stbi__get_span(s, r->scratch, n * 2);
+        for (i = 0; i < n; ++i, out += 3)
+            stbi__tga_rgb16(p[i * 2] | (p[i * 2 + 1] << 8), out);
+    }
+    else {
+        stbi_uc const *p = stbi__get_span(s, out, n * r->comp);
+        if (p != out) memcpy(out, p, (size_t)n * r->comp);
+    }
+}
+
 static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
 {
     //   read in the TGA header stuff
@@ -5438,10 +9759,7 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
     unsigned char *tga_data;
     unsigned char *tga_palette = NULL;
     int i, j;
-    unsigned char raw_data[4] = { 0 };
-    int RLE_count = 0;
-    int RLE_repeating = 0;
-    int read_next_pixel = 1;
+    stbi__tga_reader r;
     STBI_NOTUSED(ri);
 
     //   do a tiny bit of precessing
@@ -5473,135 +9791,105 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
     // skip to the data's starting position (offset usually = 0)
     stbi__skip(s, tga_offset);
 
-    if (!tga_indexed && !tga_is_RLE && !tga_rgb16) {
-        for (i = 0; i < tga_height; ++i) {
-            int row = tga_inverted ? tga_height - i - 1 : i;
-            stbi_uc *tga_row = tga_data + row*tga_width*tga_comp;
-            stbi__getn(s, tga_row, tga_width * tga_comp);
-        }
-    }
-    else {
-        //   do I need to load a palette?
-        if (tga_indexed)
-        {
-            //   any data to skip? (offset usually = 0)
-            stbi__skip(s, tga_palette_start);
-            //   load the palette
-            tga_palette = (unsigned char*)stbi__malloc_mad2(tga_palette_len, tga_comp, 0);
-            if (!tga_palette) {
-                STBI_FREE(tga_data);
-                return stbi__errpuc("outofmem", "Out of memory");
-            }
-            if (tga_rgb16) {
-                stbi_uc *pal_entry = tga_palette;
-                STBI_ASSERT(tga_comp == STBI_rgb);
-                for (i = 0; i < tga_palette_len; ++i) {
-                    stbi__tga_read_rgb16(s, pal_entry);
-                    pal_entry += tga_comp;
-                }
-            }
-            else if (!stbi__getn(s, tga_palette, tga_palette_len * tga_comp)) {
-                STBI_FREE(tga_data);
-                STBI_FREE(tga_palette);
-                return stbi__errpuc("bad palette", "Corrupt TGA");
-            }
+    memset(&r, 0, sizeof(r));
+    r.comp = tga_comp;
+    r.indexed = tga_indexed;
+    r.rgb16 = tga_rgb16 && !tga_indexed;
+    r.index_bytes = tga_bits_per_pixel == 8 ? 1 : 2;
+    stbi__setup_pixel_kernels(&r.k);
+
+    //   do I need to load a palette?
+    if (tga_indexed)
+    {
+        //   any data to skip? (offset usually = 0)
+        stbi__skip(s, tga_palette_start);
+        //   load the palette; a missing one reads as a single black entry
+        tga_palette = (unsigned char*)stbi__malloc_mad2(tga_palette_len ? tga_palette_len : 1, tga_comp, 0);
+        if (!tga_palette) {
+            stbi__free(tga_data);
+            return stbi__errpuc("outofmem", "Out of memory");
         }
-        //   load the data
-        for (i = 0; i < tga_width * tga_height; ++i)
-        {
-            //   if I'm in RLE mode, do I need to get a RLE stbi__pngchunk?
-            if (tga_is_RLE)
-            {
-                if (RLE_count == 0)
-                {
-                    //   yep, get the next byte as a RLE command
-                    int RLE_cmd = stbi__get8(s);
-                    RLE_count = 1 + (RLE_cmd & 127);
-                    RLE_repeating = RLE_cmd >> 7;
-                    read_next_pixel = 1;
-                }
-                else if (!RLE_repeating)
-                {
-                    read_next_pixel = 1;
-                }
-            }
-            else
-            {
-                read_next_pixel = 1;
+        memset(tga_palette, 0, tga_comp);
+        if (tga_rgb16) {
+            stbi_uc *pal_entry = tga_palette;
+            STBI_ASSERT(tga_comp == STBI_rgb);
+            for (i = 0; i < tga_palette_len; ++i) {
+                stbi__tga_rgb16(stbi__get16le(s), pal_entry);
+                pal_entry += tga_comp;
             }
-            //   OK, if I need to read a pixel, do it now
-            if (read_next_pixel)
-            {
-                //   load however much data we did have
-                if (tga_indexed)
-                {
-                    // read in index, then perform the lookup
-                    int pal_idx = (tga_bits_per_pixel == 8) ? stbi__get8(s) : stbi__get16le(s);
-                    if (pal_idx >= tga_palette_len) {
-                        // invalid index
-                        pal_idx = 0;
-                    }
-                    pal_idx *= tga_comp;
-                    for (j = 0; j < tga_comp; ++j) {
-                        raw_data[j] = tga_palette[pal_idx + j];
-                    }
-                }
-                else if (tga_rgb16) {
-                    STBI_ASSERT(tga_comp == STBI_rgb);
-                    stbi__tga_read_rgb16(s, raw_data);
-                }
-                else {
-                    //   read in the data raw
-                    for (j = 0; j < tga_comp; ++j) {
-                        raw_data[j] = stbi__get8(s);
-                    }
-                }
-                //   clear the reading flag for the next pixel
-                read_next_pixel = 0;
-            } // end of reading a pixel
-
-              // copy data
+        }
+        else if (!stbi__getn(s, tga_palette, tga_palette_len * tga_comp)) {
+            stbi__free(tga_data);
+            stbi__free(tga_palette);
+            return stbi__errpuc("bad palette", "Corrupt TGA");
+        }
+        r.palette = tga_palette;
+        r.palette_len = tga_palette_len;
+        for (i = 0; i < 256; ++i)
             for (j = 0; j < tga_comp; ++j)
-                tga_data[i*tga_comp + j] = raw_data[j];
+                r.pal4[i][j] = tga_palette[(i < tga_palette_len ? i : 0) * tga_comp + j];
+    }
 
-            //   in case we're in RLE mode, keep counting down
-            --RLE_count;
-        }
-        //   do I need to invert the image?
-        if (tga_inverted)
-        {
-            for (j = 0; j * 2 < tga_height; ++j)
-            {
-                int index1 = j * tga_width * tga_comp;
-                int index2 = (tga_height - 1 - j) * tga_width * tga_comp;
-                for (i = tga_width * tga_comp; i > 0; --i)
+    r.scratch = (stbi_uc *)stbi__malloc_mad2(tga_width, 4, 0);
+    if (!r.scratch) {
+        stbi__free(tga_data);
+        stbi__free(tga_palette);
+        return stbi__errpuc("outofmem", "Out of memory");
+    }
+
+    //   load the data a row at a time, straight into place. a run can go
+    //   on into the next row, so it's picked up again there
+    {
+        unsigned char raw_data[4] = { 0 };
+        int RLE_count = 0;
+        int RLE_repeating = 0;
+        for (i = 0; i < tga_height; ++i) {
+            int row = tga_inverted ? tga_height - i - 1 : i;
+            stbi_uc *tga_row = tga_data + row * tga_width * tga_comp;
+            int x = 0;
+            if (!tga_is_RLE) {
+                stbi__tga_read_pixels(s, &r, tga_row, tga_width);
+                continue;
+            }
+            while (x < tga_width) {
+                int count;
+                if (RLE_count == 0)
                 {
-                    unsigned char temp = tga_data[index1];
-                    tga_data[index1] = tga_data[index2];
-                    tga_data[index2] = temp;
-                    ++index1;
-                    ++index2;
+                    //   get the next byte as a RLE command
+                    int RLE_cmd = stbi__get8(s);
+                    RLE_count = 1 + (RLE_cmd & 127);
+                    RLE_repeating = RLE_cmd >> 7;
+                    if (RLE_repeating)
+                        stbi__tga_read_pixels(s, &r, raw_data, 1);
+                }
+                count = RLE_count < tga_width - x ? RLE_count : tga_width - x;
+                if (RLE_repeating) {
+                    for (j = 0; j < count; ++j)
+                        memcpy(tga_row + (x + j) * tga_comp, raw_data, tga_comp);
                 }
+                else
+                    stbi__tga_read_pixels(s, &r, tga_row + x * tga_comp, count);
+                x += count;
+                RLE_count -= count;
             }
         }
-        //   clear my palette, if I had one
-        if (tga_palette != NULL)
-        {
-            STBI_FREE(tga_palette);
-        }
+    }
+    stbi__free(r.scratch);
+    //   clear my palette, if I had one
+    if (tga_palette != NULL)
+    {
+        stbi__free(tga_palette);
     }
 
     // swap RGB - if the source data was RGB16, it already is in the right order
     if (tga_comp >= 3 && !tga_rgb16)
     {
-        unsigned char* tga_pixel = tga_data;
-        for (i = 0; i < tga_width * tga_height; ++i)
-        {
-            unsigned char temp = tga_pixel[0];
-            tga_pixel[0] = tga_pixel[2];
-            tga_pixel[2] = temp;
-            tga_pixel += tga_comp;
-        }
+        stbi__pixel_kernels k;
+        stbi__setup_pixel_kernels(&k);
+        if (tga_comp == 3)
+            k.swap_rb3(tga_data, tga_data, tga_width * tga_height);
+        else
+            k.swap_rb4(tga_data, tga_data, tga_width * tga_height);
     }
 
     // convert to target component count
@@ -5779,7 +10067,7 @@ static void *stbi__psd_load(stbi__context *s, int *x, int *y, int *comp, int req
             else {
                 // Read the RLE data.
                 if (!stbi__psd_decode_rle(s, p, pixelCount)) {
-                    STBI_FREE(out);
+                    stbi__free(out);
                     return stbi__errpuc("corrupt", "bad RLE data");
                 }
             }
@@ -6071,7 +10359,7 @@ static void *stbi__pic_load(stbi__context *s, int *px, int *py, int *comp, int r
     memset(result, 0xff, x*y * 4);
 
     if (!stbi__pic_load_core(s, x, y, comp, result)) {
-        STBI_FREE(result);
+        stbi__free(result);
         result = 0;
     }
     *px = x;
@@ -6094,9 +10382,12 @@ static int stbi__pic_test(stbi__context *s)
 // GIF loader -- public domain by Jean-Marc Lienher -- simplified/shrunk by stb
 
 #ifndef STBI_NO_GIF
+// a code's string is found where it was last written out: 'length' indices
+// starting at 'offset' in the frame's index buffer
 typedef struct
 {
-    stbi__int16 prefix;
+    stbi__int32 offset;
+    stbi__uint16 length;
     stbi_uc first;
     stbi_uc suffix;
 } stbi__gif_lzw;
@@ -6104,7 +10395,12 @@ typedef struct
 typedef struct
 {
     int w, h;
-    stbi_uc *out, *old_out;             // output buffer (always 4 components)
+    stbi_uc *out;                       // the canvas (always 4 components)
+    stbi_uc *prev;                      // what the last frame covered, if it's to be restored
+    stbi_uc *idx;                       // the frame's palette indices, in the order they're coded
+    int frames;                         // frames drawn on the canvas so far
+    int dispose;                        // disposal method of the last frame
+    int dirty_x0, dirty_y0, dirty_x1, dirty_y1; // pixels the last frame changed
     int flags, bgindex, ratio, transparent, eflags, delay;
     stbi_uc  pal[256][4];
     stbi_uc lpal[256][4];
@@ -6144,6 +10440,10 @@ static void stbi__gif_parse_colortable(stbi__context *s, stbi_uc pal[256][4], in
         pal[i][0] = stbi__get8(s);
         pal[i][3] = transp == i ? 0 : 255;
     }
+    // encoders may mark an index past the table transparent; don't let a
+    // stale entry from an earlier frame's bigger table show through
+    if (transp >= num_entries)
+        pal[transp][3] = 0;
 }
 
 static int stbi__gif_header(stbi__context *s, stbi__gif *g, int *comp, int is_info)
@@ -6178,60 +10478,84 @@ static int stbi__gif_info_raw(stbi__context *s, int *x, int *y, int *comp)
 {
     stbi__gif* g = (stbi__gif*)stbi__malloc(sizeof(stbi__gif));
     if (!stbi__gif_header(s, g, comp, 1)) {
-        STBI_FREE(g);
+        stbi__free(g);
         stbi__rewind(s);
         return 0;
     }
     if (x) *x = g->w;
     if (y) *y = g->h;
-    STBI_FREE(g);
+    stbi__free(g);
     return 1;
 }
 
-static void stbi__out_gif_code(stbi__gif *g, stbi__uint16 code)
+// write the frame's first n indices to the canvas as RGBA, a row at a time,
+// following the interlacing; transparent pixels leave the canvas alone
+static void stbi__gif_out_indices(stbi__gif *g, int n)
 {
-    stbi_uc *p, *c;
-
-    // recurse to decode the prefixes, since the linked-list is backwards,
-    // and working backwards through an interleaved image would be nasty
-    if (g->codes[code].prefix >= 0)
-        stbi__out_gif_code(g, g->codes[code].prefix);
-
-    if (g->cur_y >= g->max_y) return;
+    stbi_uc rgba[256][4];
+    stbi_uc const *idx = g->idx;
+    int i, transparent = 0;
 
-    p = &g->out[g->cur_x + g->cur_y];
-    c = &g->color_table[g->codes[code].suffix * 4];
-
-    if (c[3] >= 128) {
-        p[0] = c[2];
-        p[1] = c[1];
-        p[2] = c[0];
-        p[3] = c[3];
+    for (i = 0; i < 256; ++i) {
+        stbi_uc *c = &g->color_table[i * 4];
+        rgba[i][0] = c[2];
+        rgba[i][1] = c[1];
+        rgba[i][2] = c[0];
+        rgba[i][3] = c[3];
+        transparent |= c[3] < 128;
     }
-    g->cur_x += 4;
 
-    if (g->cur_x >= g->max_x) {
-        g->cur_x = g->start_x;
-        g->cur_y += g->step;
+    while (n > 0 && g->cur_y < g->max_y) {
+        stbi_uc *p = &g->out[g->cur_x + g->cur_y];
+        int count = (g->max_x - g->cur_x) >> 2;
+        if (count > n) count = n;
+        if (transparent) {
+            for (i = 0; i < count; ++i)
+                if (rgba[idx[i]][3] >= 128)
+                    memcpy(p + i * 4, rgba[idx[i]], 4);
+        }
+        else
+            for (i = 0; i < count; ++i)
+                memcpy(p + i * 4, rgba[idx[i]], 4);
+        idx += count;
+        n -= count;
+        g->cur_x += count * 4;
+
+        if (g->cur_x >= g->max_x) {
+            g->cur_x = g->start_x;
+            g->cur_y += g->step;
 
-        while (g->cur_y >= g->max_y && g->parse > 0) {
-            g->step = (1 << g->parse) * g->line_size;
-            g->cur_y = g->start_y + (g->step >> 1);
-            --g->parse;
+            while (g->cur_y >= g->max_y && g->parse > 0) {
+                g->step = (1 << g->parse) * g->line_size;
+                g->cur_y = g->start_y + (g->step >> 1);
+                --g->parse;
+            }
         }
     }
 }
 
-static stbi_uc *stbi__process_gif_raster(stbi__context *s, stbi__gif *g)
+// decode the LZW stream into g->idx. Each new code's string is the previous
+// code's string plus one byte, and that's exactly what follows where the
+// previous code was written, so a code is emitted with one copy from its
+// last occurrence instead of by walking its prefixes. Indices past the end
+// of the frame are decoded but dropped. Returns 0 on error; *count gets
+// the number of indices written either way
+static int stbi__gif_lzw_decode(stbi__context *s, stbi__gif *g, int *count)
 {
     stbi_uc lzw_cs;
     stbi__int32 len, init_code;
     stbi__uint32 first;
     stbi__int32 codesize, codemask, avail, oldcode, bits, valid_bits, clear;
+    stbi__int32 pos, last, cap;
+    stbi_uc *idx = g->idx;
+    stbi_uc block[255];
+    stbi_uc const *in = block, *in_end = block;
     stbi__gif_lzw *p;
 
+    *count = 0;
+    cap = ((g->max_x - g->start_x) >> 2) * ((g->max_y - g->start_y) / g->line_size);
     lzw_cs = stbi__get8(s);
-    if (lzw_cs > 12) return NULL;
+    if (lzw_cs > 12) return 0;
     clear = 1 << lzw_cs;
     first = 1;
     codesize = lzw_cs + 1;
@@ -6239,7 +10563,8 @@ static stbi_uc *stbi__process_gif_raster(stbi__context *s, stbi__gif *g)
     bits = 0;
     valid_bits = 0;
     for (init_code = 0; init_code < clear; init_code++) {
-        g->codes[init_code].prefix = -1;
+        g->codes[init_code].offset = 0;
+        g->codes[init_code].length = 1;
         g->codes[init_code].first = (stbi_uc)init_code;
         g->codes[init_code].suffix = (stbi_uc)init_code;
     }
@@ -6247,116 +10572,175 @@ static stbi_uc *stbi__process_gif_raster(stbi__context *s, stbi__gif *g)
     // support no starting clear code
     avail = clear + 2;
     oldcode = -1;
+    pos = last = 0;
 
-    len = 0;
     for (;;) {
-        if (valid_bits < codesize) {
-            if (len == 0) {
+        stbi__int32 code;
+        while (valid_bits < codesize) {
+            if (in == in_end) {
                 len = stbi__get8(s); // start new block
                 if (len == 0)
-                    return g->out;
+                    return *count = pos, 1;
+                // take the whole sub-block, straight from the buffer if it's there
+                if (s->img_buffer_end - s->img_buffer >= len) {
+                    in = s->img_buffer;
+                    s->img_buffer += len;
+                }
+                else {
+                    for (init_code = 0; init_code < len; ++init_code)
+                        block[init_code] = stbi__get8(s);
+                    in = block;
+                }
+                in_end = in + len;
             }
-            --len;
-            bits |= (stbi__int32)stbi__get8(s) << valid_bits;
+            bits |= (stbi__int32)*in++ << valid_bits;
             valid_bits += 8;
         }
-        else {
-            stbi__int32 code = bits & codemask;
-            bits >>= codesize;
-            valid_bits -= codesize;
-            // @OPTIMIZE: is there some way we can accelerate the non-clear path?
-            if (code == clear) {  // clear code
-                codesize = lzw_cs + 1;
-                codemask = (1 << codesize) - 1;
-                avail = clear + 2;
-                oldcode = -1;
-                first = 0;
-            }
-            else if (code == clear + 1) { // end of stream code
+        code = bits & codemask;
+        bits >>= codesize;
+        valid_bits -= codesize;
+        if (code == clear) {  // clear code
+            codesize = lzw_cs + 1;
+            codemask = (1 << codesize) - 1;
+            avail = clear + 2;
+            oldcode = -1;
+            first = 0;
+        }
+        else if (code == clear + 1) { // end of stream code
+            while ((len = stbi__get8(s)) > 0)
                 stbi__skip(s, len);
-                while ((len = stbi__get8(s)) > 0)
-                    stbi__skip(s, len);
-                return g->out;
+            return *count = pos, 1;
+        }
+        else if (code <= avail) {
+            if (first) {
+                *count = pos;
+                return stbi__err("no clear code", "Corrupt GIF");
             }
-            else if (code <= avail) {
-                if (first) return stbi__errpuc("no clear code", "Corrupt GIF");
-
-                if (oldcode >= 0) {
-                    p = &g->codes[avail++];
-                    if (avail > 4096)        return stbi__errpuc("too many codes", "Corrupt GIF");
-                    p->prefix = (stbi__int16)oldcode;
-                    p->first = g->codes[oldcode].first;
-                    p->suffix = (code == avail) ? p->first : g->codes[code].first;
-                }
-                else if (code == avail)
-                    return stbi__errpuc("illegal code in raster", "Corrupt GIF");
 
-                stbi__out_gif_code(g, (stbi__uint16)code);
-
-                if ((avail & codemask) == 0 && avail <= 0x0FFF) {
-                    codesize++;
-                    codemask = (1 << codesize) - 1;
+            if (oldcode >= 0) {
+                p = &g->codes[avail++];
+                if (avail > 4096) {
+                    *count = pos;
+                    return stbi__err("too many codes", "Corrupt GIF");
                 }
+                p->offset = last;
+                p->length = (stbi__uint16)(g->codes[oldcode].length + 1);
+                p->first = g->codes[oldcode].first;
+                p->suffix = g->codes[code].first;
+            }
+            else if (code == avail) {
+                *count = pos;
+                return stbi__err("illegal code in raster", "Corrupt GIF");
+            }
 
-                oldcode = code;
+            // everything but the last byte comes before pos, even when the
+            // code is the one just added, so one forward copy does it
+            p = &g->codes[code];
+            if (pos < cap) {
+                stbi__int32 n = p->length;
+                if (n > cap - pos) n = cap - pos;
+                if (p->length > 1)
+                    memcpy(idx + pos, idx + p->offset, (size_t)(n < p->length ? n : n - 1));
+                if (n == p->length)
+                    idx[pos + n - 1] = p->suffix;
             }
-            else {
-                return stbi__errpuc("illegal code in raster", "Corrupt GIF");
+            last = pos;
+            pos += p->length;
+            if (pos > cap) pos = cap;
+
+            if ((avail & codemask) == 0 && avail <= 0x0FFF) {
+                codesize++;
+                codemask = (1 << codesize) - 1;
             }
+
+            oldcode = code;
+        }
+        else {
+            *count = pos;
+            return stbi__err("illegal code in raster", "Corrupt GIF");
         }
     }
 }
 
+static stbi_uc *stbi__process_gif_raster(stbi__context *s, stbi__gif *g)
+{
+    int count, ok;
+    if (g->idx == 0) {
+        g->idx = (stbi_uc *)stbi__malloc_mad2(g->w, g->h, 0);
+        if (g->idx == 0) return stbi__errpuc("outofmem", "Out of memory");
+    }
+    ok = stbi__gif_lzw_decode(s, g, &count);
+    stbi__gif_out_indices(g, count);
+    return ok ? g->out : NULL;
+}
+
 static void stbi__fill_gif_background(stbi__gif *g, int x0, int y0, int x1, int y1)
 {
     int x, y;
-    stbi_uc *c = g->pal[g->bgindex];
-    for (y = y0; y < y1; y += 4 * g->w) {
-        for (x = x0; x < x1; x += 4) {
-            stbi_uc *p = &g->out[y + x];
-            p[0] = c[2];
-            p[1] = c[1];
-            p[2] = c[0];
-            p[3] = 0;
-        }
+    stbi_uc *c = g->pal[g->bgindex], *row = &g->out[y0 + x0];
+    if (y0 >= y1 || x0 >= x1) return;
+    // fill one row, then copy it down
+    for (x = 0; x < x1 - x0; x += 4) {
+        row[x + 0] = c[2];
+        row[x + 1] = c[1];
+        row[x + 2] = c[0];
+        row[x + 3] = 0;
     }
+    for (y = y0 + 4 * g->w; y < y1; y += 4 * g->w)
+        memcpy(&g->out[y + x0], row, x1 - x0);
+}
+
+// the smallest rectangle holding both the dirty one and x0,y0..x1,y1
+static void stbi__gif_dirty(stbi__gif *g, int x0, int y0, int x1, int y1)
+{
+    if (x0 < g->dirty_x0) g->dirty_x0 = x0;
+    if (y0 < g->dirty_y0) g->dirty_y0 = y0;
+    if (x1 > g->dirty_x1) g->dirty_x1 = x1;
+    if (y1 > g->dirty_y1) g->dirty_y1 = y1;
 }
 
-// this function is designed to support animated gifs, although stb_image doesn't support it
+// decode the next frame onto the canvas g->out, which still holds the
+// frame before it, and note the rectangle of the canvas that changed.
+// Returns g->out, (stbi_uc *)s after the last frame, or NULL on error
 static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, int req_comp)
 {
     int i;
-    stbi_uc *prev_out = 0;
-
-    if (g->out == 0 && !stbi__gif_header(s, g, comp, 0))
-        return 0; // stbi__g_failure_reason set by stbi__gif_header
 
-    if (!stbi__mad3sizes_valid(g->w, g->h, 4, 0))
-        return stbi__errpuc("too large", "GIF too large");
+    if (g->frames == 0) {
+        if (!stbi__gif_header(s, g, comp, 0))
+            return 0; // stbi__g_failure_reason set by stbi__gif_header
 
-    prev_out = g->out;
-    g->out = (stbi_uc *)stbi__malloc_mad3(4, g->w, g->h, 0);
-    if (g->out == 0) return stbi__errpuc("outofmem", "Out of memory");
+        if (!stbi__mad3sizes_valid(g->w, g->h, 4, 0))
+            return stbi__errpuc("too large", "GIF too large");
 
-    switch ((g->eflags & 0x1C) >> 2) {
-    case 0: // unspecified (also always used on 1st frame)
+        if (g->out == 0) {
+            g->out = (stbi_uc *)stbi__malloc_mad3(4, g->w, g->h, 0);
+            if (g->out == 0) return stbi__errpuc("outofmem", "Out of memory");
+        }
         stbi__fill_gif_background(g, 0, 0, 4 * g->w, 4 * g->w * g->h);
-        break;
-    case 1: // do not dispose
-        if (prev_out) memcpy(g->out, prev_out, 4 * g->w * g->h);
-        g->old_out = prev_out;
-        break;
-    case 2: // dispose to background
-        if (prev_out) memcpy(g->out, prev_out, 4 * g->w * g->h);
-        stbi__fill_gif_background(g, g->start_x, g->start_y, g->max_x, g->max_y);
-        break;
-    case 3: // dispose to previous
-        if (g->old_out) {
-            for (i = g->start_y; i < g->max_y; i += 4 * g->w)
-                memcpy(&g->out[i + g->start_x], &g->old_out[i + g->start_x], g->max_x - g->start_x);
+        g->dirty_x0 = g->dirty_y0 = 0;
+        g->dirty_x1 = g->w;
+        g->dirty_y1 = g->h;
+        g->dispose = 0;
+    }
+    else {
+        // take the last frame away as its disposal method says; 0 and 1
+        // both leave it in place
+        g->dirty_x0 = g->w;
+        g->dirty_y0 = g->h;
+        g->dirty_x1 = g->dirty_y1 = 0;
+        if (g->dispose == 2 || (g->dispose == 3 && g->prev)) {
+            if (g->dispose == 2)
+                stbi__fill_gif_background(g, g->start_x, g->start_y, g->max_x, g->max_y);
+            else
+                for (i = g->start_y; i < g->max_y; i += 4 * g->w)
+                    memcpy(&g->out[i + g->start_x], &g->prev[i + g->start_x], g->max_x - g->start_x);
+            stbi__gif_dirty(g, g->start_x / 4, g->start_y / g->line_size, g->max_x / 4, g->max_y / g->line_size);
         }
-        break;
     }
+    // a graphic control extension only applies to the image after it
+    g->eflags = 0;
+    g->delay = 0;
 
     for (;;) {
         switch (stbi__get8(s)) {
@@ -6381,6 +10765,17 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
             g->cur_x = g->start_x;
             g->cur_y = g->start_y;
 
+            // keep what this frame is about to cover, if it's to be restored
+            g->dispose = (g->eflags & 0x1C) >> 2;
+            if (g->dispose == 3) {
+                if (g->prev == 0) {
+                    g->prev = (stbi_uc *)stbi__malloc_mad3(4, g->w, g->h, 0);
+                    if (g->prev == 0) return stbi__errpuc("outofmem", "Out of memory");
+                }
+                for (i = g->start_y; i < g->max_y; i += 4 * g->w)
+                    memcpy(&g->prev[i + g->start_x], &g->out[i + g->start_x], g->max_x - g->start_x);
+            }
+
             g->lflags = stbi__get8(s);
 
             if (g->lflags & 0x40) {
@@ -6412,6 +10807,8 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
             if (prev_trans != -1)
                 g->pal[g->transparent][3] = (stbi_uc)prev_trans;
 
+            stbi__gif_dirty(g, x, y, x + w, y + h);
+            ++g->frames;
             return o;
         }
 
@@ -6462,8 +10859,10 @@ static void *stbi__gif_load(stbi__context *s, int *x, int *y, int *comp, int req
             u = stbi__convert_format(u, 4, req_comp, g->w, g->h);
     }
     else if (g->out)
-        STBI_FREE(g->out);
-    STBI_FREE(g);
+        stbi__free(g->out);
+    stbi__free(g->prev);
+    stbi__free(g->idx);
+    stbi__free(g);
     return u;
 }
 
@@ -6471,6 +10870,120 @@ static int stbi__gif_info(stbi__context *s, int *x, int *y, int *comp)
 {
     return stbi__gif_info_raw(s, x, y, comp);
 }
+
+struct stbi_gif_anim
+{
+    stbi__context s;
+    stbi__gif g;
+    stbi_uc const *buffer;
+    int len;
+    stbi_uc *owned;         // the file's contents, if they were read in
+    int mapped;             // ... or mapped
+};
+
+STBIDEF stbi_gif_anim *stbi_gif_anim_open_memory(stbi_uc const *buffer, int len, int *x, int *y)
+{
+    stbi_gif_anim *a;
+    stbi__context s;
+    stbi__start_mem(&s, buffer, len);
+    if (!stbi__gif_info_raw(&s, x, y, NULL))
+        return NULL;
+    a = (stbi_gif_anim *)stbi__malloc(sizeof(*a));
+    if (a == NULL) {
+        stbi__err("outofmem", "Out of memory");
+        return NULL;
+    }
+    memset(a, 0, sizeof(*a));
+    a->buffer = buffer;
+    a->len = len;
+    stbi_gif_anim_rewind(a);
+    return a;
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_gif_anim *stbi_gif_anim_open(char const *filename, int *x, int *y)
+{
+    stbi_gif_anim *a;
+    stbi_uc *data;
+    long len;
+    FILE *f;
+#ifdef STBI__MMAP
+    stbi__map m;
+    if (stbi__map_file(&m, filename)) {
+        a = stbi_gif_anim_open_memory(m.data, m.len, x, y);
+        if (a)
+            a->mapped = 1;
+        else
+            stbi__unmap_file(&m);
+        return a;
+    }
+#endif
+    f = stbi__fopen(filename, "rb");
+    if (!f) {
+        stbi__err("can't fopen", "Unable to open file");
+        return NULL;
+    }
+    data = NULL;
+    if (fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) > 0 && len <= INT_MAX && fseek(f, 0, SEEK_SET) == 0) {
+        data = (stbi_uc *)stbi__malloc((size_t)len);
+        if (data && fread(data, 1, (size_t)len, f) != (size_t)len) {
+            stbi__free(data);
+            data = NULL;
+        }
+    }
+    fclose(f);
+    if (!data) {
+        stbi__err("can't read", "Unable to read file");
+        return NULL;
+    }
+    a = stbi_gif_anim_open_memory(data, (int)len, x, y);
+    if (a)
+        a->owned = data;
+    else
+        stbi__free(data);
+    return a;
+}
+#endif
+
+STBIDEF int stbi_gif_anim_next(stbi_gif_anim *anim, stbi_gif_frame *frame)
+{
+    stbi_uc *u = stbi__gif_load_next(&anim->s, &anim->g, NULL, 4);
+    if (u == (stbi_uc *)&anim->s) return 0;
+    if (u == NULL) return -1;
+    frame->pixels = u;
+    frame->x0 = anim->g.dirty_x0;
+    frame->y0 = anim->g.dirty_y0;
+    frame->x1 = anim->g.dirty_x1;
+    frame->y1 = anim->g.dirty_y1;
+    frame->delay = anim->g.delay;
+    frame->index = anim->g.frames - 1;
+    return 1;
+}
+
+// the canvas is kept; the first frame repaints all of it
+STBIDEF void stbi_gif_anim_rewind(stbi_gif_anim *anim)
+{
+    stbi__start_mem(&anim->s, anim->buffer, anim->len);
+    anim->g.frames = 0;
+}
+
+STBIDEF void stbi_gif_anim_close(stbi_gif_anim *anim)
+{
+    if (!anim) return;
+#ifdef STBI__MMAP
+    if (anim->mapped) {
+        stbi__map m;
+        m.data = (stbi_uc *)anim->buffer;
+        m.len = anim->len;
+        stbi__unmap_file(&m);
+    }
+#endif
+    stbi__free(anim->owned);
+    stbi__free(anim->g.out);
+    stbi__free(anim->g.prev);
+    stbi__free(anim->g.idx);
+    stbi__free(anim);
+}
 #endif
 
 // *************************************************************************************************
@@ -6549,6 +11062,50 @@ static void stbi__hdr_convert(float *output, stbi_uc *input, int req_comp)
     }
 }
 
+// a scanline's worth of stbi__hdr_convert
+static void stbi__hdr_convert_row(float *output, stbi_uc *input, int width, int req_comp, int simd)
+{
+    int i = 0;
+#ifdef STBI_SSE2
+    if (simd && req_comp >= 3) {
+        // scale by 2^(e-136) as 2^(e/2-68) * 2^(e-e/2-68): neither factor nor
+        // the first product is denormal, so this matches ldexp bit for bit
+        __m128i zero = _mm_setzero_si128();
+        __m128i bias = _mm_set1_epi32(127 - 68);
+        __m128 rgb = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+        __m128 alpha = _mm_set_ps(1.0f, 0, 0, 0);
+        // with 3 channels, each store spills into the next pixel, so stop
+        // short of the last one
+        int end = req_comp == 4 ? width : width - 1;
+        for (; i + 4 <= end; i += 4) {
+            __m128i px = _mm_loadu_si128((__m128i const *) (input + i * 4));
+            __m128i lo = _mm_unpacklo_epi8(px, zero);
+            __m128i hi = _mm_unpackhi_epi8(px, zero);
+            __m128i p[4];
+            int k;
+            p[0] = _mm_unpacklo_epi16(lo, zero);
+            p[1] = _mm_unpackhi_epi16(lo, zero);
+            p[2] = _mm_unpacklo_epi16(hi, zero);
+            p[3] = _mm_unpackhi_epi16(hi, zero);
+            for (k = 0; k < 4; ++k) {
+                __m128i e = _mm_shuffle_epi32(p[k], 0xff);
+                __m128i e1 = _mm_srli_epi32(e, 1);
+                __m128 f1 = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(e1, bias), 23));
+                __m128 f2 = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(_mm_sub_epi32(e, e1), bias), 23));
+                __m128 v = _mm_mul_ps(_mm_mul_ps(_mm_cvtepi32_ps(p[k]), f1), f2);
+                // an exponent of 0 is black
+                v = _mm_andnot_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(e, zero)), v);
+                _mm_storeu_ps(output + (i + k) * req_comp, _mm_or_ps(_mm_and_ps(v, rgb), alpha));
+            }
+        }
+    }
+#else
+    STBI_NOTUSED(simd);
+#endif
+    for (; i < width; ++i)
+        stbi__hdr_convert(output + i * req_comp, input + i * 4, req_comp);
+}
+
 static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
 {
     char buffer[STBI__HDR_BUFLEN];
@@ -6559,7 +11116,7 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
     float *hdr_data;
     int len;
     unsigned char count, value;
-    int i, j, k, c1, c2, z;
+    int i, j, k, c1, c2, z, simd = 0;
     const char *headerToken;
     STBI_NOTUSED(ri);
 
@@ -6618,6 +11175,9 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
     else {
         // Read RLE-encoded data
         scanline = NULL;
+#ifdef STBI_SSE2
+        simd = stbi__sse2_available();
+#endif
 
         for (j = 0; j < height; ++j) {
             c1 = stbi__get8(s);
@@ -6634,16 +11194,16 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
                 stbi__hdr_convert(hdr_data, rgbe, req_comp);
                 i = 1;
                 j = 0;
-                STBI_FREE(scanline);
+                stbi__free(scanline);
                 goto main_decode_loop; // yes, this makes no sense
             }
             len <<= 8;
             len |= stbi__get8(s);
-            if (len != width) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("invalid decoded scanline length", "corrupt HDR"); }
+            if (len != width) { stbi__free(hdr_data); stbi__free(scanline); return stbi__errpf("invalid decoded scanline length", "corrupt HDR"); }
             if (scanline == NULL) {
                 scanline = (stbi_uc *)stbi__malloc_mad2(width, 4, 0);
                 if (!scanline) {
-                    STBI_FREE(hdr_data);
+                    stbi__free(hdr_data);
                     return stbi__errpf("outofmem", "Out of memory");
                 }
             }
@@ -6657,23 +11217,22 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
                         // Run
                         value = stbi__get8(s);
                         count -= 128;
-                        if (count > nleft) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
+                        if (count > nleft) { stbi__free(hdr_data); stbi__free(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
                         for (z = 0; z < count; ++z)
                             scanline[i++ * 4 + k] = value;
                     }
                     else {
                         // Dump
-                        if (count > nleft) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
+                        if (count > nleft) { stbi__free(hdr_data); stbi__free(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
                         for (z = 0; z < count; ++z)
                             scanline[i++ * 4 + k] = stbi__get8(s);
                     }
                 }
             }
-            for (i = 0; i < width; ++i)
-                stbi__hdr_convert(hdr_data + (j*width + i)*req_comp, scanline + i * 4, req_comp);
+            stbi__hdr_convert_row(hdr_data + j*width*req_comp, scanline, width, req_comp, simd);
         }
         if (scanline)
-            STBI_FREE(scanline);
+            stbi__free(scanline);
     }
 
     return hdr_data;
@@ -6866,6 +11425,14 @@ static void *stbi__pnm_load(stbi__context *s, int *x, int *y, int *comp, int req
     if (!stbi__mad3sizes_valid(s->img_n, s->img_x, s->img_y, 0))
         return stbi__errpuc("too large", "PNM too large");
 
+    if (s->dest && (!req_comp || req_comp == s->img_n)) {
+        int j;
+        if (!stbi__dest_fits(s, s->img_x, s->img_y, s->img_n)) return stbi__errpuc("dest too small", "Destination too small");
+        for (j = 0; j < (int)s->img_y; ++j)
+            stbi__getn(s, stbi__dest_row(s, j), s->img_n * s->img_x);
+        return s->dest;
+    }
+
     out = (stbi_uc *)stbi__malloc_mad3(s->img_n, s->img_x, s->img_y, 0);
     if (!out) return stbi__errpuc("outofmem", "Out of memory");
     stbi__getn(s, out, s->img_n * s->img_x * s->img_y);
@@ -6874,113 +11441,405 @@ static void *stbi__pnm_load(stbi__context *s, int *x, int *y, int *comp, int req
         out = stbi__convert_format(out, s->img_n, req_comp, s->img_x, s->img_y);
         if (out == NULL) return out; // stbi__convert_format frees input on failure
     }
-    return out;
+    return out;
+}
+
+static int      stbi__pnm_isspace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+static void     stbi__pnm_skip_whitespace(stbi__context *s, char *c)
+{
+    for (;;) {
+        while (!stbi__at_eof(s) && stbi__pnm_isspace(*c))
+            *c = (char)stbi__get8(s);
+
+        if (stbi__at_eof(s) || *c != '#')
+            break;
+
+        while (!stbi__at_eof(s) && *c != '\n' && *c != '\r')
+            *c = (char)stbi__get8(s);
+    }
+}
+
+static int      stbi__pnm_isdigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static int      stbi__pnm_getinteger(stbi__context *s, char *c)
+{
+    int value = 0;
+
+    while (!stbi__at_eof(s) && stbi__pnm_isdigit(*c)) {
+        value = value * 10 + (*c - '0');
+        *c = (char)stbi__get8(s);
+    }
+
+    return value;
+}
+
+static int      stbi__pnm_info(stbi__context *s, int *x, int *y, int *comp)
+{
+    int maxv;
+    char c, p, t;
+
+    stbi__rewind(s);
+
+    // Get identifier
+    p = (char)stbi__get8(s);
+    t = (char)stbi__get8(s);
+    if (p != 'P' || (t != '5' && t != '6')) {
+        stbi__rewind(s);
+        return 0;
+    }
+
+    *comp = (t == '6') ? 3 : 1;  // '5' is 1-component .pgm; '6' is 3-component .ppm
+
+    c = (char)stbi__get8(s);
+    stbi__pnm_skip_whitespace(s, &c);
+
+    *x = stbi__pnm_getinteger(s, &c); // read width
+    stbi__pnm_skip_whitespace(s, &c);
+
+    *y = stbi__pnm_getinteger(s, &c); // read height
+    stbi__pnm_skip_whitespace(s, &c);
+
+    maxv = stbi__pnm_getinteger(s, &c);  // read max value
+
+    if (maxv > 255)
+        return stbi__err("max value > 255", "PPM image not 8-bit");
+    else
+        return 1;
+}
+#endif
+
+// *************************************************************************************************
+// QOI (Quite OK Image) loader and encoder
+//
+// QOI: https://qoiformat.org/qoi-specification.pdf
+//
+// The colorspace byte is informational only and is ignored. The encoder is
+// here so that images decoded once can be cached in a format that reloads
+// without inflate or unfiltering.
+
+#ifndef STBI_NO_QOI
+
+#define STBI__QOI_OP_RGB   0xfe
+#define STBI__QOI_OP_RGBA  0xff
+#define STBI__QOI_HEADER   14
+
+static stbi_uc const stbi__qoi_end[8] = { 0,0,0,0,0,0,0,1 };
+
+typedef struct
+{
+    stbi_uc index[64][4];   // previously seen pixels, by stbi__qoi_hash
+    stbi_uc px[4];          // the current pixel
+    int run;                // how many more times px repeats
+} stbi__qoi;
+
+static int stbi__qoi_hash(stbi_uc const *px)
+{
+    return (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) & 63;
+}
+
+static int stbi__qoi_test(stbi__context *s)
+{
+    int r = stbi__get8(s) == 'q' && stbi__get8(s) == 'o' && stbi__get8(s) == 'i' && stbi__get8(s) == 'f';
+    stbi__rewind(s);
+    return r;
+}
+
+static int stbi__qoi_info(stbi__context *s, int *x, int *y, int *comp)
+{
+    stbi__uint32 w, h;
+    int n, colorspace;
+    if (!stbi__qoi_test(s)) return 0;
+    stbi__skip(s, 4);
+    w = stbi__get32be(s);
+    h = stbi__get32be(s);
+    n = stbi__get8(s);
+    colorspace = stbi__get8(s);
+    if (w == 0 || h == 0 || w > INT_MAX || h > INT_MAX || (n != 3 && n != 4) || colorspace > 1) {
+        stbi__rewind(s);
+        return stbi__err("bad QOI header", "Corrupt QOI");
+    }
+    if (x) *x = (int)w;
+    if (y) *y = (int)h;
+    if (comp) *comp = n;
+    return 1;
+}
+
+// how many bytes the op starting with b1 takes
+static int stbi__qoi_op_len(int b1)
+{
+    if (b1 == STBI__QOI_OP_RGB) return 4;
+    if (b1 == STBI__QOI_OP_RGBA) return 5;
+    return (b1 & 0xc0) == 0x80 ? 2 : 1;
+}
+
+// apply the op at p to q; returns its length
+static int stbi__qoi_op(stbi__qoi *q, stbi_uc const *p)
+{
+    int b1 = p[0], len = 1;
+    if (b1 == STBI__QOI_OP_RGB) {
+        q->px[0] = p[1];
+        q->px[1] = p[2];
+        q->px[2] = p[3];
+        len = 4;
+    }
+    else if (b1 == STBI__QOI_OP_RGBA) {
+        memcpy(q->px, p + 1, 4);
+        len = 5;
+    }
+    else switch (b1 >> 6) {
+    case 0: // index
+        memcpy(q->px, q->index[b1], 4);
+        return 1;
+    case 1: { // small difference from the last pixel
+        q->px[0] = (stbi_uc)(q->px[0] + ((b1 >> 4) & 3) - 2);
+        q->px[1] = (stbi_uc)(q->px[1] + ((b1 >> 2) & 3) - 2);
+        q->px[2] = (stbi_uc)(q->px[2] + (b1 & 3) - 2);
+        break;
+    }
+    case 2: { // green difference, red and blue relative to it
+        int vg = (b1 & 0x3f) - 32;
+        q->px[0] = (stbi_uc)(q->px[0] + vg - 8 + (p[1] >> 4));
+        q->px[1] = (stbi_uc)(q->px[1] + vg);
+        q->px[2] = (stbi_uc)(q->px[2] + vg - 8 + (p[1] & 15));
+        len = 2;
+        break;
+    }
+    default: // run; this pixel plus b1&63 more
+        q->run = b1 & 0x3f;
+        break;
+    }
+    memcpy(q->index[stbi__qoi_hash(q->px)], q->px, 4);
+    return len;
+}
+
+// decode the next 'count' pixels as n-channel (3 or 4) pixels into out;
+// returns 0 if the data ends first
+static int stbi__qoi_pixels(stbi__context *s, stbi__qoi *q, stbi_uc *out, int n, int count)
+{
+    int i = 0;
+    while (i < count) {
+        if (q->run) {
+            int k = q->run < count - i ? q->run : count - i;
+            q->run -= k;
+            i += k;
+            if (n == 4)
+                for (; k > 0; --k, out += 4) memcpy(out, q->px, 4);
+            else
+                for (; k > 0; --k, out += 3) memcpy(out, q->px, 3);
+            continue;
+        }
+        if (s->img_buffer_end - s->img_buffer >= 5)
+            s->img_buffer += stbi__qoi_op(q, s->img_buffer);
+        else {
+            // near the end of the buffer, or of the data
+            stbi_uc op[5];
+            int k, len;
+            if (stbi__at_eof(s)) return 0;
+            op[0] = stbi__get8(s);
+            len = stbi__qoi_op_len(op[0]);
+            for (k = 1; k < len; ++k) {
+                if (stbi__at_eof(s)) return 0;
+                op[k] = stbi__get8(s);
+            }
+            stbi__qoi_op(q, op);
+        }
+        if (n == 4) memcpy(out, q->px, 4);
+        else        memcpy(out, q->px, 3);
+        out += n;
+        ++i;
+    }
+    return 1;
 }
 
-static int      stbi__pnm_isspace(char c)
+static void *stbi__qoi_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
 {
-    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
-}
+    stbi__qoi q;
+    stbi_uc *out;
+    int w, h, n, out_n;
+    STBI_NOTUSED(ri);
 
-static void     stbi__pnm_skip_whitespace(stbi__context *s, char *c)
-{
-    for (;;) {
-        while (!stbi__at_eof(s) && stbi__pnm_isspace(*c))
-            *c = (char)stbi__get8(s);
+    if (!stbi__qoi_info(s, &w, &h, &n)) return NULL;
+    if (!stbi__mad3sizes_valid(4, w, h, 0)) return stbi__errpuc("too large", "QOI too large");
+    s->img_x = w;
+    s->img_y = h;
+    s->img_n = n;
+    *x = w;
+    *y = h;
+    *comp = n;
 
-        if (stbi__at_eof(s) || *c != '#')
-            break;
+    memset(&q, 0, sizeof(q));
+    q.px[3] = 255;
 
-        while (!stbi__at_eof(s) && *c != '\n' && *c != '\r')
-            *c = (char)stbi__get8(s);
-    }
-}
+    // the decoder writes 3 or 4 channels; grey is converted afterwards
+    out_n = (req_comp == 3 || req_comp == 4) ? req_comp : n;
 
-static int      stbi__pnm_isdigit(char c)
-{
-    return c >= '0' && c <= '9';
-}
+    if (s->dest && (!req_comp || req_comp == out_n)) {
+        int j;
+        if (!stbi__dest_fits(s, w, h, out_n)) return stbi__errpuc("dest too small", "Destination too small");
+        for (j = 0; j < h; ++j)
+            if (!stbi__qoi_pixels(s, &q, stbi__dest_row(s, j), out_n, w))
+                return stbi__errpuc("corrupt", "Corrupt QOI");
+        return s->dest;
+    }
 
-static int      stbi__pnm_getinteger(stbi__context *s, char *c)
-{
-    int value = 0;
+    out = (stbi_uc *)stbi__malloc_mad3(out_n, w, h, 0);
+    if (!out) return stbi__errpuc("outofmem", "Out of memory");
+    if (!stbi__qoi_pixels(s, &q, out, out_n, w * h)) {
+        STBI_FREE(out);
+        return stbi__errpuc("corrupt", "Corrupt QOI");
+    }
 
-    while (!stbi__at_eof(s) && stbi__pnm_isdigit(*c)) {
-        value = value * 10 + (*c - '0');
-        *c = (char)stbi__get8(s);
+    if (req_comp && req_comp != out_n) {
+        out = stbi__convert_format(out, out_n, req_comp, w, h);
+        if (out == NULL) return out; // stbi__convert_format frees input on failure
     }
+    return out;
+}
 
-    return value;
+static void stbi__qoi_put32(stbi_uc *p, stbi__uint32 v)
+{
+    p[0] = (stbi_uc)(v >> 24);
+    p[1] = (stbi_uc)(v >> 16);
+    p[2] = (stbi_uc)(v >> 8);
+    p[3] = (stbi_uc)v;
 }
 
-static int      stbi__pnm_info(stbi__context *s, int *x, int *y, int *comp)
+STBIDEF stbi_uc *stbi_qoi_encode(stbi_uc const *pixels, int x, int y, int comp, int *out_len)
 {
-    int maxv;
-    char c, p, t;
+    stbi_uc index[64][4], px[4], prev[4];
+    stbi_uc *out, *o;
+    int i, count, run = 0;
 
-    stbi__rewind(s);
+    if (x <= 0 || y <= 0 || (comp != 3 && comp != 4)) return stbi__errpuc("bad parameters", "QOI needs 3 or 4 channels");
+    // worst case is an RGBA op for every pixel
+    if (!stbi__mad3sizes_valid(x, y, comp + 1, STBI__QOI_HEADER + 8)) return stbi__errpuc("too large", "Image too large to encode");
+    out = (stbi_uc *)stbi__malloc_mad3(x, y, comp + 1, STBI__QOI_HEADER + 8);
+    if (!out) return stbi__errpuc("outofmem", "Out of memory");
 
-    // Get identifier
-    p = (char)stbi__get8(s);
-    t = (char)stbi__get8(s);
-    if (p != 'P' || (t != '5' && t != '6')) {
-        stbi__rewind(s);
-        return 0;
+    memcpy(out, "qoif", 4);
+    stbi__qoi_put32(out + 4, (stbi__uint32)x);
+    stbi__qoi_put32(out + 8, (stbi__uint32)y);
+    out[12] = (stbi_uc)comp;
+    out[13] = 0; // sRGB with linear alpha
+    o = out + STBI__QOI_HEADER;
+
+    memset(index, 0, sizeof(index));
+    prev[0] = prev[1] = prev[2] = 0;
+    prev[3] = 255;
+    px[3] = 255;
+    count = x * y;
+    for (i = 0; i < count; ++i, pixels += comp) {
+        memcpy(px, pixels, comp);
+        if (memcmp(px, prev, 4) == 0) {
+            if (++run == 62 || i + 1 == count) {
+                *o++ = (stbi_uc)(0xc0 | (run - 1));
+                run = 0;
+            }
+            continue;
+        }
+        if (run) {
+            *o++ = (stbi_uc)(0xc0 | (run - 1));
+            run = 0;
+        }
+        {
+            int h = stbi__qoi_hash(px);
+            if (memcmp(index[h], px, 4) == 0)
+                *o++ = (stbi_uc)h;
+            else {
+                memcpy(index[h], px, 4);
+                if (px[3] == prev[3]) {
+                    int vr = (signed char)(px[0] - prev[0]);
+                    int vg = (signed char)(px[1] - prev[1]);
+                    int vb = (signed char)(px[2] - prev[2]);
+                    int vg_r = vr - vg, vg_b = vb - vg;
+                    if (vr >= -2 && vr <= 1 && vg >= -2 && vg <= 1 && vb >= -2 && vb <= 1)
+                        *o++ = (stbi_uc)(0x40 | ((vr + 2) << 4) | ((vg + 2) << 2) | (vb + 2));
+                    else if (vg_r >= -8 && vg_r <= 7 && vg >= -32 && vg <= 31 && vg_b >= -8 && vg_b <= 7) {
+                        *o++ = (stbi_uc)(0x80 | (vg + 32));
+                        *o++ = (stbi_uc)(((vg_r + 8) << 4) | (vg_b + 8));
+                    }
+                    else {
+                        *o++ = STBI__QOI_OP_RGB;
+                        memcpy(o, px, 3);
+                        o += 3;
+                    }
+                }
+                else {
+                    *o++ = STBI__QOI_OP_RGBA;
+                    memcpy(o, px, 4);
+                    o += 4;
+                }
+            }
+        }
+        memcpy(prev, px, 4);
     }
+    memcpy(o, stbi__qoi_end, 8);
+    o += 8;
 
-    *comp = (t == '6') ? 3 : 1;  // '5' is 1-component .pgm; '6' is 3-component .ppm
-
-    c = (char)stbi__get8(s);
-    stbi__pnm_skip_whitespace(s, &c);
-
-    *x = stbi__pnm_getinteger(s, &c); // read width
-    stbi__pnm_skip_whitespace(s, &c);
-
-    *y = stbi__pnm_getinteger(s, &c); // read height
-    stbi__pnm_skip_whitespace(s, &c);
-
-    maxv = stbi__pnm_getinteger(s, &c);  // read max value
+    *out_len = (int)(o - out);
+    return out;
+}
 
-    if (maxv > 255)
-        return stbi__err("max value > 255", "PPM image not 8-bit");
-    else
-        return 1;
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_qoi_write(char const *filename, stbi_uc const *pixels, int x, int y, int comp)
+{
+    FILE *f;
+    int len, ok;
+    stbi_uc *data = stbi_qoi_encode(pixels, x, y, comp, &len);
+    if (!data) return 0;
+    f = stbi__fopen(filename, "wb");
+    if (!f) {
+        stbi__free(data);
+        return stbi__err("can't fopen", "Unable to open file");
+    }
+    ok = fwrite(data, 1, len, f) == (size_t)len;
+    ok = fclose(f) == 0 && ok;
+    stbi__free(data);
+    return ok ? 1 : stbi__err("can't write", "Unable to write file");
 }
 #endif
 
+#endif // STBI_NO_QOI
+
 static int stbi__info_main(stbi__context *s, int *x, int *y, int *comp)
 {
+    // see stbi__load_main
+    switch (stbi__peek8(s)) {
 #ifndef STBI_NO_JPEG
-    if (stbi__jpeg_info(s, x, y, comp)) return 1;
+    case 0xff: if (stbi__jpeg_info(s, x, y, comp)) return 1; break;
 #endif
-
 #ifndef STBI_NO_PNG
-    if (stbi__png_info(s, x, y, comp))  return 1;
+    case 0x89: if (stbi__png_info(s, x, y, comp))  return 1; break;
 #endif
-
 #ifndef STBI_NO_GIF
-    if (stbi__gif_info(s, x, y, comp))  return 1;
+    case 'G':  if (stbi__gif_info(s, x, y, comp))  return 1; break;
 #endif
-
 #ifndef STBI_NO_BMP
-    if (stbi__bmp_info(s, x, y, comp))  return 1;
+    case 'B':  if (stbi__bmp_info(s, x, y, comp))  return 1; break;
 #endif
-
 #ifndef STBI_NO_PSD
-    if (stbi__psd_info(s, x, y, comp))  return 1;
+    case '8':  if (stbi__psd_info(s, x, y, comp))  return 1; break;
 #endif
-
 #ifndef STBI_NO_PIC
-    if (stbi__pic_info(s, x, y, comp))  return 1;
+    case 0x53: if (stbi__pic_info(s, x, y, comp))  return 1; break;
 #endif
-
 #ifndef STBI_NO_PNM
-    if (stbi__pnm_info(s, x, y, comp))  return 1;
+    case 'P':  if (stbi__pnm_info(s, x, y, comp))  return 1; break;
+#endif
+#ifndef STBI_NO_QOI
+    case 'q':  if (stbi__qoi_info(s, x, y, comp))  return 1; break;
 #endif
-
 #ifndef STBI_NO_HDR
-    if (stbi__hdr_info(s, x, y, comp))  return 1;
+    case '#':  if (stbi__hdr_info(s, x, y, comp))  return 1; break;
 #endif
+    }
 
     // test tga last because it's a crappy test!
 #ifndef STBI_NO_TGA
@@ -6993,8 +11852,17 @@ static int stbi__info_main(stbi__context *s, int *x, int *y, int *comp)
 #ifndef STBI_NO_STDIO
 STBIDEF int stbi_info(char const *filename, int *x, int *y, int *comp)
 {
-    FILE *f = stbi__fopen(filename, "rb");
+    FILE *f;
     int result;
+#ifdef STBI__MMAP
+    stbi__map m;
+    if (stbi__map_file(&m, filename)) {
+        result = stbi_info_from_memory(m.data, m.len, x, y, comp);
+        stbi__unmap_file(&m);
+        return result;
+    }
+#endif
+    f = stbi__fopen(filename, "rb");
     if (!f) return stbi__err("can't fopen", "Unable to open file");
     result = stbi_info_from_file(f, x, y, comp);
     fclose(f);
@@ -7020,6 +11888,28 @@ STBIDEF int stbi_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y
     return stbi__info_main(&s, x, y, comp);
 }
 
+STBIDEF void stbi_load_options_init(stbi_load_options *options)
+{
+    memset(options, 0, sizeof(*options));
+    options->flip_vertically = stbi__vertically_flip_on_load;
+#ifndef STBI_NO_PNG
+    options->unpremultiply = stbi__unpremultiply_on_load;
+    options->convert_iphone_png_to_rgb = stbi__de_iphone_flag;
+    options->png_verify_checksums = stbi__png_verify_flag;
+    options->png_inflate_buffer = stbi__png_inflate_buffer;
+    options->png_inflate_buffer_size = (int)stbi__png_inflate_buffer_size;
+#endif
+#ifndef STBI_NO_LINEAR
+    options->ldr_to_hdr_gamma = stbi__l2h_gamma;
+    options->ldr_to_hdr_scale = stbi__l2h_scale;
+#else
+    options->ldr_to_hdr_gamma = 2.2f;
+    options->ldr_to_hdr_scale = 1.0f;
+#endif
+    options->hdr_to_ldr_gamma = 1 / stbi__h2l_gamma_i;
+    options->hdr_to_ldr_scale = 1 / stbi__h2l_scale_i;
+}
+
 STBIDEF int stbi_info_from_callbacks(stbi_io_callbacks const *c, void *user, int *x, int *y, int *comp)
 {
     stbi__context s;
@@ -7027,6 +11917,425 @@ STBIDEF int stbi_info_from_callbacks(stbi_io_callbacks const *c, void *user, int
     return stbi__info_main(&s, x, y, comp);
 }
 
+#if !defined(STBI_NO_PNM) || !defined(STBI_NO_BMP) || !defined(STBI_NO_TGA)
+// point v at pixels stored from buffer[start] on, 'align'-padded rows,
+// if they are complete and in a layout the caller accepts
+static int stbi__view_stored(stbi_image_view *v, stbi_uc const *buffer, int len, int start, int x, int y, int n, int align, int bottom_up, int bgr, int flags, int req_comp)
+{
+    int stride;
+    if (x <= 0 || y <= 0 || (req_comp && req_comp != n)) return 0;
+    if (bgr && !(flags & STBI_VIEW_ALLOW_BGR)) return 0;
+    if (bottom_up && !(flags & STBI_VIEW_ALLOW_BOTTOM_UP)) return 0;
+    if (!stbi__mad3sizes_valid(n, x, y, 0) || !stbi__addsizes_valid(n * x, align - 1)) return 0;
+    stride = (n * x + align - 1) & ~(align - 1);
+    if (start < 0 || start > len || (stbi__uint64)stride * (y - 1) + (stbi__uint64)(n * x) > (stbi__uint64)(len - start))
+        return 0;
+
+    v->data = buffer + start + (bottom_up ? (size_t)stride * (y - 1) : 0);
+    v->x = x;
+    v->y = y;
+    v->channels = n;
+    v->stride = bottom_up ? -stride : stride;
+    v->bgr = bgr;
+    v->zero_copy = 1;
+    return 1;
+}
+#endif
+
+// fill in a zero-copy view if the loader stbi__load_main would pick for
+// this file returns its pixels unchanged
+static int stbi__view_find(stbi_image_view *v, stbi_uc const *buffer, int len, int req_comp, int flags)
+{
+    stbi__context s;
+#if defined(STBI_NO_PNM) && defined(STBI_NO_BMP) && defined(STBI_NO_TGA)
+    STBI_NOTUSED(v);
+    STBI_NOTUSED(req_comp);
+    STBI_NOTUSED(flags);
+#endif
+    if (len < 2) return 0;
+    stbi__start_mem(&s, buffer, len);
+    switch (buffer[0]) {
+    case 'P':
+#ifndef STBI_NO_PNM
+        {
+            int x, y, n;
+            // the loader reads pixels right after the header
+            if (stbi__pnm_test(&s) && stbi__pnm_info(&s, &x, &y, &n))
+                return stbi__view_stored(v, buffer, len, (int)(s.img_buffer - buffer), x, y, n, 1, 0, 0, flags, req_comp);
+        }
+#endif
+        return 0;
+
+    case 'B':
+#ifndef STBI_NO_BMP
+        {
+            stbi__bmp_data info;
+            int x, y, n, i, j;
+            info.all_a = 255;
+            if (stbi__bmp_parse_header(&s, &info) == NULL) return 0;
+            if (info.offset < 14 + info.hsz || info.offset > len) return 0;
+            if (info.bpp == 24 && !info.ma)
+                n = 3;
+            else if (info.bpp == 32 && info.mb == 0xff && info.mg == 0xff00 && info.mr == 0x00ff0000 && info.ma == 0xff000000)
+                n = 4;
+            else
+                return 0;
+            x = (int)s.img_x;
+            y = abs((int)s.img_y);
+            if (!stbi__view_stored(v, buffer, len, (int)(s.img_buffer - buffer) + info.offset - 14 - info.hsz, x, y, n, 4, (int)s.img_y > 0, 1, flags, req_comp))
+                return 0;
+            if (n == 4) {
+                // the loader turns an all-zero alpha channel opaque
+                for (j = 0; j < y; ++j) {
+                    stbi_uc const *p = v->data + (ptrdiff_t)j * v->stride;
+                    for (i = 0; i < x; ++i)
+                        if (p[i * 4 + 3]) return 1;
+                }
+                memset(v, 0, sizeof(*v));
+                return 0;
+            }
+            return 1;
+        }
+#endif
+        return 0;
+
+    // other formats' signatures; stbi__load_main tries those first
+    case 0xff: case 0x89: case 'G': case '8': case 0x53: case '#': case 'q':
+        return 0;
+
+    default:
+#ifndef STBI_NO_TGA
+        if (stbi__tga_test(&s)) {
+            int id_len, indexed, type, x, y, bpp, desc, n, rgb16;
+            id_len = stbi__get8(&s);
+            indexed = stbi__get8(&s);
+            type = stbi__get8(&s);
+            stbi__skip(&s, 9);
+            x = stbi__get16le(&s);
+            y = stbi__get16le(&s);
+            bpp = stbi__get8(&s);
+            desc = stbi__get8(&s);
+            n = stbi__tga_get_comp(bpp, type == 3, &rgb16);
+            // the loader reads these straight after the ID field, then swaps to RGB
+            if (!indexed && (type == 2 || type == 3) && n && !rgb16)
+                return stbi__view_stored(v, buffer, len, 18 + id_len, x, y, n, 1, !((desc >> 5) & 1), n >= 3, flags, req_comp);
+        }
+#endif
+        return 0;
+    }
+}
+
+static void stbi__view_options(stbi_load_options *options, int desired_channels)
+{
+    stbi_load_options_init(options);
+    options->desired_channels = desired_channels;
+    options->flip_vertically = 0;
+}
+
+// decode into a copy the view owns
+static int stbi__view_decode(stbi__context *s, int desired_channels, stbi_image_view *view)
+{
+    stbi_load_options options;
+    stbi__ex_scope scope;
+    stbi_uc *pixels;
+    stbi__view_options(&options, desired_channels);
+    // only the PNG decoder sets this, and it counts the alpha a tRNS chunk
+    // adds, which 'channels_in_file' doesn't
+    s->img_out_n = 0;
+    stbi__ex_begin(&scope, &options);
+    pixels = stbi__load_and_postprocess_8bit(s, &view->x, &view->y, &view->channels, desired_channels);
+    stbi__ex_end(&scope, &options, pixels);
+    if (!pixels) return 0;
+    if (desired_channels) view->channels = desired_channels;
+    else if (s->img_out_n) view->channels = s->img_out_n;
+    view->data = pixels;
+    view->stride = view->x * view->channels;
+    view->private_pixels = pixels;
+    return 1;
+}
+
+STBIDEF int stbi_view_from_memory(stbi_uc const *buffer, int len, int desired_channels, int flags, stbi_image_view *view)
+{
+    stbi__context s;
+    memset(view, 0, sizeof(*view));
+    if (stbi__view_find(view, buffer, len, desired_channels, flags))
+        return 1;
+    stbi__start_mem(&s, buffer, len);
+    return stbi__view_decode(&s, desired_channels, view);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_view(char const *filename, int desired_channels, int flags, stbi_image_view *view)
+{
+    FILE *f;
+    stbi__context s;
+    int result;
+#ifdef STBI__MMAP
+    stbi__map m;
+    if (stbi__map_file(&m, filename)) {
+        int result = stbi_view_from_memory(m.data, m.len, desired_channels, flags, view);
+        if (view->zero_copy) {
+            view->private_map = m.data;
+            view->private_map_len = m.len;
+        }
+        else
+            stbi__unmap_file(&m);
+        return result;
+    }
+#else
+    STBI_NOTUSED(flags);
+#endif
+    memset(view, 0, sizeof(*view));
+    f = stbi__fopen(filename, "rb");
+    if (!f) return stbi__err("can't fopen", "Unable to open file");
+    stbi__start_file(&s, f);
+    result = stbi__view_decode(&s, desired_channels, view);
+    fclose(f);
+    return result;
+}
+#endif
+
+STBIDEF void stbi_view_free(stbi_image_view *view)
+{
+#ifdef STBI__MMAP
+    if (view->private_map) {
+        stbi__map m;
+        m.data = (stbi_uc *)view->private_map;
+        m.len = view->private_map_len;
+        stbi__unmap_file(&m);
+    }
+#endif
+    if (view->private_pixels)
+        stbi_image_free(view->private_pixels);
+    memset(view, 0, sizeof(*view));
+}
+
+typedef struct
+{
+    stbi_batch_item const *items;
+    int count;
+    volatile long next;
+    volatile long succeeded;
+    stbi_load_options const *options;   // NULL for an info batch
+    stbi_batch_callback *callback;
+    void *user;
+} stbi__batch;
+
+static void stbi__batch_run(stbi__batch *b, int index, stbi_allocator const *allocator)
+{
+    stbi_batch_item const *item = &b->items[index];
+    stbi_load_options options;
+    stbi_batch_result r;
+    int ok;
+    memset(&r, 0, sizeof(r));
+    if (b->options) {
+        options = *b->options;
+        options.allocator = allocator;
+    }
+    if (!item->filename) {
+        if (b->options)
+            ok = (r.pixels = stbi_load_from_memory_ex(item->buffer, item->len, &r.x, &r.y, &r.channels_in_file, &options)) != NULL;
+        else
+            ok = stbi_info_from_memory(item->buffer, item->len, &r.x, &r.y, &r.channels_in_file);
+    }
+    else {
+#ifndef STBI_NO_STDIO
+        if (b->options)
+            ok = (r.pixels = stbi_load_ex(item->filename, &r.x, &r.y, &r.channels_in_file, &options)) != NULL;
+        else
+            ok = stbi_info(item->filename, &r.x, &r.y, &r.channels_in_file);
+#else
+        ok = stbi__err("no stdio", "Loading files requires stdio");
+#endif
+    }
+    r.ok = ok;
+    r.failure_reason = ok ? NULL : stbi__g_failure_reason;
+    if (ok) stbi__fetch_inc(&b->succeeded);
+    b->callback(b->user, index, &r);
+}
+
+// one worker: pull items off the shared counter until there are none left
+static void stbi__batch_task(void *data, int worker)
+{
+    stbi__batch *b = (stbi__batch *)data;
+    stbi_arena arena;
+    stbi_allocator allocator;
+    int i;
+#ifdef STBI_THREADS
+    int was_worker = stbi__batch_worker;
+    stbi__batch_worker = 1;
+#endif
+    STBI_NOTUSED(worker);
+    stbi_arena_init(&arena, NULL, 0, 1);
+    allocator = stbi_arena_allocator(&arena);
+    while ((i = stbi__fetch_inc(&b->next)) < b->count)
+        stbi__batch_run(b, i, &allocator);
+    stbi_arena_free(&arena);
+#ifdef STBI_THREADS
+    stbi__batch_worker = was_worker;
+#endif
+}
+
+static int stbi__batch_main(stbi_batch_item const *items, int count, stbi_load_options const *options, stbi_batch_callback *callback, void *user)
+{
+    stbi__batch b;
+    int workers = 1;
+    if (count <= 0) return 0;
+    b.items = items;
+    b.count = count;
+    b.next = 0;
+    b.succeeded = 0;
+    b.options = options;
+    b.callback = callback;
+    b.user = user;
+#ifdef STBI_THREADS
+    workers = stbi__threads_available();
+    if (workers > count) workers = count;
+#endif
+    stbi__parallel_for(stbi__batch_task, &b, workers, 1);
+    return (int)b.succeeded;
+}
+
+STBIDEF int stbi_info_batch(stbi_batch_item const *items, int count, stbi_batch_callback *callback, void *user)
+{
+    return stbi__batch_main(items, count, NULL, callback, user);
+}
+
+STBIDEF int stbi_load_batch(stbi_batch_item const *items, int count, stbi_load_options const *options, stbi_batch_callback *callback, void *user)
+{
+    stbi_load_options defaults;
+    if (!options) {
+        stbi_load_options_init(&defaults);
+        options = &defaults;
+    }
+    return stbi__batch_main(items, count, options, callback, user);
+}
+
+// the loaders that can stream send rows themselves and return s->rows;
+// anything else comes back whole and is sent in one go. A loader that
+// fails only because stbi__rows_send told it to stop after the last row
+// has succeeded
+static int stbi__load_rows_main(stbi__context *s, int req_comp, stbi_row_callbacks const *callbacks, void *user)
+{
+    stbi__result_info ri;
+    void *result;
+    int x, y, comp, ok = 1;
+    s->rows = callbacks;
+    s->rows_user = user;
+    s->rows_buf = NULL;
+    s->rows_buf_len = 0;
+    s->rows_left = -1;
+    result = stbi__load_main(s, &x, &y, &comp, req_comp, &ri, 8);
+    if (result == NULL)
+        ok = s->rows_left == 0;
+    else if (result != (void *)callbacks) {
+        int n = req_comp ? req_comp : comp;
+        if (ri.bits_per_channel != 8)
+            result = stbi__convert_16_to_8((stbi__uint16 *)result, x, y, n);
+        if (result && stbi__rows_begin(s, x, y, comp, n))
+            stbi__rows_send(s, 0, y, (stbi_uc *)result, x * n, 0, n, n);
+        ok = s->rows_left == 0;
+        stbi__free(result);
+    }
+    stbi__free(s->rows_buf);
+    return ok;
+}
+
+// stbi_load*_ex with a region: collect the rows stbi__rows_send cuts out
+typedef struct
+{
+    stbi_uc *out;
+    int x, y, comp, n;
+} stbi__region;
+
+static int stbi__region_begin(void *user, int x, int y, int channels_in_file, int channels)
+{
+    stbi__region *r = (stbi__region *)user;
+    r->x = x;
+    r->y = y;
+    r->comp = channels_in_file;
+    r->n = channels;
+    r->out = (stbi_uc *)stbi__malloc_mad3(x, y, channels, 0);
+    return r->out != NULL;
+}
+
+static int stbi__region_rows(void *user, int y, int count, stbi_uc const *pixels, int stride)
+{
+    stbi__region *r = (stbi__region *)user;
+    int j;
+    for (j = 0; j < count; ++j)
+        memcpy(r->out + (size_t)(y + j) * r->x * r->n, pixels + (ptrdiff_t)j * stride, (size_t)r->x * r->n);
+    return 1;
+}
+
+static stbi_uc *stbi__load_region(stbi__context *s, int *x, int *y, int *comp, int req_comp)
+{
+    static stbi_row_callbacks const callbacks = { stbi__region_begin, stbi__region_rows };
+    stbi__region r;
+    r.out = NULL;
+    r.x = 0;
+    if (!stbi__load_rows_main(s, req_comp, &callbacks, &r)) {
+        stbi__free(r.out);
+        return r.x && !r.out ? stbi__errpuc("outofmem", "Out of memory") : NULL;
+    }
+    *x = r.x;
+    *y = r.y;
+    if (comp) *comp = r.comp;
+    return r.out;
+}
+
+static int stbi__load_rows_ex(stbi__context *s, stbi_load_options const *options, stbi_row_callbacks const *callbacks, void *user)
+{
+    stbi_load_options o;
+    stbi__ex_scope scope;
+    int ok;
+    if (options)
+        o = *options;
+    else
+        stbi_load_options_init(&o);
+    stbi__ex_begin(&scope, &o);
+    ok = stbi__load_rows_main(s, o.desired_channels, callbacks, user);
+    stbi__ex_end(&scope, &o, ok ? (void *)callbacks : NULL);
+    return ok;
+}
+
+STBIDEF int stbi_load_rows_from_memory(stbi_uc const *buffer, int len, stbi_load_options const *options, stbi_row_callbacks const *callbacks, void *user)
+{
+    stbi__context s;
+    stbi__start_mem(&s, buffer, len);
+    return stbi__load_rows_ex(&s, options, callbacks, user);
+}
+
+STBIDEF int stbi_load_rows_from_callbacks(stbi_io_callbacks const *clbk, void *io_user, stbi_load_options const *options, stbi_row_callbacks const *callbacks, void *user)
+{
+    stbi__context s;
+    stbi__start_callbacks(&s, (stbi_io_callbacks *)clbk, io_user);
+    return stbi__load_rows_ex(&s, options, callbacks, user);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_rows(char const *filename, stbi_load_options const *options, stbi_row_callbacks const *callbacks, void *user)
+{
+    FILE *f;
+    int result;
+    stbi__context s;
+#ifdef STBI__MMAP
+    stbi__map m;
+    if (stbi__map_file(&m, filename)) {
+        result = stbi_load_rows_from_memory(m.data, m.len, options, callbacks, user);
+        stbi__unmap_file(&m);
+        return result;
+    }
+#endif
+    f = stbi__fopen(filename, "rb");
+    if (!f) return stbi__err("can't fopen", "Unable to open file");
+    stbi__start_file(&s, f);
+    result = stbi__load_rows_ex(&s, options, callbacks, user);
+    fclose(f);
+    return result;
+}
+#endif
+
 #endif // STB_IMAGE_IMPLEMENTATION
 
 /*